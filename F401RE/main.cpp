@@ -109,36 +109,23 @@ struct SerialPrinter: Printer {
 	}
 }static serialPrinter;
 
+// Step and direction pins of all steppers, i-th pin belongs to i-th stepper.
+// Every GPIO port is written with a single BSRR write per tick.
+using StepPins = PinGroup<PC_1, PA_4, PA_0, PC_2, PC_10>;
+using DirPins = PinGroup<PC_0, PB_0, PA_1, PC_3, PC_12>;
+
+// Steppers with inverted direction: 0, 1, 3 and 4.
+static const uint32_t invertedDirs = 0x1B;
+
 struct Motor {
-	FORCE_INLINE void writeStep(StepperNumber<0>, bool lvl) {
-		Step0 = lvl;
-	}
-	FORCE_INLINE void writeStep(StepperNumber<1>, bool lvl) {
-		Step1 = lvl;
-	}
-	FORCE_INLINE void writeStep(StepperNumber<2>, bool lvl) {
-		Step2 = lvl;
-	}
-	FORCE_INLINE void writeStep(StepperNumber<3>, bool lvl) {
-		Step3 = lvl;
+	FORCE_INLINE void writeSteps(uint32_t bits) {
+		StepPins::set(bits);
 	}
-	FORCE_INLINE void writeStep(StepperNumber<4>, bool lvl) {
-		Step4 = lvl;
+	FORCE_INLINE void clearSteps(uint32_t bits) {
+		StepPins::clear(bits);
 	}
-	FORCE_INLINE void writeDirection(StepperNumber<0>, bool dir) {
-		Dir0 = !dir;
-	}
-	FORCE_INLINE void writeDirection(StepperNumber<1>, bool dir) {
-		Dir1 = !dir;
-	}
-	FORCE_INLINE void writeDirection(StepperNumber<2>, bool dir) {
-		Dir2 = dir;
-	}
-	FORCE_INLINE void writeDirection(StepperNumber<3>, bool dir) {
-		Dir3 = !dir;
-	}
-	FORCE_INLINE void writeDirection(StepperNumber<4>, bool dir) {
-		Dir4 = !dir;
+	FORCE_INLINE void writeDirections(uint32_t bits) {
+		DirPins::write(bits ^ invertedDirs);
 	}
 
 	FORCE_INLINE void begin() {
@@ -216,9 +203,12 @@ static void execute() {
 		while (pc.readable()) {
 			if (fgets(buffer, bufferSize, pc)) {
 				parser.parseLine(buffer);
+				interpreter.printAcknowledgement();
 			}
 		}
 
+		interpreter.poll();
+
 		if (executor.currentTick() >= nextNotifyTick) {
 			interpreter.printCurrentPosition();
 			nextNotifyTick = executor.currentTick() + notifyInterval;
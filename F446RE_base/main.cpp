@@ -214,9 +214,12 @@ static void execute() {
 		while (pc.readable()) {
 			if (fgets(buffer, bufferSize, pc)) {
 				parser.parseLine(buffer);
+				interpreter.printAcknowledgement();
 			}
 		}
 
+		interpreter.poll();
+
 		if (executor.currentTick() >= nextNotifyTick) {
 			interpreter.printCurrentPosition();
 			nextNotifyTick = executor.currentTick() + notifyInterval;
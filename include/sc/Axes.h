@@ -319,13 +319,21 @@ T axMax(Axes<T, Size> const &a) {
 }
 
 template <typename T, size_t Size>
-T axMax(Axes<T, Size> a, Axes<T, Size> const &b) {
+Axes<T, Size> axMax(Axes<T, Size> a, Axes<T, Size> const &b) {
     for (size_t i = 0; i < Size; ++i) {
         a[i] = std::max(a[i], b[i]);
     }
     return a;
 }
 
+template <typename T, size_t Size>
+Axes<T, Size> axMin(Axes<T, Size> a, Axes<T, Size> const &b) {
+    for (size_t i = 0; i < Size; ++i) {
+        a[i] = std::min(a[i], b[i]);
+    }
+    return a;
+}
+
 template <typename T, size_t Size>
 Axes<T, Size> axRound(Axes<T, Size> a) {
     for (size_t i = 0; i < Size; ++i) {
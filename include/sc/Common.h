@@ -1,6 +1,7 @@
 #pragma once
 
 #include <algorithm>
+#include <cinttypes>
 #include <cmath>
 #include <cstdint>
 #include <cstdio>
@@ -20,6 +21,14 @@
 
 inline void wait_us(int){};
 
+#elif defined(__GNUC__)
+
+#define FORCE_INLINE __attribute__((always_inline))
+#define RESTRICT __restrict__
+#define MEM_BARRIER() asm volatile("" : : : "memory")
+
+inline void wait_us(int){};
+
 #else
 #error "Compiler isn't supported!"
 #endif
@@ -55,6 +64,11 @@ inline auto lTruncTowardInf(float v) -> int32_t {
     return static_cast<int32_t>(v < 0.0f ? floor(v) : ceil(v));
 }
 
+// For durations, which can be longer than int32_t ticks.
+inline auto llTruncTowardInf(float v) -> int64_t {
+    return static_cast<int64_t>(v < 0.0f ? floor(v) : ceil(v));
+}
+
 constexpr auto inf() -> float { return std::numeric_limits<float>::infinity(); }
 
 constexpr const auto *eol = "\r\n";
@@ -76,7 +90,7 @@ struct Printer {
             }
             void print(const int32_t *n, int size) override {
                 for (int i = 0; i < size; i++) {
-                    printf("%ld%s", n[i], sep(i, size));
+                    printf("%" PRId32 "%s", n[i], sep(i, size));
                 }
             }
             void print(const char *str) override { printf("%s", str); }
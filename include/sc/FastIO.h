@@ -2,26 +2,100 @@
 
 // From https://developer.mbed.org/users/Sissors/code/FastIO/
 
+#include "Common.h"
+
+#include <type_traits>
+
 #if defined(TARGET_STM32F4)
 
 #include "mbed.h"
 #include "pinmap.h"
 
-typedef struct { uint32_t mask; } fastio_vars;
-
-#define PINMASK (1 << STM_PIN(pin))
-#define PINMASK_CLR ((1 << 16) << STM_PIN(pin))
-#define PORT ((GPIO_TypeDef *)(GPIOA_BASE + 0x0400 * STM_PORT(pin)))
+#define GPIO_PORT(port) ((GPIO_TypeDef *)(GPIOA_BASE + 0x0400 * (port)))
 
 #define INIT_PIN                                                                                   \
     RCC->AHB1ENR |= (1 << STM_PORT(pin));                                                          \
     (PORT->MODER &= ~(GPIO_MODER_MODER0_1 << (STM_PIN(pin) * 2)));                                 \
     container.mask = PINMASK
+
+#define SET_MODE(pull) pin_mode(pin, pull);
+
+#elif !defined(__MBED__)
+
+// Host build. GPIO registers are emulated in memory, so pin masks can be unit tested.
+
+// Same encoding as on STM32 targets: port in high nibble and pin number in low one.
+enum PinName {
+    PA_0 = 0x00, PA_1, PA_2, PA_3, PA_4, PA_5, PA_6, PA_7,
+    PA_8, PA_9, PA_10, PA_11, PA_12, PA_13, PA_14, PA_15,
+    PB_0 = 0x10, PB_1, PB_2, PB_3, PB_4, PB_5, PB_6, PB_7,
+    PB_8, PB_9, PB_10, PB_11, PB_12, PB_13, PB_14, PB_15,
+    PC_0 = 0x20, PC_1, PC_2, PC_3, PC_4, PC_5, PC_6, PC_7,
+    PC_8, PC_9, PC_10, PC_11, PC_12, PC_13, PC_14, PC_15,
+    PD_0 = 0x30, PD_1, PD_2,
+    NC = -1
+};
+
+enum PinMode { PullNone, PullUp, PullDown, PullDefault = PullNone };
+
+#define STM_PORT(X) (((uint32_t)(X) >> 4) & 0xF)
+#define STM_PIN(X) ((uint32_t)(X)&0xF)
+
+#define GPIO_MODER_MODER0_0 0x1u
+#define GPIO_MODER_MODER0_1 0x2u
+
+struct HostGpio {
+    // Write only register. Set bits have priority over reset bits like in hardware.
+    struct Bsrr {
+        Bsrr &operator=(uint32_t value) {
+            *odr = (*odr & ~(value >> 16)) | (value & 0xFFFF);
+            ++writes;
+            return *this;
+        }
+
+        uint32_t *odr;
+        int writes;
+    };
+
+    HostGpio() : MODER(0), IDR(0), ODR(0), BSRR{&ODR, 0} {}
+
+    HostGpio(HostGpio const &) = delete;
+
+    HostGpio &operator=(HostGpio const &) = delete;
+
+    uint32_t MODER;
+    uint32_t IDR;
+    uint32_t ODR;
+    Bsrr BSRR;
+};
+
+inline HostGpio *hostGpioPort(uint32_t port) {
+    static HostGpio ports[8];
+    return &ports[port];
+}
+
+#define GPIO_PORT(port) hostGpioPort(port)
+
+#define INIT_PIN                                                                                   \
+    (PORT->MODER &= ~(GPIO_MODER_MODER0_1 << (STM_PIN(pin) * 2)));                                 \
+    container.mask = PINMASK
+
+#define SET_MODE(pull)
+
+#endif
+
+#if defined(TARGET_STM32F4) || !defined(__MBED__)
+
+typedef struct { uint32_t mask; } fastio_vars;
+
+#define PINMASK (1 << STM_PIN(pin))
+#define PINMASK_CLR ((1 << 16) << STM_PIN(pin))
+#define PORT GPIO_PORT(STM_PORT(pin))
+
 #define DESTROY_PIN
 
 #define SET_DIR_INPUT (PORT->MODER &= ~(GPIO_MODER_MODER0_0 << (STM_PIN(pin) * 2)))
 #define SET_DIR_OUTPUT (PORT->MODER |= (GPIO_MODER_MODER0_0 << (STM_PIN(pin) * 2)))
-#define SET_MODE(pull) pin_mode(pin, pull);
 
 #define WRITE_PIN_SET (PORT->BSRR = PINMASK)
 #define WRITE_PIN_CLR (PORT->BSRR = PINMASK_CLR)
@@ -55,36 +129,36 @@ class FastInOut {
 
     ~FastInOut() { DESTROY_PIN; }
 
-    __attribute__((always_inline)) void write(int value) {
+    FORCE_INLINE void write(int value) {
         if (value)
             WRITE_PIN_SET;
         else
             WRITE_PIN_CLR;
     }
 
-    __attribute__((always_inline)) void set() { WRITE_PIN_SET; }
+    FORCE_INLINE void set() { WRITE_PIN_SET; }
 
-    __attribute__((always_inline)) void clear() { WRITE_PIN_CLR; }
+    FORCE_INLINE void clear() { WRITE_PIN_CLR; }
 
-    __attribute__((always_inline)) int read() { return READ_PIN; }
+    FORCE_INLINE int read() { return READ_PIN; }
 
-    __attribute__((always_inline)) void mode(PinMode pull) { SET_MODE(pull); }
+    FORCE_INLINE void mode(PinMode pull) { SET_MODE(pull); }
 
-    __attribute__((always_inline)) void output() { SET_DIR_OUTPUT; }
+    FORCE_INLINE void output() { SET_DIR_OUTPUT; }
 
-    __attribute__((always_inline)) void input() { SET_DIR_INPUT; }
+    FORCE_INLINE void input() { SET_DIR_INPUT; }
 
-    __attribute__((always_inline)) FastInOut &operator=(int value) {
+    FORCE_INLINE FastInOut &operator=(int value) {
         write(value);
         return *this;
     };
 
-    __attribute__((always_inline)) FastInOut &operator=(FastInOut &rhs) {
+    FORCE_INLINE FastInOut &operator=(FastInOut &rhs) {
         write(rhs.read());
         return *this;
     };
 
-    __attribute__((always_inline)) operator int() { return read(); };
+    FORCE_INLINE operator int() { return read(); };
 
   private:
     fastio_vars container;
@@ -115,19 +189,19 @@ class FastOut : public FastInOut<pin> {
         SET_DIR_OUTPUT;
     }
 
-    __attribute__((always_inline)) FastOut &operator=(int value) {
+    FORCE_INLINE FastOut &operator=(int value) {
         this->write(value);
         return *this;
     };
 
-    __attribute__((always_inline)) FastOut &operator=(FastOut &rhs) {
+    FORCE_INLINE FastOut &operator=(FastOut &rhs) {
         write(rhs.read());
         return *this;
     };
 
-    __attribute__((always_inline)) void flip() { this->write(!this->read()); }
+    FORCE_INLINE void flip() { this->write(!this->read()); }
 
-    __attribute__((always_inline)) operator int() { return this->read(); };
+    FORCE_INLINE operator int() { return this->read(); };
 };
 
 /**
@@ -155,15 +229,129 @@ class FastIn : public FastInOut<pin> {
         SET_DIR_INPUT;
     }
 
-    __attribute__((always_inline)) FastIn &operator=(int value) {
+    FORCE_INLINE FastIn &operator=(int value) {
         this->write(value);
         return *this;
     };
 
-    __attribute__((always_inline)) FastIn &operator=(FastIn &rhs) {
+    FORCE_INLINE FastIn &operator=(FastIn &rhs) {
         write(rhs.read());
         return *this;
     };
 
-    __attribute__((always_inline)) operator int() { return this->read(); };
+    FORCE_INLINE operator int() { return this->read(); };
 };
+
+/**
+ * Output pins which are written together
+ *
+ * i-th bit of value corresponds to i-th pin. Pins are grouped by GPIO port at compile time,
+ * so every port used by the group is written with a single BSRR write instead of one per pin.
+ * Pins should be configured as outputs separately, e.g. with FastOut.
+ *
+ * @code
+ * using StepPins = PinGroup<PC_1, PA_4, PA_0>;
+ * StepPins::set(0x5); // PC_1 and PA_0
+ * @endcode
+ */
+template <PinName... pins>
+class PinGroup {
+  public:
+    static const int size = sizeof...(pins);
+    static const uint32_t portsCount = 8;
+
+    static_assert(size <= 32, "Group should have at most 32 pins");
+
+    // Mask of group pins which belong to the port.
+    static constexpr uint32_t portMask(uint32_t port) { return portMask(port, Index<0>{}); }
+
+    // Pins of the port which correspond to set bits.
+    template <uint32_t port>
+    static FORCE_INLINE uint32_t portBits(uint32_t bits) {
+        return portBits<port>(bits, Index<0>{});
+    }
+
+    // Sets pins with 1 bits and resets pins with 0 bits.
+    static FORCE_INLINE void write(uint32_t bits) { write(bits, Port<0>{}); }
+
+    // Sets pins with 1 bits, other pins are not changed.
+    static FORCE_INLINE void set(uint32_t bits) { set(bits, Port<0>{}); }
+
+    // Resets all pins.
+    static FORCE_INLINE void clear() { clear(Port<0>{}); }
+
+    // Resets pins with 1 bits, other pins are not changed.
+    static FORCE_INLINE void clear(uint32_t bits) { clear(bits, Port<0>{}); }
+
+  private:
+    template <int i>
+    using Index = std::integral_constant<int, i>;
+
+    template <uint32_t port>
+    using Port = std::integral_constant<uint32_t, port>;
+
+    static constexpr PinName pins_[] = {pins...};
+
+    template <int i>
+    static constexpr uint32_t portMask(uint32_t port, Index<i>) {
+        return (STM_PORT(pins_[i]) == port ? 1u << STM_PIN(pins_[i]) : 0u) |
+               portMask(port, Index<i + 1>{});
+    }
+
+    static constexpr uint32_t portMask(uint32_t, Index<size>) { return 0; }
+
+    template <uint32_t port, int i>
+    static FORCE_INLINE uint32_t portBits(uint32_t bits, Index<i>) {
+        return (STM_PORT(pins_[i]) == port ? ((bits >> i) & 1u) << STM_PIN(pins_[i]) : 0u) |
+               portBits<port>(bits, Index<i + 1>{});
+    }
+
+    template <uint32_t port>
+    static FORCE_INLINE uint32_t portBits(uint32_t, Index<size>) {
+        return 0;
+    }
+
+    template <uint32_t port>
+    static FORCE_INLINE void write(uint32_t bits, Port<port>) {
+        if (portMask(port) != 0) {
+            auto high = portBits<port>(bits);
+            GPIO_PORT(port)->BSRR = high | ((portMask(port) & ~high) << 16);
+        }
+        write(bits, Port<port + 1>{});
+    }
+
+    static FORCE_INLINE void write(uint32_t, Port<portsCount>) {}
+
+    template <uint32_t port>
+    static FORCE_INLINE void set(uint32_t bits, Port<port>) {
+        if (portMask(port) != 0) {
+            GPIO_PORT(port)->BSRR = portBits<port>(bits);
+        }
+        set(bits, Port<port + 1>{});
+    }
+
+    static FORCE_INLINE void set(uint32_t, Port<portsCount>) {}
+
+    template <uint32_t port>
+    static FORCE_INLINE void clear(Port<port>) {
+        if (portMask(port) != 0) {
+            GPIO_PORT(port)->BSRR = portMask(port) << 16;
+        }
+        clear(Port<port + 1>{});
+    }
+
+    static FORCE_INLINE void clear(Port<portsCount>) {}
+
+    template <uint32_t port>
+    static FORCE_INLINE void clear(uint32_t bits, Port<port>) {
+        if (portMask(port) != 0) {
+            GPIO_PORT(port)->BSRR = portBits<port>(bits) << 16;
+        }
+        clear(bits, Port<port + 1>{});
+    }
+
+    static FORCE_INLINE void clear(uint32_t, Port<portsCount>) {}
+};
+
+template <PinName... pins>
+constexpr PinName PinGroup<pins...>::pins_[];
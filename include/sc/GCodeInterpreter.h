@@ -1,6 +1,9 @@
 #pragma once
 
+#include "PackedSegments.h"
+#include "PathToTimeOptimalTrajectoryConverter.h"
 #include "PathToTrajectoryConverter.h"
+#include "RingBuffer.h"
 #include "Segment.h"
 #include "TrajectoryToSegmentsConverter.h"
 
@@ -18,14 +21,92 @@ Clamp<T> clamp(T minV, T maxV) {
     return Clamp<T>(minV, maxV);
 }
 
+enum class TrajectoryPlanner {
+    // PathToTrajectoryConverter.
+    Blends,
+    // PathToTimeOptimalTrajectoryConverter.
+    TimeOptimal,
+};
+
+// Max velocity and acceleration of moves, steps per tick and steps per tick^2.
+template <size_t size>
+struct LimitProfile {
+    TAf<size> vel;
+    TAf<size> acc;
+};
+
+// Slow velocity is zero for homing with a single approach, see GCodeInterpreter.
+template <size_t size>
+struct HomingProfile {
+    TAf<size> vel;
+    TAf<size> acc;
+    TAf<size> slowVel;
+    TAf<size> backOff;
+};
+
+// Fixed table of distinct values, which are referenced by index from buffered commands. A value
+// is kept while it has references, then its slot can be reused for a new value.
+template <typename T, size_t Capacity>
+class InternTable {
+    static_assert(Capacity < 255, "Indices should fit into uint8_t");
+
+  public:
+    using value_type = T;
+
+    static const uint8_t none = 255;
+
+    // Returns index of the value with one more reference or none if all slots are referenced.
+    uint8_t intern(T const &value) {
+        auto index = none;
+        for (uint8_t i = 0; i < size_; ++i) {
+            if (memcmp(&values_[i], &value, sizeof(T)) == 0) {
+                ++refs_[i];
+                return i;
+            }
+            if (refs_[i] == 0 && index == none) {
+                index = i;
+            }
+        }
+        if (index == none) {
+            if (size_ == Capacity) {
+                return none;
+            }
+            index = size_++;
+        }
+        values_[index] = value;
+        refs_[index] = 1;
+        return index;
+    }
+
+    void release(uint8_t index) {
+        if (index != none) {
+            scAssert(refs_[index] > 0);
+            --refs_[index];
+        }
+    }
+
+    T const &operator[](uint8_t index) const {
+        scAssert(index < size_);
+        return values_[index];
+    }
+
+  private:
+    T values_[Capacity];
+    uint16_t refs_[Capacity]{};
+    uint8_t size_{};
+};
+
+// Moves and homing keep indices of their profiles, see GCodeInterpreter, so commands are small.
 template <size_t size>
 struct Command {
     using Af = TAf<size>;
 
+    // Infinite positions correspond to unset axes. Feed is path speed in units per tick, it is
+    // infinite for rapid moves.
     struct MoveCmd {
         Af pos;
-        Af vel;
-        Af acc;
+        float feed;
+        uint8_t limits;
         DistanceMode mode;
     };
 
@@ -34,7 +115,7 @@ struct Command {
     };
 
     struct HomingCmd {
-        Af vel;
+        uint8_t profile;
     };
 
     enum Type {
@@ -49,12 +130,12 @@ struct Command {
         HomingCmd homing;
     };
 
-    Command(Af const &pos, Af const &vel, Af const &acc, DistanceMode mode = DistanceMode::Absolute)
-        : type(Move), move({pos, vel, acc, mode}) {}
+    Command(Af const &pos, float feed, uint8_t limits, DistanceMode mode = DistanceMode::Absolute)
+        : type(Move), move({pos, feed, limits, mode}) {}
 
     Command(float sec) : type(Wait), wait({sec}) {}
 
-    Command(Af const &vel) : type(Homing), homing({vel}) {}
+    explicit Command(HomingCmd const &homing) : type(Homing), homing(homing) {}
 
     friend bool operator==(Command const &lhs, Command const &rhs) {
         if (lhs.type != rhs.type) {
@@ -62,11 +143,13 @@ struct Command {
         }
         switch (lhs.type) {
         case Move:
-            return memcmp(&lhs.move, &rhs.move, sizeof(MoveCmd)) == 0;
+            return memcmp(&lhs.move.pos, &rhs.move.pos, sizeof(Af)) == 0 &&
+                   memcmp(&lhs.move.feed, &rhs.move.feed, sizeof(float)) == 0 &&
+                   lhs.move.limits == rhs.move.limits && lhs.move.mode == rhs.move.mode;
         case Wait:
             return memcmp(&lhs.wait, &rhs.wait, sizeof(WaitCmd)) == 0;
         case Homing:
-            return memcmp(&lhs.homing, &rhs.homing, sizeof(HomingCmd)) == 0;
+            return lhs.homing.profile == rhs.homing.profile;
         default:
             scAssert(!"Wrong type");
             return false;
@@ -96,26 +179,50 @@ struct Command {
 
 /*
  Interpreter reacts to callbacks from parser and creates commands from them.
+ Planned segments are streamed to executor by poll, which should be called from the main loop.
+ Segments planned since the last start from idle state are kept, so the same trajectory can be
+ executed again by M111 without planning.
+ Commands wait for planning in a buffer of CommandsCapacity commands. A host streams lines with
+ flow control: after each line the main loop calls printAcknowledgement, which reports free slots
+ of the buffer, and the host doesn't send more commands than there are free slots.
 
 
 struct ISegmentsExecutor {
+    using Sg = TSg<size>;
+
     virtual void start() {}
     virtual void stop() {}
     virtual bool isRunning() const {}
     virtual Ai const &position() const {}
     virtual void setPosition(Ai const &) {}
-    virtual void setSegments(Sgs const &) {}
-    virtual void setSegments(Sgs &&) {}
+    virtual bool push(Sg const &) {}
+    virtual size_t queuedSegments() const {}
+    virtual uint32_t queuedTicks() const {}
     virtual void setTicksPerSecond(int32_t) {}
+    virtual void setMaxStepsPerTick(int32_t) {}
+    static const int maxFeedOverride = 2;
+    virtual void setFeedOverride(float) {}
+    virtual void setFeedOverrideRamp(float) {}
+    virtual void hold() {}
+    virtual void resume() {}
 };
  */
-template <typename ISegmentsExecutor, typename AxesTraits = DefaultAxesTraits>
+template <typename ISegmentsExecutor, typename AxesTraits = DefaultAxesTraits,
+          size_t CommandsCapacity = 128>
 class GCodeInterpreter {
   public:
     using Af = TAf<AxesTraits::size>;
     using Ai = TAi<AxesTraits::size>;
-    using Sg = TSg<AxesTraits::size>;
+    using Sg = typename ISegmentsExecutor::Sg;
     using Cmd = Command<AxesTraits::size>;
+    using PackedSgs = TPackedSgs<AxesTraits::size, typename Sg::Accumulator>;
+    using Commands = RingBuffer<Cmd, CommandsCapacity>;
+    // Profiles differ only after M100-M103, M107 and M108, so few of them are buffered at once.
+    // Moves with different limits are blended without stop, see setSegmentLimits of planners.
+    // If all profiles are referenced, buffered commands are planned to release them, see
+    // internProfile.
+    using LimitProfiles = InternTable<LimitProfile<AxesTraits::size>, 8>;
+    using HomingProfiles = InternTable<HomingProfile<AxesTraits::size>, 2>;
 
     explicit GCodeInterpreter(ISegmentsExecutor *exec, Printer *printer = Printer::instance())
         : executor_(exec), mode_(DistanceMode::Absolute), homingVelUnitsPerSec_(axConst<Af>(1.f)),
@@ -130,23 +237,50 @@ class GCodeInterpreter {
     // G Commands
     ///////////////////////////////////////////////////////////////////////////
 
-    void feedrateOverride(float) {}
+    // Scales speed of the running trajectory in real time without planning, see
+    // SegmentsExecutor::setFeedOverride. Feed is in percent and is clamped to 10% and the max
+    // feed override, see setMaxFeedOverride. Change of the ratio is rate limited, see
+    // feedOverrideRamp.
+    void feedrateOverride(float percent) {
+        executor_->setFeedOverrideRamp(feedOverrideRamp());
+        executor_->setFeedOverride(clamp(minFeedOverride, maxFeedOverride_)(percent / 100.f));
+    }
 
+    // Feed is path speed in units per minute, it limits this and following linear moves together
+    // with max velocities of axes. Infinite feed keeps the previous one.
     // Max velocity and acceleration should be set before this call.
-    void linearMove(Af const &positionInUnits, float /*feed*/ = inf()) {
-        commands_.emplace_back(positionInUnits, maxVelocity(), maxAcceleration(), mode_);
+    void linearMove(Af const &positionInUnits, float feed = inf()) {
+        if (std::isfinite(feed) && feed > 0) {
+            feedUnitsPerMin_ = feed;
+        }
+        addMove(positionInUnits, feedUnitsPerMin_ / 60.f / static_cast<float>(ticksPerSec_));
     }
 
-    // Same as linear move.
-    void g0RapidMove(Af const &pos) { linearMove(pos, inf()); }
+    // Moves with max velocities of axes, feed doesn't limit it.
+    void g0RapidMove(Af const &pos) { addMove(pos, inf()); }
 
     // Same as linear move.
     void g1LinearMove(Af const &pos, float feed = inf()) { linearMove(pos, feed); }
 
     // Ticks per second should be set before this call.
-    void g4Wait(float sec) { commands_.emplace_back(sec); }
+    void g4Wait(float sec) {
+        if (hasCommandSlot()) {
+            commands_.push(Cmd(sec));
+        }
+    }
 
-    void g28RunHomingCycle() { commands_.emplace_back(homingVelocity()); }
+    // Axes approach end switches with homing velocity and stop there. If slow homing velocity is
+    // set they decelerate with max acceleration instead, back off from the switches and approach
+    // them again with slow velocity, so fast homing keeps repeatability of the slow one.
+    void g28RunHomingCycle() {
+        if (!hasCommandSlot()) {
+            return;
+        }
+        auto const profile = internProfile(
+            homingProfiles_,
+            {homingVelocity(), maxAcceleration(), slowHomingVelocity(), homingBackOff()});
+        commands_.push(Cmd(typename Cmd::HomingCmd{profile}));
+    }
 
     void g90g91DistanceMode(DistanceMode mode) { mode_ = mode; }
 
@@ -179,18 +313,36 @@ class GCodeInterpreter {
         scAssert(all(gt(homingVelUnitsPerSec_, axZero<Af>())));
     }
 
+    // Distance from end switches before the slow approach of homing, see g28RunHomingCycle.
+    // Overrides only finite axes
+    void m107HomingBackOffOverride(Af const &units) {
+        copyOnlyFinite(units, homingBackOffUnits_);
+        scAssert(all(ge(homingBackOffUnits_, axZero<Af>())));
+    }
+
+    // Zero disables the slow approach of homing, see g28RunHomingCycle.
+    // Overrides only finite axes
+    void m108SlowHomingVelocityOverride(Af const &unitsPerSec) {
+        copyOnlyFinite(unitsPerSec, slowHomingVelUnitsPerSec_);
+        scAssert(all(ge(slowHomingVelUnitsPerSec_, axZero<Af>())));
+    }
+
     void m104PrintInfo() const {
         *printer_ << "Max velocity: " << maxVelUnitsPerSec_ << " (" << maxVelocity() << ")" << eol
                   << "Max acceleration: " << maxAccUnitsPerSec2_ << " (" << maxAcceleration() << ")"
                   << eol << "Homing velocity: " << homingVelUnitsPerSec_ << " (" << homingVelocity()
-                  << ")" << eol << "Steps per unit length: " << stepPerUnit_ << eol
+                  << ")" << eol << "Slow homing velocity: " << slowHomingVelUnitsPerSec_ << " ("
+                  << slowHomingVelocity() << ")" << eol << "Homing back-off: "
+                  << homingBackOffUnits_ << " (" << homingBackOff() << ")" << eol
+                  << "Steps per unit length: " << stepPerUnit_ << eol
                   << "Min position: " << minPosUnits_ << " (" << minPosition() << ")" << eol
                   << "Max position: " << maxPosUnits_ << " (" << maxPosition() << ")" << eol
                   << "Mode: " << (mode_ == DistanceMode::Absolute ? "Absolute" : "Relative") << eol
+                  << "Feed: " << feedUnitsPerMin_ << eol
                   << "Ticks per second: " << ticksPerSec_ << eol << "Commands (" << commands_.size()
                   << "): ";
-        for (auto const &cmd : commands_) {
-            *printer_ << eol << "    " << cmd;
+        for (size_t i = 0; i < commands_.size(); ++i) {
+            *printer_ << eol << "    " << commands_[i];
         }
         *printer_ << eol;
     }
@@ -201,8 +353,42 @@ class GCodeInterpreter {
     // Overrides all axes
     void m106MaxPositionOverride(Af const &units) { maxPosUnits_ = units; }
 
+    // Decelerates to stop along the trajectory and holds there, start resumes the motion. The
+    // ramp of the hold leaves room for planned acceleration, see feedOverrideRamp, so a hold
+    // during a blend adds at most half of max acceleration. Position is kept exact, so stop
+    // after the hold doesn't lose steps. Hold without motion is dropped by the next start.
+    void m109FeedHold() {
+        executor_->setFeedOverrideRamp(feedOverrideRamp());
+        executor_->hold();
+    }
+
     void m110PrintAxesConfiguration() { *printer_ << "Axes: " << AxesTraits::names() << eol; }
 
+    // Executes the last trajectory again. Unless it starts with homing, axes first move to its
+    // start position with max velocities and accelerations if they were moved since.
+    void m111RerunLastTrajectory() {
+        if (!isIdle()) {
+            *printer_ << "Error: can't rerun while running" << eol;
+            return;
+        }
+        if (!lastRecorded_ || last_.empty()) {
+            *printer_ << "Error: no trajectory to rerun" << eol;
+            return;
+        }
+        if (!last_.front().isHoming() && executor_->position() != lastStartPosition_) {
+            // Limits leave room for feed override, see setMaxFeedOverride.
+            auto const r = maxFeedOverride_;
+            addMoveSegments(pending_, {executor_->position(), lastStartPosition_},
+                            axAbs(maxVelocity()) / r, axAbs(maxAcceleration()) / (r * r));
+        }
+        pending_.append(last_);
+        window_.assign(1, lastEndPosition_);
+        releaseWindowLimits();
+        hasPreviousLine_ = false;
+        pushPendingSegments();
+        executor_->start();
+    }
+
     ///////////////////////////////////////////////////////////////////////////
     // Others
     ///////////////////////////////////////////////////////////////////////////
@@ -211,16 +397,60 @@ class GCodeInterpreter {
         *printer_ << "Error: " << reason << " at " << static_cast<int>(pos) << " in " << str << eol;
     }
 
+    // Plans buffered commands and appends them to the trajectory. If executor is already running
+    // new segments are executed right after current ones and held motion is resumed.
+    // With planning window only the first window is planned here, others are planned by poll,
+    // which also plans commands received later. Poll plans the next window while segments of the
+    // previous one are still executed, so the executor doesn't wait for planning.
     void start() {
-        if (executor_->isRunning()) {
-            *printer_ << "Error: already running" << eol;
-            return;
+        if (!executor_->isRunning() && pending_.empty() && next_.empty() &&
+            (!commands_.empty() || !deferred_.empty())) {
+            // New trajectory.
+            last_.clear();
+            lastRecorded_ = true;
+            lastStartPosition_ = executor_->position();
+        }
+        streaming_ = planningWindow_ > 0;
+        next_.append(deferred_);
+        recordLastTrajectory(deferred_);
+        deferred_.clear();
+        planCommands();
+        pushPendingSegments();
+        if (!executor_->isRunning()) {
+            executor_->start();
+        } else {
+            executor_->resume();
+        }
+    }
+
+    void stop() {
+        executor_->stop();
+        pending_.clear();
+        next_.clear();
+        deferred_.clear();
+        window_.clear();
+        releaseWindowLimits();
+        hasPreviousLine_ = false;
+        streaming_ = false;
+    }
+
+    // Feeds planned segments to executor queue and resumes execution if queue was drained before
+    // all segments were pushed. The next window is planned as soon as the previous one is handed
+    // over to pushing, at most two windows are kept planned ahead of the queue.
+    void poll() {
+        if (streaming_ && next_.empty()) {
+            planCommands();
+        }
+        pushPendingSegments();
+        if (!executor_->isRunning() && executor_->queuedSegments() > 0) {
+            executor_->start();
+        }
+        if (acknowledgedFull_ && !commands_.full()) {
+            printAcknowledgement();
         }
-        loadSegmentsToExecutor();
-        executor_->start();
     }
 
-    void stop() { executor_->stop(); }
+    size_t pendingSegments() const { return pending_.size() + next_.size() + deferred_.size(); }
 
     bool isRunning() const { return executor_->isRunning(); }
 
@@ -234,10 +464,70 @@ class GCodeInterpreter {
     }
 
     void clearCommandsBuffer() {
-        // Also frees memory.
-        commands_ = move(std::vector<Cmd>());
+        while (!commands_.empty()) {
+            releaseProfile(commands_.front());
+            commands_.pop();
+        }
     }
 
+    size_t freeCommandSlots() const { return commands_.freeSpace(); }
+
+    // Flow control acknowledgement of a received line with number of free command slots. If the
+    // buffer was full, poll repeats it once planning frees slots, so the host can continue.
+    // Without planning window poll doesn't plan, so the buffer is freed only by start. Then the
+    // full buffer is reported with error, the host should start the buffered part of the program.
+    void printAcknowledgement() {
+        if (commands_.full() && !acknowledgedFull_ && !streaming_) {
+            *printer_ << "Error: commands buffer is full, start to plan it" << eol;
+        }
+        *printer_ << "Ok: " << static_cast<int>(freeCommandSlots()) << eol;
+        acknowledgedFull_ = commands_.full();
+    }
+
+    // Number of way-points planned at once, 0 to plan all buffered commands at start, so the
+    // program should fit into the commands buffer, see printAcknowledgement. With a window
+    // motion starts after the first window is planned and planner memory doesn't depend on length
+    // of the program. Trajectory is continued between windows, but it stops when there are no more
+    // commands to plan and executor queue is shorter than the stop margin, see setStopMargin.
+    void setPlanningWindow(size_t waypoints) { planningWindow_ = waypoints; }
+
+    size_t planningWindow() const { return planningWindow_; }
+
+    // With planning window the last commands are planned with stop once the executor queue is
+    // shorter than this, so poll should be called more often. Otherwise the queue can be drained
+    // at full speed and the motion stops instantly. In seconds.
+    void setStopMargin(float sec) {
+        scAssert(sec >= 0);
+        stopMarginSec_ = sec;
+    }
+
+    float stopMargin() const { return stopMarginSec_; }
+
+    void setTrajectoryPlanner(TrajectoryPlanner planner) { planner_ = planner; }
+
+    TrajectoryPlanner trajectoryPlanner() const { return planner_; }
+
+    // Feed override above 1 scales velocities by the ratio and accelerations by its square, so
+    // moves added after this call are planned with max velocities divided by the ratio and max
+    // accelerations divided by its square. Then they stay within limits with any override.
+    void setMaxFeedOverride(float ratio) {
+        scAssert(ratio >= 1.f && ratio <= ISegmentsExecutor::maxFeedOverride);
+        maxFeedOverride_ = ratio;
+    }
+
+    float maxFeedOverride() const { return maxFeedOverride_; }
+
+    // Blends with linearly changing acceleration instead of its steps. They are planned with half
+    // of max acceleration, so their peak acceleration is the max one.
+    void setJerkLimitedBlends(bool jerkLimited) { jerkLimited_ = jerkLimited; }
+
+    bool jerkLimitedBlends() const { return jerkLimited_; }
+
+    // Last trajectory is kept for M111 while it takes at most this number of bytes.
+    void setRerunCapacity(size_t bytes) { rerunCapacity_ = bytes; }
+
+    size_t rerunCapacity() const { return rerunCapacity_; }
+
     ///////////////////////////////////////////////////////////////////////////
     // State
     ///////////////////////////////////////////////////////////////////////////
@@ -248,10 +538,38 @@ class GCodeInterpreter {
         executor_->setTicksPerSecond(tps);
     }
 
+    // Axes can make more steps per tick to move faster with the same tick rate, see
+    // SegmentsExecutor::setMaxStepsPerTick.
+    void setMaxStepsPerTick(int32_t steps) {
+        scAssert(steps >= 1 && steps <= Sg::maxStepsPerTick);
+        maxStepsPerTick_ = steps;
+        executor_->setMaxStepsPerTick(steps);
+    }
+
+    int32_t maxStepsPerTick() const { return maxStepsPerTick_; }
+
+    // Slow segments are executed with fewer interrupts, see
+    // TrajectoryToSegmentsConverter::setMaxTickPeriod. In ticks.
+    void setMaxTickPeriod(int32_t ticks) {
+        scAssert(ticks >= 1);
+        maxTickPeriod_ = ticks;
+    }
+
+    int32_t maxTickPeriod() const { return maxTickPeriod_; }
+
     // Steps per tick
     Af maxVelocity() const {
+        auto const limit = static_cast<float>(maxStepsPerTick_);
         return apply(maxVelUnitsPerSec_ * stepPerUnit_ / static_cast<float>(ticksPerSec_),
-                     clamp(-1.f, 1.f));
+                     clamp(-limit, limit));
+    }
+
+    // Max change of feed override ratio per tick. Changing it by r per tick adds v * r to
+    // acceleration of an axis moving with velocity v. The ramp is half of the least max
+    // acceleration to max velocity ratio of all axes, so a change during a blend adds at most
+    // half of max acceleration to the planned one.
+    float feedOverrideRamp() const {
+        return 0.5f / axMax(axAbs(maxVelocity() / maxAcceleration()));
     }
 
     // Steps per tick per tick
@@ -268,6 +586,15 @@ class GCodeInterpreter {
                      clamp(-1.f, 1.f));
     }
 
+    // Steps per tick
+    Af slowHomingVelocity() const {
+        return apply(slowHomingVelUnitsPerSec_ * stepPerUnit_ / static_cast<float>(ticksPerSec_),
+                     clamp(-1.f, 1.f));
+    }
+
+    // Steps
+    Af homingBackOff() const { return axAbs(homingBackOffUnits_ * stepPerUnit_); }
+
     // Steps
     Af minPosition() const { return minPosUnits_ * stepPerUnit_; }
 
@@ -276,11 +603,12 @@ class GCodeInterpreter {
 
     int32_t ticksPerSecond() const { return ticksPerSec_; }
 
-    std::vector<Cmd> const &commands() const { return commands_; }
+    Commands const &commands() const { return commands_; }
 
     std::vector<Ai> path() const {
         std::vector<Ai> points;
-        for (auto const &cmd : commands_) {
+        for (size_t i = 0; i < commands_.size(); ++i) {
+            auto const &cmd = commands_[i];
             if (cmd.type != Cmd::Move) {
                 break;
             }
@@ -334,83 +662,364 @@ class GCodeInterpreter {
         }
     }
 
-    void loadSegmentsToExecutor() {
-        auto points = std::vector<Ai>();
-        auto trajectory = std::vector<Sg>();
+    bool isIdle() const { return !executor_->isRunning() && pendingSegments() == 0; }
+
+    // Feed is in units per tick.
+    void addMove(Af const &positionInUnits, float feed) {
+        if (!hasCommandSlot()) {
+            return;
+        }
+        // Limits leave room for feed override, see setMaxFeedOverride.
+        auto const r = maxFeedOverride_;
+        auto const limits =
+            internProfile(limitProfiles_, {maxVelocity() / r, maxAcceleration() / (r * r)});
+        commands_.push(Cmd(positionInUnits, feed, limits, mode_));
+    }
+
+    // New command is dropped with error if the buffer is full, see printAcknowledgement.
+    bool hasCommandSlot() const {
+        if (commands_.full()) {
+            *printer_ << "Error: commands buffer is full" << eol;
+            return false;
+        }
+        return true;
+    }
+
+    // Returns index of the profile with a reference for a new command. If all profiles are
+    // referenced, buffered commands are planned first, so a received line is never dropped.
+    template <typename Profiles>
+    uint8_t internProfile(Profiles &profiles, typename Profiles::value_type const &profile) {
+        auto index = profiles.intern(profile);
+        if (index == Profiles::none) {
+            planBufferedCommands();
+            index = profiles.intern(profile);
+            scAssert(index != Profiles::none);
+        }
+        return index;
+    }
+
+    // Plans all buffered commands with stop at the end, then neither they nor the planning window
+    // reference profiles. Motion stops there even if the following move could be blended. Until
+    // start the segments are deferred, so motion doesn't begin before it.
+    void planBufferedCommands() {
+        auto trajectory = PackedSgs();
+        planCommands(trajectory, std::numeric_limits<size_t>::max(), true);
+        if (streaming_) {
+            next_.append(trajectory);
+            recordLastTrajectory(trajectory);
+        } else {
+            deferred_.append(trajectory);
+        }
+    }
 
-        auto currPos = executor_->position();
-        auto acc = axZero<Af>();
-        auto vel = axZero<Af>();
+    void releaseProfile(Cmd const &cmd) {
+        if (cmd.type == Cmd::Move) {
+            limitProfiles_.release(cmd.move.limits);
+        } else if (cmd.type == Cmd::Homing) {
+            homingProfiles_.release(cmd.homing.profile);
+        }
+    }
 
-        auto appendPointsToTrajectory = [&] {
-            if (points.size() < 2) {
-                return;
+    // Segments of the next window follow the pending ones, planning continues into the empty
+    // buffer.
+    void pushPendingSegments() {
+        if (pending_.empty()) {
+            std::swap(pending_, next_);
+        }
+        while (!pending_.empty() && executor_->push(pending_.front())) {
+            pending_.pop_front();
+            if (pending_.empty()) {
+                std::swap(pending_, next_);
             }
-            auto lastPoint = points.back();
+        }
+    }
 
-            auto trajGen = PathToTrajectoryConverter<AxesTraits::size>(points);
-            trajGen.setMaxVelocity(vel);
-            trajGen.setMaxAcceleration(acc);
-            trajGen.update();
+    void planCommands() {
+        if (planningWindow_ == 0) {
+            planCommands(std::numeric_limits<size_t>::max(), true);
+        } else {
+            // Stop blend follows the queued segments, so it is planned while they still run.
+            auto const margin = llround(stopMarginSec_ * ticksPerSecond());
+            auto const ending = pendingSegments() == 0 && executor_->queuedTicks() <= margin;
+            planCommands(planningWindow_, ending);
+        }
+    }
 
-            auto segGen = TrajectoryToSegmentsConverter<AxesTraits::size>(points);
-            segGen.setBlendDurations(move(trajGen.blendDurations()));
-            segGen.setDurations(move(trajGen.durations()));
-            segGen.appendTo(trajectory);
+    // Planned segments follow the pending ones and are kept for rerun.
+    void planCommands(size_t window, bool flush) {
+        auto trajectory = PackedSgs();
+        planCommands(trajectory, window, flush);
+        next_.append(trajectory);
+        recordLastTrajectory(trajectory);
+    }
 
-            points.clear();
-            points.push_back(lastPoint);
-        };
+    // Without slow velocity axes approach end switches once. Otherwise the fast approach of axes
+    // with slow velocity decelerates after the switches are hit, and back-off is counted from
+    // them, so it includes stopping distance. Back-off is planned as a move with homing velocity
+    // and max acceleration. Other axes stop at the switches at once and stay there.
+    // Homing moves against the sign of velocity, see Segment.
+    void addHomingSegments(PackedSgs &trajectory, HomingProfile<AxesTraits::size> const &homing) {
+        if (all(eq(homing.slowVel, axZero<Af>()))) {
+            trajectory.emplace_back(homing.vel);
+            return;
+        }
+        auto deceleration = axZero<Af>();
+        auto dx = axZero<Ai>();
+        // Axes without back-off don't move.
+        auto maxVelocity = axConst<Af>(1.f);
+        for (int i = 0; i < AxesTraits::size; ++i) {
+            auto const v = homing.vel[i];
+            if (v == 0 || homing.slowVel[i] == 0) {
+                continue;
+            }
+            deceleration[i] = std::abs(homing.acc[i]);
+            auto const stopping = v * v / (2 * deceleration[i]);
+            auto const steps = static_cast<int32_t>(std::ceil(homing.backOff[i] + stopping));
+            dx[i] = v > 0 ? steps : -steps;
+            maxVelocity[i] = std::abs(v);
+        }
+        trajectory.emplace_back(homing.vel, deceleration);
+        if (any(neq(dx, 0))) {
+            addMoveSegments(trajectory, {axZero<Ai>(), dx}, maxVelocity, axAbs(homing.acc));
+        }
+        trajectory.emplace_back(homing.slowVel);
+    }
 
-        for (auto const &cmd : commands_) {
+    // Plans a move between two positions, which starts and ends at rest. Velocity and
+    // acceleration limits are positive.
+    void addMoveSegments(PackedSgs &trajectory, std::vector<Ai> path, Af const &maxVelocity,
+                         Af const &maxAcceleration) {
+        auto trajGen = PathToTrajectoryConverter<AxesTraits::size>(path);
+        trajGen.setMaxVelocity(maxVelocity);
+        // Blends are planned with half of max acceleration if they are jerk limited.
+        trajGen.setMaxAcceleration(jerkLimited_ ? maxAcceleration * 0.5f : maxAcceleration);
+        trajGen.update();
+        auto segGen =
+            TrajectoryToSegmentsConverter<AxesTraits::size, typename Sg::Accumulator>(path);
+        segGen.setBlendDurations(move(trajGen.blendDurations()));
+        segGen.setDurations(move(trajGen.durations()));
+        segGen.setJerkLimitedBlends(jerkLimited_);
+        segGen.setMaxStepsPerTick(maxStepsPerTick_);
+        segGen.setMaxTickPeriod(maxTickPeriod_);
+        segGen.appendTo(trajectory);
+    }
+
+    // Plans buffered commands into trajectory. Moves are planned in windows of given number of
+    // way-points, only one full window per call. If flush is false, the last incomplete window is
+    // kept until more commands are received, otherwise it is planned with stop at the end.
+    void planCommands(PackedSgs &trajectory, size_t window, bool flush) {
+        if (isIdle()) {
+            // Continue from actual position, previous motion is completed.
+            if (window_.empty()) {
+                window_.push_back(executor_->position());
+            } else {
+                window_[0] = executor_->position();
+            }
+            hasPreviousLine_ = false;
+        }
+
+        while (!commands_.empty()) {
+            auto const cmd = commands_.front();
+            commands_.pop();
             switch (cmd.type) {
             case Cmd::Move: {
-                if (any(neq(vel, cmd.move.vel)) || any(neq(acc, cmd.move.acc))) {
-                    appendPointsToTrajectory();
-
-                    vel = cmd.move.vel;
-                    acc = cmd.move.acc;
+                auto const points = window_.size();
+                addMoveCmdPoint(window_, cmd, window_.back(), cmd.move.mode);
+                if (window_.size() > points) {
+                    // Reference of the command is kept by the window.
+                    windowLimits_.push_back({cmd.move.limits, cmd.move.feed});
+                } else {
+                    limitProfiles_.release(cmd.move.limits);
                 }
-
-                addMoveCmdPoint(points, cmd, currPos, cmd.move.mode);
             } break;
             case Cmd::Wait: {
                 auto sec = cmd.wait.sec;
                 if (sec < 0) {
                     break;
                 }
-                appendPointsToTrajectory();
-                if (sec > 0) {
-                    auto ticks = lround(sec * ticksPerSecond());
-                    trajectory.push_back(Sg(ticks));
+                planWindow(trajectory, true);
+                // Long dwell is split into waits, which fit into int32_t ticks.
+                for (auto ticks = llround(sec * ticksPerSecond()); ticks > 0;) {
+                    auto dt = static_cast<int32_t>(std::min<int64_t>(ticks, int32Max));
+                    trajectory.push_back(Sg(dt));
+                    ticks -= dt;
                 }
             } break;
             case Cmd::Homing: {
-                appendPointsToTrajectory();
-                points.clear();
-                trajectory.emplace_back(cmd.homing.vel);
-                currPos.fill(0);
+                planWindow(trajectory, true);
+                addHomingSegments(trajectory, homingProfiles_[cmd.homing.profile]);
+                homingProfiles_.release(cmd.homing.profile);
+                window_.assign(1, axZero<Ai>());
             } break;
             default:
                 scAssert(!"Unexpected command");
             }
+
+            if (window_.size() > window) {
+                planWindow(trajectory, false);
+                break;
+            }
         }
-        commands_.clear();
 
-        appendPointsToTrajectory();
-        executor_->setTrajectory(move(trajectory));
+        if (commands_.empty() && flush) {
+            planWindow(trajectory, true);
+        }
+    }
+
+    // Plans way-points of the window, which continues motion of the previous one if it didn't
+    // stop. Without stop the last blend is left for the next window.
+    void planWindow(PackedSgs &trajectory, bool stop) {
+        if (window_.size() < 2 && !(stop && hasPreviousLine_)) {
+            return;
+        }
+
+        auto segGen =
+            TrajectoryToSegmentsConverter<AxesTraits::size, typename Sg::Accumulator>(window_);
+        if (hasPreviousLine_) {
+            segGen.setPreviousLine(previousLineVelocity_, previousBlendDuration_);
+        }
+        if (planner_ == TrajectoryPlanner::TimeOptimal) {
+            planDurations<PathToTimeOptimalTrajectoryConverter<AxesTraits::size>>(segGen);
+        } else {
+            planDurations<PathToTrajectoryConverter<AxesTraits::size>>(segGen);
+        }
+        segGen.setStopAtEnd(stop);
+        segGen.setJerkLimitedBlends(jerkLimited_);
+        segGen.setMaxStepsPerTick(maxStepsPerTick_);
+        segGen.setMaxTickPeriod(maxTickPeriod_);
+        segGen.appendTo(trajectory);
+
+        hasPreviousLine_ = !stop && window_.size() > 1;
+        limitProfiles_.release(previousLineLimits_);
+        previousLineLimits_ = LimitProfiles::none;
+        if (hasPreviousLine_) {
+            previousLineVelocity_ = segGen.lastLineVelocity();
+            previousBlendDuration_ = segGen.lastBlendDuration();
+            previousLineLimits_ = windowLimits_.back().profile;
+            windowLimits_.pop_back();
+        }
+        window_.erase(window_.begin(), window_.end() - 1);
+        releaseWindowLimits();
+    }
+
+    void releaseWindowLimits() {
+        for (auto const &limits : windowLimits_) {
+            limitProfiles_.release(limits.profile);
+        }
+        windowLimits_.clear();
+    }
+
+    // Passes durations planned by TrajGen for the window to segments generator.
+    template <typename TrajGen, typename SegGen>
+    void planDurations(SegGen &segGen) {
+        // Blends are planned with half of max acceleration if they are jerk limited.
+        auto blendAcceleration = [&](Af const &acc) { return jerkLimited_ ? acc * 0.5f : acc; };
+        auto trajGen = TrajGen(window_);
+        auto maxVelocities = std::vector<Af>();
+        auto maxAccelerations = std::vector<Af>();
+        for (size_t i = 0; i < windowLimits_.size(); ++i) {
+            auto const &profile = limitProfiles_[windowLimits_[i].profile];
+            auto const dx = window_[i + 1] - window_[i];
+            maxVelocities.push_back(feedLimitedVelocity(profile.vel, dx, windowLimits_[i].feed));
+            maxAccelerations.push_back(blendAcceleration(profile.acc));
+        }
+        trajGen.setSegmentLimits(move(maxVelocities), move(maxAccelerations));
+        if (hasPreviousLine_) {
+            auto const &previous = limitProfiles_[previousLineLimits_];
+            trajGen.setMaxVelocity(previous.vel);
+            trajGen.setMaxAcceleration(blendAcceleration(previous.acc));
+            trajGen.setInitialVelocity(previousLineVelocity_, previousBlendDuration_);
+        }
+        trajGen.update();
+
+        segGen.setInitialVelocity(trajGen.initialVelocity());
+        segGen.setBlendDurations(move(trajGen.blendDurations()));
+        segGen.setDurations(move(trajGen.durations()));
+    }
+
+    // Velocities of axes along dx, which keep path speed in units within feed, feed and velocities
+    // are per tick. Feed limits only the line, blends are limited by accelerations.
+    Af feedLimitedVelocity(Af velocity, Ai const &dx, float feed) const {
+        if (!std::isfinite(feed)) {
+            return velocity;
+        }
+        auto const length = norm(axCast<float>(dx) / stepPerUnit_);
+        for (int i = 0; i < AxesTraits::size; ++i) {
+            if (dx[i] != 0) {
+                velocity[i] = std::min(velocity[i], feed * std::abs(dx[i]) / length);
+            }
+        }
+        return velocity;
+    }
+
+    void recordLastTrajectory(PackedSgs const &segments) {
+        if (!lastRecorded_ || segments.empty()) {
+            return;
+        }
+        if (last_.bytes() + segments.bytes() > rerunCapacity_) {
+            // Too long, also frees memory.
+            lastRecorded_ = false;
+            last_ = PackedSgs();
+            return;
+        }
+        last_.append(segments);
+        lastEndPosition_ = window_.front();
     }
 
     ISegmentsExecutor *executor_;
-    std::vector<Cmd> commands_;
+    // Commands which are not planned yet.
+    Commands commands_;
+    LimitProfiles limitProfiles_;
+    HomingProfiles homingProfiles_;
+    bool acknowledgedFull_{};
+    // Planned but not yet pushed to executor, segments of the next window wait in next_ until
+    // pending_ is pushed.
+    PackedSgs pending_;
+    PackedSgs next_;
+    // Planned before start to release profiles, see planBufferedCommands.
+    PackedSgs deferred_;
+    // Last trajectory for rerun, it is dropped if it doesn't fit into rerun capacity.
+    PackedSgs last_;
+    bool lastRecorded_{};
+    size_t rerunCapacity_{16384};
+    Ai lastStartPosition_{};
+    Ai lastEndPosition_{};
+    // Planning window.
+    size_t planningWindow_{};
+    TrajectoryPlanner planner_{TrajectoryPlanner::Blends};
+    bool jerkLimited_{};
+    bool streaming_{};
+    float stopMarginSec_{0.05f};
+    float maxFeedOverride_{1.f};
+    // Way-points which are not planned yet, the first one is the end of planned trajectory.
+    std::vector<Ai> window_;
+    struct SegmentLimits {
+        uint8_t profile;
+        float feed;
+    };
+    // Limits of segments between way-points of the window, references of moves are kept.
+    std::vector<SegmentLimits> windowLimits_;
+    // Last line of planned trajectory if it ends without stop blend.
+    bool hasPreviousLine_{};
+    uint8_t previousLineLimits_{LimitProfiles::none};
+    Af previousLineVelocity_{};
+    float previousBlendDuration_{};
     DistanceMode mode_;
+    // Modal feed of linear moves, infinite until F is set.
+    float feedUnitsPerMin_{inf()};
     Af homingVelUnitsPerSec_;
+    Af slowHomingVelUnitsPerSec_{axZero<Af>()};
+    Af homingBackOffUnits_{axZero<Af>()};
     Af maxVelUnitsPerSec_;
     Af maxAccUnitsPerSec2_;
     Af stepPerUnit_;
     Af minPosUnits_; // Can be inf
     Af maxPosUnits_; // Can be inf
     int32_t ticksPerSec_;
+    int32_t maxStepsPerTick_{1};
+    int32_t maxTickPeriod_{1};
     Printer *printer_;
+
+    static constexpr float minFeedOverride = 0.1f;
 };
 }
@@ -30,7 +30,11 @@ m103HomingVelocityOverride = [axesFloat] "\n"
 m104PrintInfo = "\n"
 m105MinPositionOverride = [axesFloat] "\n"
 m106MaxPositionOverride = [axesFloat] "\n"
+m107HomingBackOffOverride = [axesFloat] "\n"
+m108SlowHomingVelocityOverride = [axesFloat] "\n"
+m109FeedHold = "\n"
 m110PrintAxesConfiguration = "\n"
+m111RerunLastTrajectory = "\n"
 
 linearMove = axesWithFeedrate "\n"
 feedrateOverride = feedrate "\n"
@@ -38,7 +42,9 @@ gCommand = "G" integer ( g0RapidMove | g1LinearMove | g4Wait | g28RunHomingCycle
     g90AbsoluteDistanceMode | g91RelativeDistanceMode )
 mCommand = "M" integer ( m100MaxVelocityOverride | m101MaxAccelerationOverride |
     m102StepsPerUnitLengthOverride | m103HomingVelocityOverride | m104PrintInfo |
-    m105MinPositionOverride | m106MaxPositionOverride | m110PrintAxesConfiguration)
+    m105MinPositionOverride | m106MaxPositionOverride | m107HomingBackOffOverride |
+    m108SlowHomingVelocityOverride | m109FeedHold | m110PrintAxesConfiguration |
+    m111RerunLastTrajectory)
 start = "~" "\n"
 stop = "!" "\n"
 clearCommandsBuffer = "^" "\n"
@@ -62,7 +68,11 @@ struct IGCodeInterpreter {]
   void m104PrintInfo() const = 0;
   void m105MinPositionOverride(Af const &vel) {}
   void m106MaxPositionOverride(Af const &vel) {}
+  void m107HomingBackOffOverride(Af const &dist) {}
+  void m108SlowHomingVelocityOverride(Af const &vel) {}
+  void m109FeedHold() {}
   void m110PrintAxesConfiguration() {}
+  void m111RerunLastTrajectory() {}
   void error(const char *reason, const char *pos, const char *str) {}
   void start() {}
   void stop() {}
@@ -373,6 +383,34 @@ class GCodeParser {
         return true;
     }
 
+    bool m107HomingBackOffOverride() {
+        auto dist = axInf<Af>();
+        axesFloat(&dist);
+        if (!expectNewLine()) {
+            return false;
+        }
+        cb_->m107HomingBackOffOverride(dist);
+        return true;
+    }
+
+    bool m108SlowHomingVelocityOverride() {
+        auto vel = axInf<Af>();
+        axesFloat(&vel);
+        if (!expectNewLine()) {
+            return false;
+        }
+        cb_->m108SlowHomingVelocityOverride(vel);
+        return true;
+    }
+
+    bool m109FeedHold() {
+        if (!expectNewLine()) {
+            return false;
+        }
+        cb_->m109FeedHold();
+        return true;
+    }
+
     bool m110PrintAxesConfiguration() {
         if (!expectNewLine()) {
             return false;
@@ -381,6 +419,14 @@ class GCodeParser {
         return true;
     }
 
+    bool m111RerunLastTrajectory() {
+        if (!expectNewLine()) {
+            return false;
+        }
+        cb_->m111RerunLastTrajectory();
+        return true;
+    }
+
     bool mCommand() {
         if (!isMCommand()) {
             return false;
@@ -405,8 +451,16 @@ class GCodeParser {
             return m105MinPositionOverride();
         case 106:
             return m106MaxPositionOverride();
+        case 107:
+            return m107HomingBackOffOverride();
+        case 108:
+            return m108SlowHomingVelocityOverride();
+        case 109:
+            return m109FeedHold();
         case 110:
             return m110PrintAxesConfiguration();
+        case 111:
+            return m111RerunLastTrajectory();
         default:
             return error("unknown M command");
         }
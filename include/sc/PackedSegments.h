@@ -0,0 +1,316 @@
+#pragma once
+
+#include "Segment.h"
+
+#include <initializer_list>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+namespace StepperControl {
+
+enum class SegmentKind : uint32_t { Wait, Linear, Parabolic, Homing, Cubic };
+
+// Compact encoding of not started segments into 32 bit words.
+// Record is a header with kind in three high bits, flag of tick period in the next one and mask of
+// active axes in the others, then dt (twice dt for parabolic, thrice dt for cubic, -1 for homing),
+// tick period if it is not one and values of active axes only:
+//   Wait      -- nothing,
+//   Linear    -- dx,
+//   Parabolic -- dx1 and half of acceleration,
+//   Homing    -- velocity and deceleration,
+//   Cubic     -- dx1, dx2 and dx3.
+// Integration state is restored by unpack, so it is stored only for the executed segment.
+template <size_t AxesSize, typename Accum = int64_t>
+struct SegmentPacking {
+    static_assert(AxesSize <= 28, "Active axes should fit into header");
+
+    using Sg = Segment<AxesSize, Accum>;
+
+    static const int kindShift = 29;
+    static const uint32_t periodFlag = 1u << 28;
+    static const uint32_t axesMaskBits = periodFlag - 1;
+    static const size_t maxPackedSize = 3 + 3 * AxesSize;
+
+    static SegmentKind kind(Sg const &sg) {
+        if (sg.isHoming()) {
+            return SegmentKind::Homing;
+        }
+        if (sg.isCubic()) {
+            return SegmentKind::Cubic;
+        }
+        if (all(eq(sg.acceleration, 0)) && sg.denominator == 2 * static_cast<Accum>(sg.dt)) {
+            return SegmentKind::Linear;
+        }
+        if (sg.axesMask == 0 && sg.denominator == 1) {
+            return SegmentKind::Wait;
+        }
+        return SegmentKind::Parabolic;
+    }
+
+    static size_t wordsPerAxis(SegmentKind kind) {
+        switch (kind) {
+        case SegmentKind::Wait:
+            return 0;
+        case SegmentKind::Parabolic:
+        case SegmentKind::Homing:
+            return 2;
+        case SegmentKind::Cubic:
+            return 3;
+        default:
+            return 1;
+        }
+    }
+
+    // Number of words in record starting with header.
+    FORCE_INLINE static size_t packedSize(int32_t header) {
+        auto const bits = static_cast<uint32_t>(header);
+        size_t count = 0;
+        for (auto mask = bits & axesMaskBits; mask != 0; mask &= mask - 1) {
+            ++count;
+        }
+        auto const periodWords = (bits & periodFlag) != 0 ? 1 : 0;
+        return 2 + periodWords + count * wordsPerAxis(static_cast<SegmentKind>(bits >> kindShift));
+    }
+
+    // Writes record of not started segment to words, which should have space for maxPackedSize
+    // words. Returns number of written words.
+    static size_t pack(Sg const &sg, int32_t *words) {
+        scAssert(all(eq(sg.error, 0)));
+
+        auto const k = kind(sg);
+        auto const flag = sg.period != 1 ? periodFlag : 0;
+        auto const header = (static_cast<uint32_t>(k) << kindShift) | flag | sg.axesMask;
+        words[0] = static_cast<int32_t>(header);
+        words[1] = sg.dt;
+        size_t n = 2;
+        if (flag != 0) {
+            words[n++] = sg.period;
+        }
+        for (size_t i = 0; i < AxesSize; ++i) {
+            if (((sg.axesMask >> i) & 1u) == 0) {
+                continue;
+            }
+            switch (k) {
+            case SegmentKind::Linear:
+                words[n++] = static_cast<int32_t>(sg.velocity[i] / 2);
+                break;
+            case SegmentKind::Parabolic: {
+                auto const halfA = sg.acceleration[i] / 2;
+                auto const twiceDt = static_cast<int64_t>(sg.dt);
+                words[n++] = static_cast<int32_t>((sg.velocity[i] - halfA) / (2 * twiceDt));
+                words[n++] = halfA;
+            } break;
+            case SegmentKind::Homing:
+                words[n++] = static_cast<int32_t>(sg.velocity[i]);
+                words[n++] = sg.acceleration[i];
+                break;
+            case SegmentKind::Cubic: {
+                // Inverse of coefficients of the cubic segment constructor.
+                auto const T = static_cast<int64_t>(sg.dt);
+                auto const c3 = static_cast<int64_t>(sg.jerk[i] / 6);
+                auto const c2 = (sg.acceleration[i] - 6 * c3) / 2;
+                auto const c1 = static_cast<int64_t>(sg.velocity[i]) - c2 - c3;
+                auto const dx1 = c1 / (3 * T * T);
+                auto const dx2 = dx1 + c2 / (3 * T);
+                words[n++] = static_cast<int32_t>(dx1);
+                words[n++] = static_cast<int32_t>(dx2);
+                words[n++] = static_cast<int32_t>(c3 + 2 * dx2 - dx1);
+            } break;
+            case SegmentKind::Wait:
+                break;
+            }
+        }
+        return n;
+    }
+
+    // Restores segment from record. Words is anything indexable from the header, e.g. a pointer
+    // or a ring buffer.
+    template <typename TWords>
+    FORCE_INLINE static void unpack(TWords const &words, Sg &sg) {
+        auto const header = static_cast<uint32_t>(words[0]);
+        auto const k = static_cast<SegmentKind>(header >> kindShift);
+        auto const mask = header & axesMaskBits;
+        auto const dt = words[1];
+
+        sg.dt = dt;
+        sg.axesMask = mask;
+        sg.period = 1;
+        sg.acceleration.fill(0);
+        sg.jerk.fill(0);
+        sg.velocity.fill(0);
+        sg.error.fill(0);
+
+        switch (k) {
+        case SegmentKind::Wait:
+            sg.denominator = 1;
+            break;
+        case SegmentKind::Linear:
+            sg.denominator = 2 * static_cast<Accum>(dt);
+            break;
+        case SegmentKind::Parabolic:
+            sg.denominator = static_cast<Accum>(dt) * dt;
+            break;
+        case SegmentKind::Homing:
+            sg.denominator = 2 * static_cast<Accum>(Sg::maxDt);
+            break;
+        case SegmentKind::Cubic:
+            sg.denominator = static_cast<Accum>(dt) * dt * dt;
+            break;
+        }
+
+        size_t n = 2;
+        if ((header & periodFlag) != 0) {
+            sg.period = words[n++];
+        }
+        for (size_t i = 0; i < AxesSize; ++i) {
+            if (((mask >> i) & 1u) == 0) {
+                continue;
+            }
+            switch (k) {
+            case SegmentKind::Linear:
+                sg.velocity[i] = 2 * static_cast<Accum>(words[n++]);
+                break;
+            case SegmentKind::Parabolic: {
+                auto const dx1 = static_cast<Accum>(words[n++]);
+                auto const halfA = words[n++];
+                sg.velocity[i] = 2 * static_cast<Accum>(dt) * dx1 + halfA;
+                sg.acceleration[i] = 2 * halfA;
+            } break;
+            case SegmentKind::Homing:
+                sg.velocity[i] = words[n++];
+                sg.acceleration[i] = words[n++];
+                break;
+            case SegmentKind::Cubic: {
+                auto const T = static_cast<int64_t>(dt);
+                auto const dx1 = static_cast<int64_t>(words[n++]);
+                auto const dx2 = static_cast<int64_t>(words[n++]);
+                auto const dx3 = static_cast<int64_t>(words[n++]);
+                auto const c2 = 3 * T * (dx2 - dx1);
+                auto const c3 = dx3 - 2 * dx2 + dx1;
+                sg.velocity[i] = static_cast<Accum>(3 * T * T * dx1 + c2 + c3);
+                sg.acceleration[i] = static_cast<int32_t>(2 * c2 + 6 * c3);
+                sg.jerk[i] = static_cast<int32_t>(6 * c3);
+            } break;
+            case SegmentKind::Wait:
+                break;
+            }
+        }
+    }
+};
+
+// Sequence of segments stored in packed records, see SegmentPacking.
+// Iterators give unpacked copies of segments and are invalidated by push_back like ones of vector.
+template <size_t AxesSize, typename Accum = int64_t>
+class PackedSegments {
+  public:
+    using Packing = SegmentPacking<AxesSize, Accum>;
+    using Sg = Segment<AxesSize, Accum>;
+    using value_type = Sg;
+
+    class const_iterator {
+      public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Sg;
+        using difference_type = ptrdiff_t;
+        using pointer = Sg const *;
+        using reference = Sg;
+
+        const_iterator() = default;
+
+        explicit const_iterator(int32_t const *words) : words_(words) {}
+
+        Sg operator*() const {
+            Sg sg(0);
+            Packing::unpack(words_, sg);
+            return sg;
+        }
+
+        const_iterator &operator++() {
+            words_ += Packing::packedSize(*words_);
+            return *this;
+        }
+
+        const_iterator operator++(int) {
+            auto old = *this;
+            ++*this;
+            return old;
+        }
+
+        // Record of the segment.
+        int32_t const *words() const { return words_; }
+
+        friend bool operator==(const_iterator const &lhs, const_iterator const &rhs) {
+            return lhs.words_ == rhs.words_;
+        }
+
+        friend bool operator!=(const_iterator const &lhs, const_iterator const &rhs) {
+            return !(lhs == rhs);
+        }
+
+      private:
+        int32_t const *words_{};
+    };
+
+    PackedSegments() = default;
+
+    PackedSegments(std::initializer_list<Sg> segments) {
+        for (auto const &sg : segments) {
+            push_back(sg);
+        }
+    }
+
+    void push_back(Sg const &segment) {
+        int32_t record[Packing::maxPackedSize];
+        auto const n = Packing::pack(segment, record);
+        words_.insert(words_.end(), record, record + n);
+        ++size_;
+    }
+
+    template <typename... Args>
+    void emplace_back(Args &&... args) {
+        push_back(Sg(std::forward<Args>(args)...));
+    }
+
+    void append(PackedSegments const &other) {
+        words_.insert(words_.end(), other.words_.begin() + other.begin_, other.words_.end());
+        size_ += other.size_;
+    }
+
+    Sg front() const { return *begin(); }
+
+    // Memory of removed segments is reused when all of them are removed.
+    void pop_front() {
+        scAssert(size_ > 0);
+        begin_ += Packing::packedSize(words_[begin_]);
+        if (--size_ == 0) {
+            clear();
+        }
+    }
+
+    const_iterator begin() const { return const_iterator(words_.data() + begin_); }
+
+    const_iterator end() const { return const_iterator(words_.data() + words_.size()); }
+
+    size_t size() const { return size_; }
+
+    bool empty() const { return size_ == 0; }
+
+    // Memory used by records.
+    size_t bytes() const { return (words_.size() - begin_) * sizeof(int32_t); }
+
+    void clear() {
+        words_.clear();
+        begin_ = 0;
+        size_ = 0;
+    }
+
+  private:
+    std::vector<int32_t> words_;
+    size_t begin_{};
+    size_t size_{};
+};
+
+template <size_t size, typename Accum = int64_t>
+using TPackedSgs = PackedSegments<size, Accum>;
+}
@@ -0,0 +1,301 @@
+#pragma once
+
+#include "Axes.h"
+
+#include <cmath>
+#include <vector>
+
+namespace StepperControl {
+/*
+Alternative to PathToTrajectoryConverter with the same output: parabolic blends at way-points and
+linear segments between them, but velocities are chosen to make the trajectory close to
+time-optimal.
+
+Every segment moves with its own speed s_i = 1/dT_i, at most the velocity limit
+s_i <= min_j(vmax[j]/|q_i+1[j] - q_i[j]|).
+
+Blend at way-point i changes velocity from v_i-1 to v_i
+tb_i = max_j(|v_i[j] - v_i-1[j]|/amax[j])
+and fits if it takes at most half of the neighboring segments, with a tick left for rounding
+tb_i <= min(dT_i-1, dT_i) - 1
+
+Speeds start from the velocity limits. If a blend does not fit, its shorter neighbor is slowed
+down, but not below the speed of the other one: forward pass slows down segments after blends,
+backward pass segments before them. So long segments keep their speed and only as much is lost as
+the blend needs. If a blend does not fit even between segments of equal durations, both are slowed
+down by the same factor. Passes are repeated until all blends fit.
+
+Trajectory can continue motion of the previous one and limits can differ between segments the same
+way as in PathToTrajectoryConverter.
+*/
+template <size_t AxesSize, typename Real = float>
+class PathToTimeOptimalTrajectoryConverter {
+  public:
+    using Af = Axes<Real, AxesSize>;
+    using Ai = Axes<int32_t, AxesSize>;
+
+    explicit PathToTimeOptimalTrajectoryConverter(std::vector<Ai> &path) : path_(path) {
+        maxVelocity_.fill(0.5f);
+        maxAcceleration_.fill(0.1f);
+    }
+
+    // Should be less or equal that 0.4 to proper segment generation, or than
+    // max steps per tick - 0.6 if segments can make more steps per tick.
+    // In steps per tick.
+    void setMaxVelocity(Af const &maxVel) {
+        scAssert(all(gt(maxVel, axZero<Af>())));
+        maxVelocity_ = maxVel;
+    }
+
+    // In steps per tick^2. See PathToTrajectoryConverter::setMaxAcceleration.
+    void setMaxAcceleration(Af const &maxAccel) {
+        scAssert(all(gt(maxAccel, axZero<Af>())));
+        maxAcceleration_ = maxAccel;
+    }
+
+    // See PathToTrajectoryConverter::setSegmentLimits.
+    void setSegmentLimits(std::vector<Af> maxVelocities, std::vector<Af> maxAccelerations) {
+        scAssert(maxVelocities.size() == maxAccelerations.size());
+        segmentMaxVelocities_ = move(maxVelocities);
+        segmentMaxAccelerations_ = move(maxAccelerations);
+    }
+
+    // See PathToTrajectoryConverter::setInitialVelocity.
+    void setInitialVelocity(Af const &velocity, Real maxBlendDuration) {
+        scAssert(maxBlendDuration >= 0);
+        initialVelocity_ = velocity;
+        maxInitialBlendDuration_ = maxBlendDuration;
+    }
+
+    // Velocity the first blend starts with, it is zero if trajectory starts from rest.
+    Af const &initialVelocity() const { return initialVelocity_; }
+
+    void update() {
+        scAssert(!path_.empty());
+        resizeVectorsToFitPath();
+        calculateMaxSpeeds();
+        fitFirstBlendIntoInitialOne();
+        limitSpeedsByBlends();
+        calculateTrajectory();
+    }
+
+    std::vector<Af> const &velocities() const { return velocities_; }
+
+    std::vector<Af> const &accelerations() const { return accelerations_; }
+
+    std::vector<Real> const &durations() const { return Dts_; }
+
+    std::vector<Real> &durations() { return Dts_; }
+
+    std::vector<Real> const &blendDurations() const { return tbs_; }
+
+    std::vector<Real> &blendDurations() { return tbs_; }
+
+    Af const &maxVelocity() const { return maxVelocity_; }
+
+    Af const &maxAcceleration() const { return maxAcceleration_; }
+
+  private:
+    static constexpr Real minContinuationFactor = 0.5f;
+    static constexpr Real eps = 1e-5f;
+    static const int bisectionSteps = 24;
+
+    Af const &segmentMaxVelocity(size_t i) const {
+        return segmentMaxVelocities_.empty() ? maxVelocity_ : segmentMaxVelocities_[i];
+    }
+
+    Af blendMaxAcceleration(size_t i) const {
+        auto const &limits = segmentMaxAccelerations_;
+        if (limits.empty()) {
+            return maxAcceleration_;
+        }
+        auto const &after = limits[std::min(i, limits.size() - 1)];
+        if (i == 0) {
+            auto const continues = any(neq(initialVelocity_, axZero<Af>()));
+            return continues ? axMin(maxAcceleration_, after) : after;
+        }
+        return axMin(limits[i - 1], after);
+    }
+
+    void resizeVectorsToFitPath() {
+        speeds_.resize(path_.size() - 1);
+        velocities_.resize(path_.size() - 1);
+        Dts_.resize(path_.size() - 1);
+        accelerations_.resize(path_.size());
+        tbs_.resize(path_.size());
+    }
+
+    void calculateMaxSpeeds() {
+        for (size_t i = 0; i < path_.size() - 1; i++) {
+            // Segment takes at least a tick, which also covers repeated way-points.
+            Real Dt = 1.0f;
+            for (size_t j = 0; j < AxesSize; j++) {
+                auto const dx = std::abs(path_[i + 1][j] - path_[i][j]);
+                Dt = std::max(Dt, dx / segmentMaxVelocity(i)[j]);
+            }
+            speeds_[i] = 1.0f / Dt;
+        }
+    }
+
+    void fitFirstBlendIntoInitialOne() {
+        if (all(eq(initialVelocity_, axZero<Af>())) || path_.size() < 2) {
+            initialVelocity_.fill(0);
+            return;
+        }
+        auto maxSpeed = speeds_[0];
+        // Blend duration is convex in the speed and at zero speed it is the stop blend, which
+        // doesn't fit with lower acceleration than the previous line had. If it fits, later
+        // slowdowns of the first segment keep the first blend within the initial one.
+        speeds_[0] = 0.0f;
+        auto const stopFits = fits(0);
+        speeds_[0] = maxSpeed;
+        if (!stopFits || !lowerSpeedToFit(0, 0, minContinuationFactor * maxSpeed)) {
+            // Sharp turn or lower acceleration, stop first.
+            initialVelocity_.fill(0);
+            speeds_[0] = maxSpeed;
+        }
+    }
+
+    Af velocity(size_t i) const { return axCast<Real>(path_[i + 1] - path_[i]) * speeds_[i]; }
+
+    Af previousVelocity(size_t i) const { return i == 0 ? initialVelocity_ : velocity(i - 1); }
+
+    Af nextVelocity(size_t i) const {
+        return i == path_.size() - 1 ? axZero<Af>() : velocity(i);
+    }
+
+    Real blendDuration(size_t i) const {
+        auto dv = nextVelocity(i) - previousVelocity(i);
+        auto const maxAcceleration = blendMaxAcceleration(i);
+        Real tb = 0.0f;
+        for (size_t j = 0; j < AxesSize; j++) {
+            tb = std::max(tb, std::abs(dv[j]) / maxAcceleration[j]);
+        }
+        return tb;
+    }
+
+    bool fits(size_t i) const {
+        auto tb = blendDuration(i);
+        if (i == 0 && any(neq(initialVelocity_, axZero<Af>())) &&
+            tb > maxInitialBlendDuration_ * (1 + eps)) {
+            return false;
+        }
+        // A tick is left for rounding of durations up to whole ticks.
+        if (i > 0 && (tb + 1) * speeds_[i - 1] > 1 + eps) {
+            return false;
+        }
+        if (i < path_.size() - 1 && (tb + 1) * speeds_[i] > 1 + eps) {
+            return false;
+        }
+        return true;
+    }
+
+    // Sets speed of segment k to the largest one from low to the current one, for which blend i
+    // fits. Returns false and leaves low if blend does not fit even with it.
+    bool lowerSpeedToFit(size_t i, size_t k, Real low) {
+        auto high = speeds_[k];
+        speeds_[k] = low;
+        if (!fits(i)) {
+            return false;
+        }
+        for (int n = 0; n < bisectionSteps; n++) {
+            speeds_[k] = 0.5f * (low + high);
+            if (fits(i)) {
+                low = speeds_[k];
+            } else {
+                high = speeds_[k];
+            }
+        }
+        speeds_[k] = low;
+        return true;
+    }
+
+    // Slows down the shorter neighbor of the blend, which it doesn't fit, if the neighbor is after
+    // the blend in forward pass or before it in backward one. Returns true if speeds were changed.
+    bool fitBlend(size_t i, bool forward) {
+        if (fits(i)) {
+            return false;
+        }
+        auto const last = path_.size() - 1;
+        if (i == 0 || i == last) {
+            // Starts or stops motion, the segment can be slowed down until the blend fits.
+            auto k = i == 0 ? 0 : last - 1;
+            lowerSpeedToFit(i, k, 0.0f);
+            return true;
+        }
+
+        auto shorterAfter = speeds_[i] > speeds_[i - 1];
+        if (shorterAfter != forward) {
+            return false;
+        }
+        auto k = shorterAfter ? i : i - 1;
+        if (!lowerSpeedToFit(i, k, std::min(speeds_[i - 1], speeds_[i]))) {
+            // Corner is too sharp for equal durations.
+            scaleSpeedsToFit(i);
+        }
+        return true;
+    }
+
+    // Slows down both neighbors of the blend by the largest common factor, for which it fits.
+    void scaleSpeedsToFit(size_t i) {
+        auto const before = speeds_[i - 1];
+        auto const after = speeds_[i];
+        Real low = 0.0f;
+        Real high = 1.0f;
+        for (int n = 0; n < bisectionSteps; n++) {
+            auto f = 0.5f * (low + high);
+            speeds_[i - 1] = f * before;
+            speeds_[i] = f * after;
+            if (fits(i)) {
+                low = f;
+            } else {
+                high = f;
+            }
+        }
+        speeds_[i - 1] = low * before;
+        speeds_[i] = low * after;
+    }
+
+    void limitSpeedsByBlends() {
+        auto const size = path_.size();
+        for (auto changed = true; changed;) {
+            changed = false;
+            for (size_t i = 0; i < size; i++) {
+                changed = fitBlend(i, true) || changed;
+            }
+            for (size_t i = size; i-- > 0;) {
+                changed = fitBlend(i, false) || changed;
+            }
+        }
+    }
+
+    void calculateTrajectory() {
+        for (size_t i = 0; i < path_.size() - 1; i++) {
+            Dts_[i] = 1.0f / speeds_[i];
+            velocities_[i] = velocity(i);
+        }
+        for (size_t i = 0; i < path_.size(); i++) {
+            tbs_[i] = blendDuration(i);
+            if (i == 0 && any(neq(initialVelocity_, axZero<Af>()))) {
+                // Rounded up to ticks the first blend should still fit into the initial one.
+                tbs_[0] = std::min(tbs_[0], maxInitialBlendDuration_);
+            }
+            accelerations_[i] =
+                tbs_[i] > 0 ? (nextVelocity(i) - previousVelocity(i)) / tbs_[i] : axZero<Af>();
+        }
+    }
+
+    std::vector<Ai> &path_; // In steps.
+    std::vector<Real> speeds_; // Part of segment per tick.
+    std::vector<Af> velocities_;
+    std::vector<Af> accelerations_;
+    std::vector<Real> Dts_;
+    std::vector<Real> tbs_;
+    Af maxVelocity_;
+    Af maxAcceleration_;
+    std::vector<Af> segmentMaxVelocities_;
+    std::vector<Af> segmentMaxAccelerations_;
+    Af initialVelocity_{};
+    Real maxInitialBlendDuration_{};
+};
+}
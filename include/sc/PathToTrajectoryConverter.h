@@ -18,6 +18,13 @@ a_i = (v_i - v_i-1)/tb_i
 
 Apply slow down factor to velocities if blends overlap.
 f_i = sqrt(min(dT_i-1, dT_i)/tb_i)
+
+Trajectory can continue motion of the previous one instead of starting from rest. Then the first
+blend starts with velocity of the last line of the previous trajectory and should fit into the
+stop blend which that trajectory reserved, so the first segment is slowed down if necessary.
+
+Limits can differ between segments, then vmax is of the segment and amax of a blend is the least of
+its neighbors, so the path doesn't stop where limits change.
 */
 template <size_t AxesSize, typename Real = float>
 class PathToTrajectoryConverter {
@@ -30,62 +37,79 @@ class PathToTrajectoryConverter {
         maxAcceleration_.fill(0.1f);
     }
 
-    // Should be less or equal that 0.4 to proper segment generation.
+    // Should be less or equal that 0.4 to proper segment generation, or than
+    // max steps per tick - 0.6 if segments can make more steps per tick.
     // In steps per tick.
     void setMaxVelocity(Af const &maxVel) {
         scAssert(all(gt(maxVel, axZero<Af>())));
         maxVelocity_ = maxVel;
     }
 
-    // In steps per tick^2.
+    // In steps per tick^2. With segment limits it is the limit of the last line of the previous
+    // trajectory, see setInitialVelocity.
     void setMaxAcceleration(Af const &maxAccel) {
         scAssert(all(gt(maxAccel, axZero<Af>())));
         maxAcceleration_ = maxAccel;
     }
 
+    // Limits of segments between way-points, they replace max velocity and acceleration.
+    void setSegmentLimits(std::vector<Af> maxVelocities, std::vector<Af> maxAccelerations) {
+        scAssert(maxVelocities.size() == maxAccelerations.size());
+        segmentMaxVelocities_ = move(maxVelocities);
+        segmentMaxAccelerations_ = move(maxAccelerations);
+    }
+
+    // Previous trajectory ended at the first way-point with a line of given velocity, which was
+    // truncated for a stop blend of maxBlendDuration. If the first segment would have to be slowed
+    // down more than minContinuationFactor to fit the blend, trajectory starts from rest instead.
+    void setInitialVelocity(Af const &velocity, Real maxBlendDuration) {
+        scAssert(maxBlendDuration >= 0);
+        initialVelocity_ = velocity;
+        maxInitialBlendDuration_ = maxBlendDuration;
+    }
+
+    // Velocity the first blend starts with, it is zero if trajectory starts from rest.
+    Af const &initialVelocity() const { return initialVelocity_; }
+
     // Remove way-point if difference between it and next is less than threshold for all axes.
-    // Does not remove first or last way-points.
+    // Close interior way-points are replaced by their average. Does not remove first or last
+    // way-points. Path is compacted in place in a single pass. Unlike repeated passes over pairs,
+    // a merged way-point is checked against the previous one at once, so a chain of close
+    // way-points is merged from its start, e.g. 50, 52, 54, 56 become 54 instead of 53.
     void removeCloseWaypoints(Ai const &threshold) {
         scAssert(all(ge(threshold, axZero<Ai>())));
 
-        auto remove = true;
-        while (remove) {
-            remove = false;
-            auto it = path_.begin();
-            auto next = it;
-            if (next != path_.end()) {
-                ++next;
+        auto close = [&](Ai const &a, Ai const &b) { return all(le(axAbs(a - b), threshold)); };
+
+        // Way-points up to top are already compacted.
+        size_t top = 0;
+        for (size_t i = 1; i < path_.size(); ++i) {
+            auto const point = path_[i];
+            if (i + 1 == path_.size()) {
+                // Last way-point replaces close ones.
+                while (top > 0 && close(path_[top], point)) {
+                    --top;
+                }
+                path_[++top] = point;
+                break;
             }
-            while (next != path_.end()) {
-                if (all(le(axAbs(*it - *next), threshold))) {
-                    remove = true;
-                    auto nextNext = next;
-                    ++nextNext;
-                    if (it == path_.begin()) {
-                        it = path_.erase(next);
-                    } else if (nextNext == path_.end()) {
-                        it = path_.erase(it);
-                    } else {
-                        *it = (*it + *next) / 2;
-                        ++it;
-                        it = path_.erase(it);
-                    }
-                    next = it;
-                    if (next != path_.end()) {
-                        ++next;
-                    }
-                } else {
-                    it = next;
-                    ++next;
+            path_[++top] = point;
+            // Merged way-point can be close to the previous one too.
+            while (top > 0 && close(path_[top - 1], path_[top])) {
+                if (top > 1) {
+                    path_[top - 1] = (path_[top - 1] + path_[top]) / 2;
                 }
+                --top;
             }
         }
+        path_.resize(std::min(path_.size(), top + 1));
     }
 
     void update() {
         scAssert(!path_.empty());
         resizeVectorsToFitPath();
         calculateTimeBetweenWaypointsAndInitialVelocitiesOfLinearSegments();
+        fitFirstBlendIntoInitialOne();
         applySlowDownFactor();
     }
 
@@ -106,6 +130,24 @@ class PathToTrajectoryConverter {
     Af const &maxAcceleration() const { return maxAcceleration_; }
 
   private:
+    Af const &segmentMaxVelocity(size_t i) const {
+        return segmentMaxVelocities_.empty() ? maxVelocity_ : segmentMaxVelocities_[i];
+    }
+
+    // Blend respects limits of both neighbors, the first one continues the previous trajectory.
+    Af blendMaxAcceleration(size_t i) const {
+        auto const &limits = segmentMaxAccelerations_;
+        if (limits.empty()) {
+            return maxAcceleration_;
+        }
+        auto const &after = limits[std::min(i, limits.size() - 1)];
+        if (i == 0) {
+            auto const continues = any(neq(initialVelocity_, axZero<Af>()));
+            return continues ? axMin(maxAcceleration_, after) : after;
+        }
+        return axMin(limits[i - 1], after);
+    }
+
     void resizeVectorsToFitPath() {
         velocities_.resize(path_.size() - 1);
         Dts_.resize(path_.size() - 1);
@@ -117,54 +159,168 @@ class PathToTrajectoryConverter {
         for (size_t i = 0; i < path_.size() - 1; i++) {
             Dts_[i] = 0.0f;
             for (size_t j = 0; j < path_[i].size(); j++) {
-                Dts_[i] =
-                    std::max(Dts_[i], (std::abs(path_[i + 1][j] - path_[i][j]) / maxVelocity_[j]));
+                Dts_[i] = std::max(Dts_[i], (std::abs(path_[i + 1][j] - path_[i][j]) /
+                                             segmentMaxVelocity(i)[j]));
             }
             velocities_[i] = axCast<Real>(path_[i + 1] - path_[i]) / Dts_[i];
         }
     }
 
-    void applySlowDownFactor() {
+    static constexpr Real minContinuationFactor = 0.5f;
+    // Relative tolerance of the first blend duration for rounding errors.
+    static constexpr Real initialBlendEps = 1e-5f;
+
+    // Slows down the first segment so that the first blend from initial velocity is not longer
+    // than the initial one. Duration of the blend is convex in the factor and at zero it is the
+    // stop blend with the first blend acceleration, so if the stop blend fits, every factor from
+    // zero to the found one keeps the blend short enough. Stop blend doesn't fit if the first
+    // segment has lower acceleration than the previous line, then trajectory starts from rest.
+    void fitFirstBlendIntoInitialOne() {
+        if (all(eq(initialVelocity_, axZero<Af>())) || path_.size() < 2) {
+            initialVelocity_.fill(0);
+            return;
+        }
+        auto const maxAcceleration = blendMaxAcceleration(0);
+        auto const maxDuration = maxInitialBlendDuration_ * (1 + initialBlendEps);
+        if (!all(le(axAbs(initialVelocity_), maxAcceleration * maxDuration))) {
+            // Lower acceleration, stop first.
+            initialVelocity_.fill(0);
+            return;
+        }
+        Real factor = 1.0f;
+        for (size_t j = 0; j < AxesSize; j++) {
+            auto v = initialVelocity_[j];
+            auto u = velocities_[0][j];
+            auto dv = maxAcceleration[j] * maxInitialBlendDuration_;
+            if (u > 0) {
+                factor = std::min(factor, (v + dv) / u);
+            } else if (u < 0) {
+                factor = std::min(factor, (v - dv) / u);
+            }
+        }
+        if (factor < minContinuationFactor) {
+            // Sharp turn, stop first.
+            initialVelocity_.fill(0);
+            return;
+        }
+        velocities_[0] *= factor;
+        Dts_[0] = Dts_[0] / factor;
+    }
+
+    // Calculate blend duration and acceleration.
+    void updateBlend(size_t i) {
+        Af previousVelocity = (i == 0) ? initialVelocity_ : velocities_[i - 1];
+        Af nextVelocity = (i == path_.size() - 1) ? axConst<Af>(0.f) : velocities_[i];
+        auto const maxAcceleration = blendMaxAcceleration(i);
+        tbs_[i] = 0.0f;
+        for (size_t j = 0; j < path_[i].size(); j++) {
+            tbs_[i] = std::max(tbs_[i], (abs(nextVelocity[j] - previousVelocity[j]) /
+                                         maxAcceleration[j]));
+        }
+        if (i == 0 && any(neq(initialVelocity_, axZero<Af>()))) {
+            // Rounded up to ticks the first blend should still fit into the initial one.
+            scAssert(tbs_[0] <= maxInitialBlendDuration_ * (1 + initialBlendEps));
+            tbs_[0] = std::min(tbs_[0], maxInitialBlendDuration_);
+        }
+        accelerations_[i] = (nextVelocity - previousVelocity) / tbs_[i];
+    }
+
+    // Slow down factor such that the blend phase replaces at most half of the neighboring linear
+    // trajectory, or 1 if it already does.
+    Real slowDownFactor(size_t i) const {
         constexpr auto eps = 1e-6f;
 
-        int numBlendsSlowedDown = std::numeric_limits<int>::max();
-        std::vector<Real> slowDownFactors(path_.size());
-        while (numBlendsSlowedDown >= 1) {
-            numBlendsSlowedDown = 0;
-            fill(slowDownFactors.begin(), slowDownFactors.end(), 1.0f);
-
-            for (size_t i = 0; i < path_.size(); i++) {
-                // Calculate blend duration and acceleration.
-                Af previousVelocity = (i == 0) ? axConst<Af>(0.f) : velocities_[i - 1];
-                Af nextVelocity = (i == path_.size() - 1) ? axConst<Af>(0.f) : velocities_[i];
-                tbs_[i] = 0.0f;
-                for (size_t j = 0; j < path_[i].size(); j++) {
-                    tbs_[i] = std::max(
-                        tbs_[i],
-                        (abs(nextVelocity[j] - previousVelocity[j]) / maxAcceleration_[j]));
-                    accelerations_[i] = (nextVelocity - previousVelocity) / tbs_[i];
+        if ((i > 0 && tbs_[i] > Dts_[i - 1] + eps &&
+             tbs_[i - 1] + tbs_[i] > 2.f * Dts_[i - 1] + eps) ||
+            (i < path_.size() - 1 && tbs_[i] > Dts_[i] + eps &&
+             tbs_[i] + tbs_[i + 1] > 2.f * Dts_[i] + eps)) {
+            auto maxDuration =
+                std::min(i == 0 ? std::numeric_limits<Real>::max() : Dts_[i - 1],
+                         i == path_.size() - 1 ? std::numeric_limits<Real>::max() : Dts_[i]);
+            return std::sqrt(maxDuration / tbs_[i]);
+        }
+        return 1.0f;
+    }
+
+    // Slows down segments until every blend fits. Blends are processed in rounds in path order,
+    // the check of a blend sees durations of previous blends from the current round and of next
+    // ones from the previous round. Blend durations depend only on velocities of neighboring
+    // segments, so in every round only blends next to the slowed down segments and blends which
+    // check them are revisited. Others would give the same result as in the previous round.
+    void applySlowDownFactor() {
+        auto const size = path_.size();
+
+        std::vector<Real> slowDownFactors(size, 1.0f);
+        std::vector<int> updatedInRound(size, 0);
+        // Blends with changed neighboring segments in the current and previous rounds.
+        std::vector<size_t> updated(size);
+        for (size_t i = 0; i < size; i++) {
+            updated[i] = i;
+        }
+        std::vector<size_t> previousUpdated;
+        std::vector<size_t> checked;
+        std::vector<size_t> slowedDown;
+        std::vector<size_t> slowedSegments;
+
+        auto sortUnique = [](std::vector<size_t> &v) {
+            std::sort(v.begin(), v.end());
+            v.erase(std::unique(v.begin(), v.end()), v.end());
+        };
+
+        for (int round = 1; !updated.empty(); round++) {
+            checked.clear();
+            for (auto i : updated) {
+                updatedInRound[i] = round;
+                checked.push_back(i);
+                if (i + 1 < size) {
+                    checked.push_back(i + 1);
+                }
+            }
+            for (auto i : previousUpdated) {
+                if (i > 0) {
+                    checked.push_back(i - 1);
                 }
+            }
+            sortUnique(checked);
 
-                // Calculate slow down factor such that the blend phase replaces at most half of the
-                // neighboring linear trajectory.
-                if ((i > 0 && tbs_[i] > Dts_[i - 1] + eps &&
-                     tbs_[i - 1] + tbs_[i] > 2.f * Dts_[i - 1] + eps) ||
-                    (i < path_.size() - 1 && tbs_[i] > Dts_[i] + eps &&
-                     tbs_[i] + tbs_[i + 1] > 2.f * Dts_[i] + eps)) {
-                    numBlendsSlowedDown++;
-                    auto maxDuration = std::min(
-                        i == 0 ? std::numeric_limits<Real>::max() : Dts_[i - 1],
-                        i == path_.size() - 1 ? std::numeric_limits<Real>::max() : Dts_[i]);
-                    slowDownFactors[i] = std::sqrt(maxDuration / tbs_[i]);
+            slowedDown.clear();
+            for (auto i : checked) {
+                if (updatedInRound[i] == round) {
+                    updateBlend(i);
+                }
+                slowDownFactors[i] = slowDownFactor(i);
+                if (slowDownFactors[i] != 1.0f) {
+                    slowedDown.push_back(i);
                 }
             }
 
             // Apply slow down factors to linear trajectory.
-            for (size_t i = 0; i < path_.size() - 1; i++) {
+            slowedSegments.clear();
+            for (auto i : slowedDown) {
+                if (i > 0) {
+                    slowedSegments.push_back(i - 1);
+                }
+                if (i < size - 1) {
+                    slowedSegments.push_back(i);
+                }
+            }
+            sortUnique(slowedSegments);
+            for (auto i : slowedSegments) {
                 auto f = std::min(slowDownFactors[i], slowDownFactors[i + 1]);
                 velocities_[i] *= f;
                 Dts_[i] = Dts_[i] / f;
             }
+            for (auto i : slowedDown) {
+                slowDownFactors[i] = 1.0f;
+            }
+
+            previousUpdated.swap(updated);
+            updated.clear();
+            for (auto i : slowedSegments) {
+                updated.push_back(i);
+                updated.push_back(i + 1);
+            }
+            sortUnique(updated);
         }
     }
 
@@ -175,5 +331,9 @@ class PathToTrajectoryConverter {
     std::vector<Real> tbs_;
     Af maxVelocity_;
     Af maxAcceleration_;
+    std::vector<Af> segmentMaxVelocities_;
+    std::vector<Af> segmentMaxAccelerations_;
+    Af initialVelocity_{};
+    Real maxInitialBlendDuration_{};
 };
 }
@@ -0,0 +1,123 @@
+#pragma once
+
+#include "Common.h"
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+
+namespace StepperControl {
+
+// Bounded lock-free queue for single producer and single consumer.
+// Producer (main loop) only calls push, consumer (ISR) only calls front, operator[] and pop.
+// Head is written only by consumer and tail only by producer, so no locks are required.
+// Capacity should be a power of two to make index wrapping cheap.
+template <typename T, size_t Capacity>
+class RingBuffer {
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0,
+                  "Capacity should be a power of two");
+
+  public:
+    RingBuffer() : head_(0), tail_(0) {}
+
+    ~RingBuffer() { clear(); }
+
+    RingBuffer(RingBuffer const &) = delete;
+
+    RingBuffer &operator=(RingBuffer const &) = delete;
+
+    static constexpr size_t capacity() { return Capacity; }
+
+    size_t size() const { return tail_ - head_; }
+
+    size_t freeSpace() const { return Capacity - size(); }
+
+    bool empty() const { return head_ == tail_; }
+
+    bool full() const { return size() == Capacity; }
+
+    // Producer side. Returns false if there is no free space.
+    bool push(T const &item) {
+        if (full()) {
+            return false;
+        }
+        new (slot(tail_)) T(item);
+        // Item should be completely written before it becomes visible to consumer.
+        MEM_BARRIER();
+        tail_ = tail_ + 1;
+        return true;
+    }
+
+    // Producer side. Pushes all items or none of them if there is not enough free space.
+    // Items become visible to consumer at once.
+    bool push(T const *items, size_t count) {
+        if (count > freeSpace()) {
+            return false;
+        }
+        auto const tail = tail_;
+        for (size_t i = 0; i < count; ++i) {
+            new (slot(tail + i)) T(items[i]);
+        }
+        MEM_BARRIER();
+        tail_ = tail + count;
+        return true;
+    }
+
+    // Consumer side. Queue should not be empty.
+    FORCE_INLINE T &front() {
+        scAssert(!empty());
+        return *slot(head_);
+    }
+
+    FORCE_INLINE T const &front() const {
+        scAssert(!empty());
+        return *slot(head_);
+    }
+
+    // Consumer side. i-th item from the front, i should be less than size.
+    FORCE_INLINE T const &operator[](size_t i) const {
+        scAssert(i < size());
+        return *slot(head_ + i);
+    }
+
+    // Consumer side. Queue should not be empty.
+    FORCE_INLINE void pop() {
+        scAssert(!empty());
+        slot(head_)->~T();
+        // Item should be completely read before its slot is given back to producer.
+        MEM_BARRIER();
+        head_ = head_ + 1;
+    }
+
+    // Consumer side. Removes count items from the front.
+    FORCE_INLINE void pop(size_t count) {
+        scAssert(count <= size());
+        auto const head = head_;
+        for (size_t i = 0; i < count; ++i) {
+            slot(head + i)->~T();
+        }
+        MEM_BARRIER();
+        head_ = head + count;
+    }
+
+    // Consumer side.
+    void clear() {
+        while (!empty()) {
+            pop();
+        }
+    }
+
+  private:
+    using Storage = typename std::aligned_storage<sizeof(T), alignof(T)>::type;
+
+    FORCE_INLINE T *slot(size_t i) { return reinterpret_cast<T *>(&items_[i & (Capacity - 1)]); }
+
+    FORCE_INLINE T const *slot(size_t i) const {
+        return reinterpret_cast<T const *>(&items_[i & (Capacity - 1)]);
+    }
+
+    Storage items_[Capacity];
+    volatile size_t head_;
+    volatile size_t tail_;
+};
+}
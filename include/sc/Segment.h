@@ -2,6 +2,7 @@
 
 #include "Axes.h"
 
+#include <type_traits>
 #include <vector>
 
 namespace StepperControl {
@@ -10,26 +11,68 @@ const int32_t int32Max = std::numeric_limits<int32_t>::max();
 const int64_t int64Max = std::numeric_limits<int64_t>::max();
 
 // Contains data for Bresenham's algorithm.
-template <size_t AxesSize>
+// Accum is the type of accumulators. With int64_t any segment is integrated exactly.
+// With int32_t integration is faster on 32 bit MCUs, but durations are limited by maxDt and
+// maxTwiceDt, so accumulators can't overflow. Longer segments should be split.
+template <size_t AxesSize, typename Accum = int64_t>
 struct Segment {
+    static_assert(std::is_same<Accum, int64_t>::value || std::is_same<Accum, int32_t>::value,
+                  "Accumulator should be int64_t or int32_t");
+    static_assert(AxesSize <= 32, "Active axes should fit into 32 bit mask");
+
+    using Accumulator = Accum;
     using Ai = Axes<int32_t, AxesSize>;
-    using Al = Axes<int64_t, AxesSize>;
+    using Al = Axes<Accum, AxesSize>;
+    using Al64 = Axes<int64_t, AxesSize>;
+
+    // Slope of a segment is at most maxStepsPerTick - 0.5 steps per tick, so an axis makes at
+    // most maxStepsPerTick steps in a tick. By default executor makes one step per tick and the
+    // slope should be at most 0.5, see SegmentsExecutor::setMaxStepsPerTick.
+    static const int32_t maxStepsPerTick = 4;
+    static const int32_t maxDoubledSlope = 2 * maxStepsPerTick - 1;
+
+    // Error stays within maxStepsPerTick + 1 denominators during integration and denominator is
+    // at most 2 * maxDt for linear, maxTwiceDt ^ 2 for parabolic and maxThriceDt ^ 3 for cubic
+    // segment. Acceleration of cubic segment changes during integration and is at most
+    // 6 * maxDoubledSlope * thriceDt ^ 2, so maxThriceDt keeps it within int32_t.
+    static const bool isWide = sizeof(Accum) == sizeof(int64_t);
+    static const int32_t maxDt = isWide ? int32Max : 1 << 27;
+    static const int32_t maxTwiceDt = isWide ? 1 << 30 : 1 << 14;
+    static const int32_t maxThriceDt = isWide ? 1 << 12 : 1 << 9;
 
     // Homing segment.
-    // Linear motion for max time at constant homing velocity.
-    // Duration is set to negative number to determine this type of segment.
-    Segment(Axes<float, AxesSize> const &homingVelocity) {
-        auto dtL = static_cast<int64_t>(int32Max);
-        auto dx = dtL / axCast<int64_t>(-1.f / homingVelocity);
+    // Linear motion for max time at constant homing velocity. When end switch of an axis is hit
+    // it stops at once or, if its deceleration is positive, decelerates to zero velocity. Until
+    // then acceleration keeps deceleration, steps per tick per tick, in the same units as velocity.
+    // Duration is set to negative number to determine this type of segment. Axes with zero
+    // velocity don't move.
+    Segment(Axes<float, AxesSize> const &homingVelocity,
+            Axes<float, AxesSize> const &deceleration = axZero<Axes<float, AxesSize>>()) {
+        auto dtL = static_cast<int64_t>(maxDt);
+        auto dx = axZero<Al64>();
+        for (size_t i = 0; i < AxesSize; ++i) {
+            if (homingVelocity[i] != 0) {
+                dx[i] = dtL / static_cast<int64_t>(-1.f / homingVelocity[i]);
+            }
+        }
 
         // dx <= dt/2
-        scAssert(all(le(axAbs(dx) * 2, axConst<Al>(dtL))));
+        scAssert(all(le(axAbs(dx) * 2, axConst<Al64>(dtL))));
+        // Deceleration fits into acceleration.
+        scAssert(all(ge(deceleration, axZero<Axes<float, AxesSize>>())));
+        scAssert(all(le(deceleration, axConst<Axes<float, AxesSize>>(0.5f))));
 
         dt = -1;
-        denominator = 2 * dtL;
-        velocity = 2 * dx;
-        acceleration.fill(0);
+        denominator = static_cast<Accum>(2 * dtL);
+        velocity = axCast<Accum>(2 * dx);
+        for (size_t i = 0; i < AxesSize; ++i) {
+            acceleration[i] = static_cast<int32_t>(
+                std::min<int64_t>(llround(deceleration[i] * 2.0 * dtL), int32Max));
+        }
+        jerk.fill(0);
         error.fill(0);
+        axesMask = activeAxesMask();
+        period = 1;
     }
 
     // Wait segment.
@@ -40,7 +83,10 @@ struct Segment {
         denominator = 1;
         velocity.fill(0);
         acceleration.fill(0);
+        jerk.fill(0);
         error.fill(0);
+        axesMask = 0;
+        period = 1;
     }
 
     /* Linear segment.
@@ -58,16 +104,20 @@ struct Segment {
         auto dtL = static_cast<int64_t>(dt);
 
         // Overflow check. abs(dx) <= int64max/2
-        scAssert(all(le(axCast<int64_t>(axAbs(dx)), axConst<Al>(int64Max / 2))));
+        scAssert(all(le(axCast<int64_t>(axAbs(dx)), axConst<Al64>(int64Max / 2))));
+        scAssert(dt <= maxDt);
 
         scAssert(dt > 0);
-        // dx <= dt/2
-        scAssert(all(le(axAbs(dx) * 2, axConst<Ai>(dt))));
+        // dx <= dt * (maxStepsPerTick - 1/2)
+        scAssert(fitsSlope(dx, 2, dt));
 
-        denominator = 2 * dtL;
-        velocity = 2 * axCast<int64_t>(dx);
+        denominator = static_cast<Accum>(2 * dtL);
+        velocity = axCast<Accum>(2 * axCast<int64_t>(dx));
         acceleration.fill(0);
+        jerk.fill(0);
         error.fill(0);
+        axesMask = activeAxesMask();
+        period = 1;
     }
 
     /* Parabolic segment.
@@ -87,35 +137,114 @@ struct Segment {
 
         // Overflow check.
         scAssert(twiceDtL <= int64Max / twiceDtL);
-        scAssert(all(le(axCast<int64_t>(axAbs(dx1)), axConst<Al>(int64Max / (2 * twiceDtL)))));
-        scAssert(all(le(axCast<int64_t>(axAbs(dx2)), axConst<Al>(int64Max / (2 * twiceDtL)))));
+        scAssert(all(le(axCast<int64_t>(axAbs(dx1)), axConst<Al64>(int64Max / (2 * twiceDtL)))));
+        scAssert(all(le(axCast<int64_t>(axAbs(dx2)), axConst<Al64>(int64Max / (2 * twiceDtL)))));
         scAssert(all(le(axAbs(halfA), axConst<Ai>(int32Max / 2))));
+        scAssert(twiceDt <= maxTwiceDt);
 
         scAssert(twiceDt > 0);
-        // dx1 <= dt1/2 && dx2 <= dt2/2
-        scAssert(all(le(axAbs(dx1) * 4, axConst<Ai>(twiceDt))));
-        scAssert(all(le(axAbs(dx2) * 4, axConst<Ai>(twiceDt))));
+        // dx1 <= dt1 * (maxStepsPerTick - 1/2) && dx2 <= dt2 * (maxStepsPerTick - 1/2)
+        scAssert(fitsSlope(dx1, 4, twiceDt));
+        scAssert(fitsSlope(dx2, 4, twiceDt));
 
-        denominator = twiceDtL * twiceDtL;
-        velocity = 2 * twiceDtL * axCast<int64_t>(dx1);
+        denominator = static_cast<Accum>(twiceDtL * twiceDtL);
+        velocity = axCast<Accum>(2 * twiceDtL * axCast<int64_t>(dx1));
         acceleration = 2 * halfA;
+        jerk.fill(0);
         error.fill(0);
 
         // First half step integration to make area under the velocity profile equal it's real
         // value at the end of integration.
-        velocity += axCast<int64_t>(halfA);
+        velocity += axCast<Accum>(halfA);
+        axesMask = activeAxesMask();
+        period = 1;
+    }
+
+    /* Cubic segment.
+       It is set by displacements between four control points of Bezier curve p0-p1-p2-p3,
+       which are thriceDt / 3 ticks apart. Tangents at the ends are p0-p1 and p2-p3.
+    x  ^
+   x2  +------p2           thriceDt = t3 - t0, ticks
+       |     /  \          dx1 = x1 - x0, steps
+   x1  +---p1    \         dx2 = x2 - x1, steps
+       |  /       \        dx3 = x3 - x2, steps
+   x3  +-/--------p3
+       |/         |
+   x0  p0---------+---> t
+       t0         t3
+    */
+    Segment(int32_t thriceDt, Ai const &dx1, Ai const &dx2, Ai const &dx3) : dt(thriceDt) {
+        scAssert(thriceDt > 1);
+        scAssert(thriceDt <= maxThriceDt);
+        // Slope of the curve is within slopes of control polygon.
+        // dx1, dx2, dx3 <= thriceDt / 3 * (maxStepsPerTick - 1/2)
+        scAssert(fitsSlope(dx1, 6, thriceDt));
+        scAssert(fitsSlope(dx2, 6, thriceDt));
+        scAssert(fitsSlope(dx3, 6, thriceDt));
+
+        // Position multiplied by denominator is integer polynomial of tick t
+        // 3 * dx1 * T^2 * t + 3 * (dx2 - dx1) * T * t^2 + (dx3 - 2 * dx2 + dx1) * t^3,
+        // which is integrated exactly with its forward differences.
+        auto const T = static_cast<int64_t>(thriceDt);
+        auto const c1 = 3 * T * T * axCast<int64_t>(dx1);
+        auto const c2 = 3 * T * axCast<int64_t>(dx2 - dx1);
+        auto const c3 = axCast<int64_t>(dx3 - 2 * dx2 + dx1);
+        // Jerk is added to acceleration every tick, so both fit into int32_t until the end.
+        scAssert(all(le(axAbs(6 * c3), axConst<Al64>(int32Max))));
+        scAssert(all(le(axAbs(2 * c2 + 6 * c3) + axAbs(6 * c3) * T, axConst<Al64>(int32Max))));
+
+        denominator = static_cast<Accum>(T * T * T);
+        velocity = axCast<Accum>(c1 + c2 + c3);
+        acceleration = axCast<int32_t>(2 * c2 + 6 * c3);
+        jerk = axCast<int32_t>(6 * c3);
+        error.fill(0);
+        axesMask = activeAxesMask();
+        period = 1;
+    }
+
+    // Converts segment with other accumulator type. Values should fit into accumulators.
+    template <typename OtherAccum>
+    explicit Segment(Segment<AxesSize, OtherAccum> const &other)
+        : dt(other.dt), acceleration(other.acceleration), jerk(other.jerk),
+          velocity(axCast<Accum>(other.velocity)),
+          denominator(static_cast<Accum>(other.denominator)), error(axCast<Accum>(other.error)),
+          axesMask(other.axesMask), period(other.period) {}
+
+    // i-th bit is set if i-th axis has nonzero velocity, acceleration or jerk.
+    uint32_t activeAxesMask() const {
+        uint32_t mask = 0;
+        for (size_t i = 0; i < AxesSize; ++i) {
+            if (velocity[i] != 0 || acceleration[i] != 0 || jerk[i] != 0) {
+                mask |= 1u << i;
+            }
+        }
+        return mask;
+    }
+
+    // True if slope of dx made in 2 * ticks / multiplier ticks is within the limit.
+    static bool fitsSlope(Ai const &dx, int32_t multiplier, int32_t ticks) {
+        auto const limit = static_cast<int64_t>(maxDoubledSlope) * ticks;
+        return all(le(axCast<int64_t>(axAbs(dx)) * multiplier, axConst<Al64>(limit)));
     }
 
     bool isHoming() const { return dt == -1; }
 
     bool isWait() const { return all(eq(velocity, 0)); }
 
+    // Not started cubic segment. Its denominator is dt ^ 3, which differs from denominators of
+    // other segments, and jerk is zero only if it is a parabola.
+    bool isCubic() const {
+        auto const dtL = static_cast<int64_t>(dt);
+        return any(neq(jerk, 0)) || (dt > 1 && denominator == dtL * dtL * dtL);
+    }
+
     bool isMove() const { return !isHoming() && !isWait(); }
 
     friend bool operator==(Segment const &lhs, Segment const &rhs) {
         return lhs.dt == rhs.dt && lhs.denominator == rhs.denominator &&
                lhs.velocity == rhs.velocity && lhs.acceleration == rhs.acceleration &&
-               lhs.error == rhs.error;
+               lhs.jerk == rhs.jerk && lhs.error == rhs.error && lhs.axesMask == rhs.axesMask &&
+               lhs.period == rhs.period;
     }
 
     friend bool operator!=(Segment const &lhs, Segment const &rhs) { return !(lhs == rhs); }
@@ -125,20 +254,28 @@ struct Segment {
         return os << std::endl
                   << "dt: " << obj.dt << " denominator: " << obj.denominator
                   << " velocity: " << obj.velocity << " halfAcceleration: " << obj.acceleration
-                  << " error: " << obj.error;
+                  << " jerk: " << obj.jerk << " error: " << obj.error
+                  << " axesMask: " << obj.axesMask << " period: " << obj.period;
     }
 #endif
 
     int32_t dt;
     Ai acceleration;
+    // Change of acceleration per tick, nonzero only in cubic segments.
+    Ai jerk;
     Al velocity;
-    int64_t denominator;
+    Accum denominator;
     Al error;
+    // Axes which can make steps, see activeAxesMask.
+    uint32_t axesMask;
+    // Ticks of executor per tick of the segment. Its dt and slopes are in its own ticks, so slow
+    // segments can be executed with fewer interrupts.
+    int32_t period;
 };
 
-template <size_t size>
-using TSg = Segment<size>;
+template <size_t size, typename Accum = int64_t>
+using TSg = Segment<size, Accum>;
 
-template <size_t size>
-using TSgs = std::vector<TSg<size>>;
+template <size_t size, typename Accum = int64_t>
+using TSgs = std::vector<TSg<size, Accum>>;
 }
@@ -1,29 +1,56 @@
 #pragma once
 
+#include "PackedSegments.h"
+#include "RingBuffer.h"
 #include "Segment.h"
 
+#include <type_traits>
+
 namespace StepperControl {
 template <int i>
 struct StepperNumber {
     static const int value = i;
 };
 
-// Starts timer and generates steps using provided linear or parabolic trajectory.
+enum class TickMode {
+    // Timer interrupt is called on every tick of the executed segment, see Segment::period, and
+    // once for the whole wait.
+    Periodic,
+    // Timer is reprogrammed for the tick of the next step event only. Ticks without steps are
+    // integrated in closed form, so interrupt rate scales with step rate instead of tick rate.
+    NextStep,
+};
+
+// Starts timer and generates steps using provided linear, parabolic or cubic trajectory.
 // Uses modified Bresenham's line drawing algorithm.
-template <typename TMotor, typename TTicker, typename AxesTraits = DefaultAxesTraits>
+// Segments are streamed through bounded single producer single consumer queue: main loop pushes
+// them while timer interrupt consumes, so trajectory of any length can be executed without stops.
+// Queued segments are packed, see SegmentPacking, and QueueWords is the capacity of the queue in
+// 32 bit words. Only the executed segment is unpacked with its integration state.
+// Motor writes every axis separately with writeStep and writeDirection. If it also provides
+// writeSteps(bits), clearSteps(bits) and writeDirections(bits), where i-th bit corresponds to
+// i-th axis, then all axes are written at once, e.g. with a single port write.
+// Accum is the type of Bresenham's accumulators, see Segment.
+template <typename TMotor, typename TTicker, typename AxesTraits = DefaultAxesTraits,
+          size_t QueueWords = 512, typename Accum = int64_t>
 class SegmentsExecutor {
   public:
     static const int size = AxesTraits::size;
+    static_assert(size <= 32, "Steps and directions of all axes should fit into 32 bit mask");
+    // Maximum of pulse ticks plus direction setup ticks plus one.
+    static const int pipelineSize = 16;
+    // Max ratio of feed override, see setFeedOverride.
+    static const int maxFeedOverride = 2;
     using Ai = TAi<size>;
-    using Sg = TSg<size>;
-    using Sgs = TSgs<size>;
+    using Sg = TSg<size, Accum>;
+    using Sgs = TSgs<size, Accum>;
+    using Packing = SegmentPacking<size, Accum>;
     using Callback = void (*)(void *);
 
     SegmentsExecutor(TMotor *motor, TTicker *ticker)
         : running_(false), motor_(motor), ticker_(ticker), position_(axZero<Ai>()),
           ticksPerSecond_(1), onStarted_(nullptr, nullptr), onStopped_(nullptr, nullptr) {
         scAssert(motor_ && ticker_);
-        it_ = end();
     }
 
     int32_t ticksPerSecond() const { return ticksPerSecond_; }
@@ -33,17 +60,120 @@ class SegmentsExecutor {
         ticksPerSecond_ = ticksPerSecond;
     }
 
-    void setTrajectory(Sgs const &segments) {
-        trajectory_ = segments;
-        it_ = end();
+    // Replaces queued segments. Should not be called while running.
+    // Trajectory should fit into the queue, use push to stream longer ones.
+    // Segments are Sgs, TPackedSgs or any other sequence of Sg.
+    template <typename TSegments>
+    void setTrajectory(TSegments const &segments) {
+        scAssert(!running_);
+        clearQueue();
+        for (auto const &sg : segments) {
+            auto pushed = push(sg);
+            scAssert(pushed);
+        }
     }
 
-    void setTrajectory(Sgs &&segments) {
-        trajectory_ = move(segments);
-        it_ = end();
+    // Appends not started segment to the end of the queue. Can be called while running.
+    // Returns false if queue has not enough free space.
+    bool push(Sg const &segment) {
+        int32_t record[Packing::maxPackedSize];
+        auto const n = Packing::pack(segment, record);
+        if (!queue_.push(record, n)) {
+            return false;
+        }
+        pushedSegments_ = pushedSegments_ + 1;
+        pushedTicks_ = pushedTicks_ + ticksOf(segment);
+        return true;
     }
 
-    Sgs const &segments() const { return trajectory_; }
+    // Segments which are pushed but not started yet.
+    size_t queuedSegments() const { return pushedSegments_ - loadedSegments_; }
+
+    // Duration of segments which are pushed but not started yet, in ticks without feed override.
+    // Homing has no duration.
+    uint32_t queuedTicks() const { return pushedTicks_ - loadedTicks_; }
+
+    // Free space of the queue in words.
+    size_t freeSpace() const { return queue_.freeSpace(); }
+
+    TickMode tickMode() const { return tickMode_; }
+
+    // Should not be called while running.
+    void setTickMode(TickMode mode) {
+        scAssert(!running_);
+        tickMode_ = mode;
+    }
+
+    int32_t pulseTicks() const { return pulseTicks_; }
+
+    int32_t dirSetupTicks() const { return dirSetupTicks_; }
+
+    // By default step pulse and direction setup are timed with busy waiting inside of the timer
+    // interrupt. If pulse ticks are positive then steps are set on one tick and cleared pulse
+    // ticks later, and directions are written dir setup ticks before the step which needs them.
+    // Steps are delayed by dir setup ticks for that. Steps of one axis should be at least
+    // pulse plus dir setup ticks apart. Should not be called while running.
+    void setStepTiming(int32_t pulseTicks, int32_t dirSetupTicks) {
+        scAssert(!running_);
+        scAssert(pulseTicks >= 0 && dirSetupTicks >= 0);
+        scAssert(pulseTicks + dirSetupTicks < pipelineSize);
+        scAssert(pulseTicks > 0 || dirSetupTicks == 0);
+        scAssert(pulseTicks == 0 || maxStepsPerTick_ == 1);
+        pulseTicks_ = pulseTicks;
+        dirSetupTicks_ = dirSetupTicks;
+    }
+
+    int32_t maxStepsPerTick() const { return maxStepsPerTick_; }
+
+    // By default an axis makes at most one step per tick, so slope of segments should be at most
+    // 0.5 steps per tick. With more steps per tick the slope can be up to steps - 0.5 and steps
+    // of a tick are written as a train of pulses timed with busy waiting, so step rate is raised
+    // without raising the tick rate. Pulses can't be timed in interrupts then, see setStepTiming.
+    // Should not be called while running.
+    void setMaxStepsPerTick(int32_t steps) {
+        scAssert(!running_);
+        scAssert(steps >= 1 && steps <= Sg::maxStepsPerTick);
+        scAssert(steps == 1 || pulseTicks_ == 0);
+        maxStepsPerTick_ = steps;
+    }
+
+    // Ratio of trajectory time to real time, e.g. 0.5 executes segments at half speed. Timer
+    // handlers scale time with a fractional tick accumulator, so segments are not changed.
+    // Above 1 some interrupts integrate several ticks with busy waited pulses, so with pulses
+    // timed in interrupts, see setStepTiming, the ratio is limited to 1.
+    // Can be called while running, the change starts at the next interrupt.
+    void setFeedOverride(float ratio) {
+        scAssert(ratio >= 0 && ratio <= maxFeedOverride);
+        feedTarget_ = static_cast<int32_t>(lroundf(ratio * (1 << feedTargetBits)));
+    }
+
+    float feedOverride() const { return static_cast<float>(feedTarget_) / (1 << feedTargetBits); }
+
+    // Ratio which is applied now. It follows feed override with limited rate.
+    float currentFeedOverride() const {
+        return static_cast<float>(feedScale_) / static_cast<float>(feedOne);
+    }
+
+    // Max change of the applied ratio per tick, unlimited by default. Changing it by r per tick
+    // adds v * r to acceleration of an axis moving with velocity v steps per tick.
+    // Can be called while running.
+    void setFeedOverrideRamp(float ratioPerTick) {
+        scAssert(ratioPerTick > 0);
+        auto const ramp = std::ceil(ratioPerTick * static_cast<float>(feedOne));
+        feedRamp_ =
+            ramp < static_cast<float>(maxFeedRamp) ? static_cast<int32_t>(ramp) : maxFeedRamp;
+    }
+
+    // Decelerates to zero speed along the trajectory with the feed override ramp, see
+    // setFeedOverrideRamp, and holds at the reached state of the segment. Executor keeps running
+    // with interrupts which integrate nothing, and resume continues from the same state, so no
+    // step is lost. Can be called while running, start drops the hold.
+    void hold() { held_ = true; }
+
+    void resume() { held_ = false; }
+
+    // Motion is stopped by hold or zero feed override.
+    bool isHeld() const { return motionless_; }
 
     void setOnStarted(Callback func, void *payload) { onStarted_ = std::make_pair(func, payload); }
 
@@ -53,26 +183,42 @@ class SegmentsExecutor {
         if (onStarted_.first) {
             onStarted_.first(onStarted_.second);
         }
-        it_ = begin();
         running_ = true;
         currentTick_ = 0;
-        for (int i = 0; i < size; ++i) {
-            dir_[i] = false;
-        }
-        writeDir(StepperNumber<0>{});
-        if (!trajectory_.empty()) {
-            ticker_->attach_us(this, &SegmentsExecutor::tick, 1000000 / ticksPerSecond_);
+        dirBits_ = 0;
+        pinDirBits_ = 0;
+        resetPipeline();
+        writeDir(dirBits_, GroupedOutput{});
+        held_ = false;
+        feedScale_ = targetFeedScale();
+        feedPhase_ = 0;
+        intervalSlots_ = 1;
+        if (!queue_.empty()) {
+            loadSegment();
+            intervalTicks_ = it_->period;
+            if (tickMode_ == TickMode::NextStep) {
+                ticker_->attach_us(this, &SegmentsExecutor::tickNextStep,
+                                   tickPeriodUs() * intervalTicks_);
+            } else {
+                ticker_->attach_us(this, &SegmentsExecutor::tickPeriodic,
+                                   tickPeriodUs() * intervalTicks_);
+            }
         } else {
-            stop();
+            finish();
         }
     }
 
     void tick() {
+        if (!it_) {
+            // Trajectory is completed, but delayed steps are not.
+            drainPipeline();
+            return;
+        }
         auto const dt = it_->dt;
         if (dt > 0) {
             // Integrate next interval.
             tick0();
-        } else if (dt == 0 && ++it_ != end()) {
+        } else if (dt == 0 && nextSegment()) {
             // If there is next segment then integrate it's first interval.
             tick0();
         } else if (dt < 0) {
@@ -81,11 +227,8 @@ class SegmentsExecutor {
                 // If any of switches is not hit then integrate next interval.
                 tick0();
 
-                // Check end switch for every axis and stop if hit.
-                for (int i = 0; i < AxesTraits::size; i++) {
-                    if (it_->velocity[i] != 0 && motor_->checkEndSwitchHit(i)) {
-                        it_->velocity[i] = 0;
-                    }
+                for (size_t i = 0; i < AxesTraits::size; i++) {
+                    updateHoming(i);
                 }
             } else {
                 // Stop and reset position when all switches are hit.
@@ -94,22 +237,45 @@ class SegmentsExecutor {
             }
         } else {
             // No trajectory left.
-            stop();
+            it_ = nullptr;
+            drainPipeline();
+        }
+    }
+
+    // Timer handler for TickMode::Periodic.
+    // Interrupts follow tick period of the executed segment, see Segment::period, and the rest of
+    // a wait is skipped at once, so a wait takes a single interrupt.
+    void tickPeriodic() {
+        integrateDueTicks();
+        if (!running_) {
+            return;
+        }
+        auto skip = it_ && it_->axesMask == 0 && isPipelineEmpty() ? ticksWithoutEvents() : 0;
+        reprogramTicker(skip, &SegmentsExecutor::tickPeriodic);
+    }
+
+    // Timer handler for TickMode::NextStep.
+    // Integrates current tick and reprograms timer for the next one where anything can happen.
+    void tickNextStep() {
+        integrateDueTicks();
+        if (!running_) {
+            return;
         }
+        // Delayed steps and pulses are timed in interrupts, so ticks are skipped only without them.
+        auto skip = it_ && isPipelineEmpty() ? ticksWithoutEvents() : 0;
+        reprogramTicker(skip, &SegmentsExecutor::tickNextStep);
     }
 
     bool isRunning() const { return running_; }
 
     int32_t currentTick() const { return currentTick_; }
 
+    // Stops immediately and drops all queued segments.
     void stop() {
         ticker_->detach();
-        it_ = end();
-        running_ = false;
-        currentTick_ = 0;
-        if (onStopped_.first) {
-            onStopped_.first(onStopped_.second);
-        }
+        clearQueue();
+        dropPipeline();
+        finish();
     }
 
     Ai const &position() const { return position_; }
@@ -117,118 +283,619 @@ class SegmentsExecutor {
     void setPosition(Ai const &position = axZero<Ai>()) { position_ = position; }
 
   private:
-    FORCE_INLINE Sg *begin() RESTRICT { return trajectory_.data(); }
-    FORCE_INLINE Sg *end() RESTRICT { return trajectory_.data() + trajectory_.size(); }
+    template <typename T>
+    static auto hasGroupedOutput(T *motor)
+        -> decltype(motor->writeSteps(0u), motor->clearSteps(0u), motor->writeDirections(0u),
+                    std::true_type{});
+
+    static std::false_type hasGroupedOutput(...);
+
+    using GroupedOutput = decltype(hasGroupedOutput(static_cast<TMotor *>(nullptr)));
+
+    // Moves to the next segment if it was already pushed.
+    FORCE_INLINE bool nextSegment() RESTRICT {
+        if (queue_.empty()) {
+            return false;
+        }
+        loadSegment();
+        return true;
+    }
+
+    // Unpacks front segment to the current one and releases its record.
+    FORCE_INLINE void loadSegment() RESTRICT {
+        Packing::unpack(queue_, current_);
+        queue_.pop(Packing::packedSize(queue_.front()));
+        loadedSegments_ = loadedSegments_ + 1;
+        loadedTicks_ = loadedTicks_ + ticksOf(current_);
+        setSegment(&current_);
+    }
+
+    // Consumer side.
+    void clearQueue() {
+        queue_.clear();
+        loadedSegments_ = pushedSegments_;
+        loadedTicks_ = pushedTicks_;
+    }
+
+    // Counters of ticks wrap around, only their difference is used.
+    static uint32_t ticksOf(Sg const &segment) {
+        return segment.dt > 0 ? static_cast<uint32_t>(segment.dt) * segment.period : 0;
+    }
+
+    FORCE_INLINE void setSegment(Sg *segment) RESTRICT {
+        it_ = segment;
+        // 2 * error >= denominator is the same as error >= ceil(denominator / 2) for integers.
+        threshold_ = (it_->denominator + 1) / 2;
+
+        withJerk_ = any(neq(it_->jerk, 0));
+
+        if (it_->dt < 0) {
+            // Homing moves with constant velocity until switches are hit, see Segment.
+            homingDeceleration_ = it_->acceleration;
+            it_->acceleration.fill(0);
+        }
+
+        auto const mask = it_->axesMask;
+        if (mask == allAxesMask) {
+            dispatch_ = Dispatch::All;
+            return;
+        }
+        activeAxesCount_ = 0;
+        for (int i = 0; i < size; ++i) {
+            if ((mask >> i) & 1u) {
+                activeAxes_[activeAxesCount_++] = i;
+            }
+        }
+        dispatch_ = activeAxesCount_ == 0 ? Dispatch::None
+                                          : activeAxesCount_ == 1 ? Dispatch::One : Dispatch::List;
+    }
+
+    int32_t tickPeriodUs() const { return 1000000 / ticksPerSecond_; }
+
+    // Feed override is applied to the time of segments. Every tick slot of the executed segment
+    // adds the applied ratio to the phase, and a tick is integrated per whole unit of it.
+    static const int feedTargetBits = 16;
+    static const int feedBits = 30;
+    static const int64_t feedOne = int64_t{1} << feedBits;
+    static const int32_t maxFeedRamp = int32Max;
+
+    int64_t targetFeedScale() const {
+        if (held_) {
+            return 0;
+        }
+        auto const target = static_cast<int64_t>(feedTarget_) << (feedBits - feedTargetBits);
+        auto const one = feedOne;
+        return pulseTicks_ > 0 ? std::min(target, one) : target;
+    }
+
+    // Moves applied ratio toward the target by the ramp for elapsed ticks and integrates ticks
+    // which are due.
+    void integrateDueTicks() {
+        auto const target = targetFeedScale();
+        auto const scale = feedScale_;
+        if (scale != target) {
+            auto const ramp = static_cast<int64_t>(feedRamp_) * intervalTicks_;
+            feedScale_ = target > scale ? std::min(target, scale + ramp)
+                                        : std::max(target, scale - ramp);
+        }
+        // Ratio changes linearly during the interval, so its mean is applied.
+        feedPhase_ += intervalSlots_ * ((scale + feedScale_) / 2);
+        motionless_ = feedScale_ == 0;
+        for (; feedPhase_ >= feedOne && running_; feedPhase_ -= feedOne) {
+            tick();
+        }
+    }
+
+    // Number of tick slots of current segment after which the next tick is due.
+    int64_t slotsBeforeDueTick() const {
+        auto const rest = feedOne - feedPhase_;
+        if (rest <= 0 || feedScale_ == 0) {
+            return 1;
+        }
+        return (rest + feedScale_ - 1) / feedScale_;
+    }
+
+    // Integrates skipped ticks of current segment and reprograms timer if interval to the next
+    // interrupt changes. In periodic mode interrupts are not reprogrammed for feed override,
+    // ticks are just not due in some of them.
+    void reprogramTicker(int32_t skip, void (SegmentsExecutor::*handler)()) {
+        skipTicks(skip);
+        feedPhase_ -= static_cast<int64_t>(skip) * feedOne;
+        auto const period = it_ ? it_->period : 1;
+        auto const slots = skip == 0 && tickMode_ == TickMode::Periodic ? 1 : slotsBeforeDueTick();
+        // Timer interval should not overflow.
+        intervalSlots_ = std::min<int64_t>(slots, int32Max / (tickPeriodUs() * period));
+        auto const interval = static_cast<int32_t>(intervalSlots_) * period;
+        if (interval != intervalTicks_) {
+            intervalTicks_ = interval;
+            ticker_->attach_us(this, handler, tickPeriodUs() * intervalTicks_);
+        }
+    }
+
+    // Number of following ticks of current segment in which no axis makes a step.
+    int32_t ticksWithoutEvents() const {
+        auto const dt = it_->dt;
+        if (dt <= 0) {
+            // Segment switch or homing cycle, which checks switches every tick.
+            return 0;
+        }
+        // Timer interval should not overflow.
+        auto skip = std::min<int64_t>(dt, int32Max / (tickPeriodUs() * it_->period) - 1);
+        for (int k = 0; k < activeAxesCount() && skip > 0; ++k) {
+            skip = std::min(skip, ticksBeforeStep(activeAxis(k), skip + 1) - 1);
+        }
+        return static_cast<int32_t>(skip);
+    }
+
+    int activeAxesCount() const {
+        return dispatch_ == Dispatch::All ? size
+                                          : dispatch_ == Dispatch::None ? 0 : activeAxesCount_;
+    }
+
+    int activeAxis(int k) const { return dispatch_ == Dispatch::All ? k : activeAxes_[k]; }
+
+    // Returns index of the first following tick in which i-th axis makes a step or changes sign
+    // of velocity, but not greater than limit.
+    int64_t ticksBeforeStep(int i, int64_t limit) const {
+        auto const e = static_cast<int64_t>(it_->error[i]);
+        auto const v = static_cast<int64_t>(it_->velocity[i]);
+        auto const a = static_cast<int64_t>(it_->acceleration[i]);
+        auto const j = static_cast<int64_t>(it_->jerk[i]);
+        auto const den = static_cast<int64_t>(it_->denominator);
+
+        // Velocity used in m-th tick is v + (m - 1) * a + j * (m - 1) * (m - 2) / 2.
+        // Search only ticks where it keeps sign.
+        auto window = limit;
+        if (j == 0) {
+            if (v >= 0 && a < 0) {
+                window = std::min(window, v / -a + 1);
+            } else if (v < 0 && a > 0) {
+                window = std::min(window, (-v + a - 1) / a);
+            }
+        } else {
+            window = std::min(window, ticksWithVelocitySign(v, a, j, window));
+        }
+
+        // With constant sign doubled error in direction of motion after m ticks is
+        // 2 * sign * (e + m * v + a * m * (m - 1) / 2 + j * m * (m - 1) * (m - 2) / 6).
+        // It is nondecreasing, so the first tick where it reaches denominator can be found by
+        // exponential and then binary search.
+        int64_t const sign = v >= 0 ? 1 : -1;
+        auto reached = [&](int64_t m) {
+            return 2 * sign * e + 2 * m * sign * v + sign * a * m * (m - 1) +
+                       sign * j * (m * (m - 1) * (m - 2) / 3) >=
+                   den;
+        };
+        int64_t lo = 0;
+        int64_t hi = 1;
+        while (hi < window && !reached(hi)) {
+            lo = hi;
+            hi *= 2;
+        }
+        if (hi >= window) {
+            if (!reached(window)) {
+                return std::min(window + 1, limit);
+            }
+            hi = window;
+        }
+        while (hi - lo > 1) {
+            auto mid = lo + (hi - lo) / 2;
+            if (reached(mid)) {
+                hi = mid;
+            } else {
+                lo = mid;
+            }
+        }
+        return hi;
+    }
+
+    // Number of ticks up to limit from the first one, in which velocity of cubic segment keeps
+    // its sign. Acceleration a + (m - 1) * j is added after m-th tick, velocity is monotonic while
+    // acceleration keeps sign, and sign of monotonic velocity is found by binary search.
+    static int64_t ticksWithVelocitySign(int64_t v, int64_t a, int64_t j, int64_t limit) {
+        auto monotonic = limit;
+        if (a > 0 && j < 0) {
+            monotonic = std::min(monotonic, a / -j + 2);
+        } else if (a < 0 && j > 0) {
+            monotonic = std::min(monotonic, -a / j + 2);
+        }
+        auto keepsSign = [&](int64_t m) {
+            auto velocity = v + (m - 1) * a + j * ((m - 1) * (m - 2) / 2);
+            return (velocity >= 0) == (v >= 0);
+        };
+        if (keepsSign(monotonic)) {
+            return monotonic;
+        }
+        int64_t lo = 1;
+        auto hi = monotonic;
+        while (hi - lo > 1) {
+            auto mid = lo + (hi - lo) / 2;
+            if (keepsSign(mid)) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    // Integrates ticks without steps in closed form.
+    void skipTicks(int32_t ticks) {
+        if (ticks == 0) {
+            return;
+        }
+        auto const k = static_cast<int64_t>(ticks);
+        for (int i = 0; i < size; ++i) {
+            auto const a = static_cast<int64_t>(it_->acceleration[i]);
+            auto const j = static_cast<int64_t>(it_->jerk[i]);
+            it_->error[i] += static_cast<Accum>(k * it_->velocity[i] + a * (k * (k - 1) / 2) +
+                                                j * (k * (k - 1) * (k - 2) / 6));
+            it_->velocity[i] += static_cast<Accum>(k * a + j * (k * (k - 1) / 2));
+            it_->acceleration[i] += static_cast<int32_t>(k * j);
+        }
+        it_->dt -= ticks;
+        currentTick_ += ticks * it_->period;
+    }
+
+    // Checks end switch of moving axis and stops it if the switch is hit. With deceleration the
+    // axis slows down until its velocity reaches zero instead.
+    void updateHoming(size_t i) {
+        auto const velocity = it_->velocity[i];
+        if (velocity == 0) {
+            return;
+        }
+        auto const acceleration = it_->acceleration[i];
+        if (acceleration != 0) {
+            if ((velocity > 0) == (acceleration > 0)) {
+                it_->velocity[i] = 0;
+                it_->acceleration[i] = 0;
+            }
+        } else if (motor_->checkEndSwitchHit(i)) {
+            auto const deceleration = homingDeceleration_[i];
+            if (deceleration == 0) {
+                it_->velocity[i] = 0;
+            } else {
+                it_->acceleration[i] = velocity > 0 ? -deceleration : deceleration;
+            }
+        }
+    }
+
+    // Queue is drained. Segments pushed after this point are executed by the next start.
+    void finish() {
+        ticker_->detach();
+        it_ = nullptr;
+        running_ = false;
+        held_ = false;
+        motionless_ = false;
+        currentTick_ = 0;
+        if (onStopped_.first) {
+            onStopped_.first(onStopped_.second);
+        }
+    }
 
     FORCE_INLINE void tick0() RESTRICT {
         motor_->begin();
 
         // Update time.
         --it_->dt;
-        ++currentTick_;
+        currentTick_ += it_->period;
 
-        shouldMakeAnyStep_ = false;
-        shouldChangeAnyDir_ = false;
+        auto const oldDirBits = dirBits_;
+        dirBits_ = 0;
+        stepBits_ = 0;
 
-        updateDir(StepperNumber<0>{});
+        if (pulseTicks_ > 0) {
+            // Pulses should be cleared before directions are changed.
+            clearPulses();
 
-        if (shouldChangeAnyDir_) {
-            writeDir(StepperNumber<0>{});
-            wait_us(4);
-        }
+            integrate();
 
-        updateErr(StepperNumber<0>{});
+            // Direction is changed only by the step which needs it, because earlier steps of the
+            // same axis can be still in the pipeline.
+            auto const pinDirBits = (pinDirBits_ & ~stepBits_) | (dirBits_ & stepBits_);
+            if (pinDirBits != pinDirBits_) {
+                pinDirBits_ = pinDirBits;
+                writeDir(pinDirBits_, GroupedOutput{});
+            }
 
-        if (shouldMakeAnyStep_) {
-            writeStep(StepperNumber<0>{});
-            wait_us(2);
-            clearStep(StepperNumber<0>{});
+            pipeline_[(pipelineTick_ + dirSetupTicks_) & pipelineMask] = stepBits_;
+            setPulses();
+        } else {
+            integrate();
+
+            if (dirBits_ != oldDirBits) {
+                writeDir(dirBits_, GroupedOutput{});
+                wait_us(4);
+            }
+
+            if (stepBits_ != 0) {
+                writeStep(stepBits_, GroupedOutput{});
+                wait_us(2);
+                clearStep(stepBits_, GroupedOutput{});
+                if (maxStepsPerTick_ > 1) {
+                    writePulseTrain();
+                }
+            }
         }
 
         // Notify motor about integration end.
         motor_->end();
     }
 
-    // Integrate i-th axis.
-    template <int i>
-    FORCE_INLINE void updateDir(StepperNumber<i>) RESTRICT {
-        auto oldDir = dir_[i];
-        dir_[i] = it_->velocity[i] < 0;
-        shouldChangeAnyDir_ = shouldChangeAnyDir_ || oldDir != dir_[i];
+    // Step pipeline is indexed by interrupt. Steps integrated in interrupt n are set in
+    // interrupt n + dir setup ticks and cleared in interrupt n + dir setup ticks + pulse ticks.
+    static const uint32_t pipelineMask = pipelineSize - 1;
 
-        updateDir(StepperNumber<i + 1>{});
+    FORCE_INLINE void clearPulses() RESTRICT {
+        auto &slot = pipeline_[(pipelineTick_ - pulseTicks_) & pipelineMask];
+        if (slot != 0) {
+            clearStep(slot, GroupedOutput{});
+            slot = 0;
+        }
     }
 
-    // All axes were integrated.
-    FORCE_INLINE void updateDir(StepperNumber<size>) RESTRICT {}
+    FORCE_INLINE void setPulses() RESTRICT {
+        auto const bits = pipeline_[pipelineTick_ & pipelineMask];
+        if (bits != 0) {
+            writeStep(bits, GroupedOutput{});
+        }
+        ++pipelineTick_;
+    }
 
-    template <int i>
-    FORCE_INLINE void updateErr(StepperNumber<i>) RESTRICT {
-        // Update difference between rounded and actual position.
-        it_->error[i] += it_->velocity[i];
+    bool isPipelineEmpty() const {
+        uint32_t bits = 0;
+        for (auto slot : pipeline_) {
+            bits |= slot;
+        }
+        return bits == 0;
+    }
 
-        int sign = it_->velocity[i] >= 0 ? 1 : -1;
+    void resetPipeline() {
+        pipelineTick_ = 0;
+        for (auto &slot : pipeline_) {
+            slot = 0;
+        }
+    }
 
-        // +1 -- positive or zero slope; -1 -- negative slope.
-        //       error >= 0.5                  error <= -0.5
-        if (2 * sign * it_->error[i] >= it_->denominator) {
-            //   error -= 1                    error += 1
-            it_->error[i] -= it_->denominator * sign;
-            // Rising edge.
-            position_[i] += sign;
+    // Outputs delayed steps after the end of trajectory and stops when all pulses are cleared.
+    void drainPipeline() {
+        if (isPipelineEmpty()) {
+            finish();
+            return;
+        }
+        motor_->begin();
+        clearPulses();
+        setPulses();
+        motor_->end();
+    }
+
+    // Clears pulses which are set and removes steps which are not made yet from position.
+    void dropPipeline() {
+        for (int32_t k = -pulseTicks_; k < dirSetupTicks_; ++k) {
+            auto &slot = pipeline_[(pipelineTick_ + k) & pipelineMask];
+            if (k < 0) {
+                clearStep(slot, GroupedOutput{});
+            } else {
+                for (int i = 0; i < size; ++i) {
+                    if ((slot >> i) & 1u) {
+                        position_[i] += (pinDirBits_ >> i) & 1u ? 1 : -1;
+                    }
+                }
+            }
+            slot = 0;
+        }
+    }
+
+    // Steps after the first one of the tick, pulses are cleared before the next ones are set.
+    FORCE_INLINE void writePulseTrain() RESTRICT {
+        for (int k = 1; k < Sg::maxStepsPerTick && trainBits_[k] != 0; ++k) {
+            wait_us(2);
+            writeStep(trainBits_[k], GroupedOutput{});
+            wait_us(2);
+            clearStep(trainBits_[k], GroupedOutput{});
+            trainBits_[k] = 0;
+        }
+    }
+
+    // Jerk is integrated only in cubic segments and further steps of a tick are checked only if
+    // they are enabled.
+    FORCE_INLINE void integrate() RESTRICT {
+        if (maxStepsPerTick_ > 1) {
+            integrate(std::true_type{});
+        } else {
+            integrate(std::false_type{});
+        }
+    }
 
-            shouldMakeAnyStep_ = true;
-            step_[i] = true;
+    template <typename MultiStep>
+    FORCE_INLINE void integrate(MultiStep) RESTRICT {
+        if (withJerk_) {
+            updateActiveAxes(std::true_type{}, MultiStep{});
         } else {
-            step_[i] = false;
+            updateActiveAxes(std::false_type{}, MultiStep{});
+        }
+    }
+
+    // Axes without velocity and acceleration can't make steps, so only active ones are integrated.
+    template <typename WithJerk, typename MultiStep>
+    FORCE_INLINE void updateActiveAxes(WithJerk, MultiStep) RESTRICT {
+        switch (dispatch_) {
+        case Dispatch::All:
+            updateAxes(StepperNumber<0>{}, WithJerk{}, MultiStep{});
+            break;
+        case Dispatch::One:
+            updateAxis(activeAxes_[0], WithJerk{}, MultiStep{});
+            break;
+        case Dispatch::List:
+            for (int k = 0; k < activeAxesCount_; ++k) {
+                updateAxis(activeAxes_[k], WithJerk{}, MultiStep{});
+            }
+            break;
+        case Dispatch::None:
+            break;
+        }
+    }
+
+    // Integrate i-th axis.
+    template <int i, typename WithJerk, typename MultiStep>
+    FORCE_INLINE void updateAxes(StepperNumber<i>, WithJerk, MultiStep) RESTRICT {
+        updateAxis(i, WithJerk{}, MultiStep{});
+
+        updateAxes(StepperNumber<i + 1>{}, WithJerk{}, MultiStep{});
+    }
+
+    // All axes were integrated.
+    template <typename WithJerk, typename MultiStep>
+    FORCE_INLINE void updateAxes(StepperNumber<size>, WithJerk, MultiStep) RESTRICT {}
+
+    // Step decision is branchless, signed right shift is arithmetic on supported compilers.
+    template <typename WithJerk, typename MultiStep>
+    FORCE_INLINE void updateAxis(int i, WithJerk, MultiStep) RESTRICT {
+        static const int signShift = sizeof(Accum) * 8 - 1;
+        auto const velocity = it_->velocity[i];
+
+        dirBits_ |= static_cast<uint32_t>(velocity < 0) << i;
+
+        // Update difference between rounded and actual position.
+        auto error = it_->error[i] + velocity;
+
+        // All ones -- negative slope; zero -- positive or zero slope.
+        auto const negative = velocity >> signShift;
+        // Error in direction of motion.
+        auto const forwardError = (error ^ negative) - negative;
+
+        // All ones if error >= 0.5 for positive or error <= -0.5 for negative slope.
+        auto const step = (threshold_ - 1 - forwardError) >> signShift;
+
+        //   error -= 1                    error += 1
+        error -= ((it_->denominator ^ negative) - negative) & step;
+        it_->error[i] = error;
+
+        // Rising edge.
+        position_[i] += static_cast<int32_t>((negative | 1) & step);
+        stepBits_ |= static_cast<uint32_t>(step & 1) << i;
+
+        if (MultiStep::value) {
+            // Each further step of the tick moves error by one more denominator.
+            auto moreSteps = step;
+            for (int k = 1; k < Sg::maxStepsPerTick && moreSteps != 0; ++k) {
+                auto const forward = (error ^ negative) - negative;
+                moreSteps = (threshold_ - 1 - forward) >> signShift;
+                error -= ((it_->denominator ^ negative) - negative) & moreSteps;
+                position_[i] += static_cast<int32_t>((negative | 1) & moreSteps);
+                trainBits_[k] |= static_cast<uint32_t>(moreSteps & 1) << i;
+            }
+            it_->error[i] = error;
         }
 
-        it_->velocity[i] += it_->acceleration[i];
+        it_->velocity[i] = velocity + it_->acceleration[i];
+        if (WithJerk::value) {
+            it_->acceleration[i] += it_->jerk[i];
+        }
+    }
 
-        updateErr(StepperNumber<i + 1>{});
+    FORCE_INLINE void writeDir(uint32_t bits, std::true_type) RESTRICT {
+        motor_->writeDirections(bits);
     }
 
-    FORCE_INLINE void updateErr(StepperNumber<size>) RESTRICT {}
+    FORCE_INLINE void writeDir(uint32_t bits, std::false_type) RESTRICT {
+        writeDir(bits, StepperNumber<0>{});
+    }
 
     // Integrate i-th axis.
     template <int i>
-    FORCE_INLINE void writeDir(StepperNumber<i>) RESTRICT {
-        motor_->writeDirection(StepperNumber<i>{}, dir_[i]);
+    FORCE_INLINE void writeDir(uint32_t bits, StepperNumber<i>) RESTRICT {
+        motor_->writeDirection(StepperNumber<i>{}, ((bits >> i) & 1u) != 0);
 
-        writeDir(StepperNumber<i + 1>{});
+        writeDir(bits, StepperNumber<i + 1>{});
     }
 
     // All axes were integrated.
-    FORCE_INLINE void writeDir(StepperNumber<size>) RESTRICT {}
+    FORCE_INLINE void writeDir(uint32_t, StepperNumber<size>) RESTRICT {}
+
+    FORCE_INLINE void writeStep(uint32_t bits, std::true_type) RESTRICT {
+        motor_->writeSteps(bits);
+    }
+
+    FORCE_INLINE void writeStep(uint32_t bits, std::false_type) RESTRICT {
+        writeStep(bits, StepperNumber<0>{});
+    }
 
     template <int i>
-    FORCE_INLINE void writeStep(StepperNumber<i>) RESTRICT {
-        motor_->writeStep(StepperNumber<i>{}, step_[i]);
+    FORCE_INLINE void writeStep(uint32_t bits, StepperNumber<i>) RESTRICT {
+        motor_->writeStep(StepperNumber<i>{}, ((bits >> i) & 1u) != 0);
+
+        writeStep(bits, StepperNumber<i + 1>{});
+    }
+
+    FORCE_INLINE void writeStep(uint32_t, StepperNumber<size>) RESTRICT {}
 
-        writeStep(StepperNumber<i + 1>{});
+    FORCE_INLINE void clearStep(uint32_t bits, std::true_type) RESTRICT {
+        motor_->clearSteps(bits);
     }
 
-    FORCE_INLINE void writeStep(StepperNumber<size>) RESTRICT {}
+    FORCE_INLINE void clearStep(uint32_t bits, std::false_type) RESTRICT {
+        clearStep(bits, StepperNumber<0>{});
+    }
 
     template <int i>
-    FORCE_INLINE void clearStep(StepperNumber<i>) RESTRICT {
-        motor_->writeStep(StepperNumber<i>{}, false);
+    FORCE_INLINE void clearStep(uint32_t bits, StepperNumber<i>) RESTRICT {
+        if ((bits >> i) & 1u) {
+            motor_->writeStep(StepperNumber<i>{}, false);
+        }
 
-        clearStep(StepperNumber<i + 1>{});
+        clearStep(bits, StepperNumber<i + 1>{});
     }
 
-    FORCE_INLINE void clearStep(StepperNumber<size>) RESTRICT {}
+    FORCE_INLINE void clearStep(uint32_t, StepperNumber<size>) RESTRICT {}
 
     int32_t currentTick_{};
     bool running_{};
-
-    bool shouldMakeAnyStep_{};
-    bool shouldChangeAnyDir_{};
-    bool step_[size]{};
-    bool dir_[size]{};
-
+    TickMode tickMode_{TickMode::Periodic};
+    int32_t intervalTicks_{1};
+
+    // i-th bit corresponds to i-th axis.
+    uint32_t stepBits_{};
+    uint32_t dirBits_{};
+    // Directions written to motor.
+    uint32_t pinDirBits_{};
+
+    int32_t pulseTicks_{};
+    int32_t dirSetupTicks_{};
+    uint32_t pipelineTick_{};
+    uint32_t pipeline_[pipelineSize]{};
+
+    int32_t maxStepsPerTick_{1};
+
+    volatile int32_t feedTarget_{1 << feedTargetBits};
+    volatile int32_t feedRamp_{maxFeedRamp};
+    volatile bool held_{};
+    volatile bool motionless_{};
+    int64_t feedScale_{feedOne};
+    int64_t feedPhase_{};
+    int64_t intervalSlots_{1};
+    // Bits of k-th pulse of the tick, the first ones are step bits.
+    uint32_t trainBits_[Sg::maxStepsPerTick]{};
+
+    // How active axes of current segment are integrated.
+    enum class Dispatch { None, One, List, All };
+    static const uint32_t allAxesMask = size == 32 ? ~0u : (1u << size) - 1;
+
+    // Current segment with its integration state.
+    Sg current_{0};
+    Ai homingDeceleration_{};
     Sg *RESTRICT it_{};
-    Sgs trajectory_;
+    Accum threshold_{};
+    bool withJerk_{};
+    Dispatch dispatch_{Dispatch::All};
+    int activeAxesCount_{};
+    int activeAxes_[size]{};
+    RingBuffer<int32_t, QueueWords> queue_;
+    // Pushed segments are counted by producer and loaded ones by consumer.
+    volatile size_t pushedSegments_{};
+    volatile size_t loadedSegments_{};
+    volatile uint32_t pushedTicks_{};
+    volatile uint32_t loadedTicks_{};
     TMotor *RESTRICT motor_{};
     TTicker *RESTRICT ticker_{};
     Ai position_{};
@@ -3,16 +3,30 @@
 #include "Segment.h"
 
 #include <algorithm>
+#include <array>
+#include <initializer_list>
+
+#ifndef __MBED__
+#include <future>
+#endif
 
 namespace StepperControl {
 // It creates sequence of linear and parabolic trajectory from given path points,
 // durations between points and durations of blend trajectory.
-template <size_t AxesSize>
+// Segments which are too long for accumulators of Accum type or for int32_t durations are split
+// into shorter ones, which continue each other exactly, so long and slow moves are safe at high
+// tick rates.
+// Blends are parabolic with constant acceleration or, if jerk is limited, two cubic segments in
+// which acceleration rises linearly from zero and falls back. The latter have twice the peak
+// acceleration of parabolic blends of the same duration.
+// Trajectory can continue the previous one, which ended with a line truncated for a blend at the
+// first way-point, and can end without the last blend, so the next trajectory continues it.
+template <size_t AxesSize, typename Accum = int64_t>
 class TrajectoryToSegmentsConverter {
   public:
     using Af = Axes<float, AxesSize>;
     using Ai = Axes<int32_t, AxesSize>;
-    using Sg = Segment<AxesSize>;
+    using Sg = Segment<AxesSize, Accum>;
     using Segments = std::vector<Sg>;
 
     explicit TrajectoryToSegmentsConverter(std::vector<Ai> const &path) : path_(path) {}
@@ -25,35 +39,154 @@ class TrajectoryToSegmentsConverter {
 
     void setBlendDurations(std::vector<float> &&blendDurations) { tbs_ = move(blendDurations); }
 
-    void appendTo(Segments &segments) {
+    // Previous trajectory ended with a line of given velocity, which was truncated for a blend of
+    // blendDuration at the first way-point.
+    void setPreviousLine(Af const &velocity, float blendDuration) {
+        previousVelocity_ = velocity;
+        previousBlendDuration_ = blendDuration;
+    }
+
+    // Velocity the first blend starts with. If it is zero after a previous line, the motion is
+    // stopped by the blend which was reserved for it.
+    void setInitialVelocity(Af const &velocity) { initialVelocity_ = velocity; }
+
+    // If false the last blend, which stops the motion, is not added.
+    void setStopAtEnd(bool stop) { stopAtEnd_ = stop; }
+
+    void setJerkLimitedBlends(bool jerkLimited) { jerkLimited_ = jerkLimited; }
+
+    // Slope of segments is at most steps - 0.5 steps per tick, see
+    // SegmentsExecutor::setMaxStepsPerTick. Durations are corrected to keep rounded slopes within
+    // the limit.
+    void setMaxStepsPerTick(int32_t steps) {
+        scAssert(steps >= 1 && steps <= Sg::maxStepsPerTick);
+        maxStepsPerTick_ = steps;
+    }
+
+    // Every segment is executed with the coarsest tick period up to the given one, in which its
+    // slope is within the limit, see Segment::period. Steps are timed with accuracy of the period
+    // and duration of the segment is rounded up to whole periods.
+    void setMaxTickPeriod(int32_t ticks) {
+        scAssert(ticks >= 1);
+        maxTickPeriod_ = ticks;
+    }
+
+    // Velocity of the last line and duration of the last blend it was truncated for.
+    // Valid after appendTo.
+    Af lastLineVelocity() const {
+        auto n = path_.size();
+        return n < 2 ? axZero<Af>() : axCast<float>(path_[n - 1] - path_[n - 2]) / Dts_[n - 2];
+    }
+
+    float lastBlendDuration() const { return tbs_.back(); }
+
+    // Segments is Segments, TPackedSgs or any other container with push_back.
+    template <typename TSegments>
+    void appendTo(TSegments &segments) {
+        roundDurations();
+        for (size_t i = 0; i < path_.size(); i++) {
+            addSegmentsForPoint(i, segments);
+        }
+    }
+
+#ifndef __MBED__
+    // The same as appendTo, but path is split into chunks of way-points, which are converted on
+    // given number of threads. Segments of a way-point depend only on its neighbors, so the result
+    // is identical. Segments is Segments or TPackedSgs.
+    template <typename TSegments>
+    void appendTo(TSegments &segments, size_t threads) {
+        roundDurations();
+        auto const size = path_.size();
+        auto const chunks = std::max<size_t>(1, std::min(threads, size));
+        std::vector<TSegments> chunkSegments(chunks);
+        std::vector<std::future<void>> futures;
+        for (size_t c = 0; c < chunks; ++c) {
+            auto convert = [this, c, chunks, size, &chunkSegments] {
+                for (auto i = size * c / chunks; i < size * (c + 1) / chunks; i++) {
+                    addSegmentsForPoint(i, chunkSegments[c]);
+                }
+            };
+            futures.push_back(std::async(std::launch::async, convert));
+        }
+        // Rethrows failed assertions of the threads.
+        for (auto &future : futures) {
+            future.get();
+        }
+        for (auto const &chunk : chunkSegments) {
+            appendSegments(segments, chunk);
+        }
+    }
+#endif
+
+  private:
+    // The least duration, in which displacement dx keeps slope within the limit. Multiplier is 2
+    // for a line, 4 for tangents of parabola and 6 for control polygon of cubic curve.
+    int64_t minTicks(int32_t dx, int32_t multiplier) const {
+        auto const doubledSlope = 2 * static_cast<int64_t>(maxStepsPerTick_) - 1;
+        return (static_cast<int64_t>(dx) * multiplier + doubledSlope - 1) / doubledSlope;
+    }
+
+    // Adds segment of given duration in ticks with the coarsest allowed tick period. Multiplier is
+    // the same as in minTicks.
+    template <typename TSegments, typename... Dxs>
+    void addSegment(TSegments &segments, int64_t ticks, int32_t multiplier, Dxs const &... dxs) {
+        int32_t period = 1;
+        if (maxTickPeriod_ > 1) {
+            // Cubic segment takes at least two ticks.
+            int64_t least = multiplier == 6 ? 2 : 1;
+            for (auto const *dx : {&dxs...}) {
+                for (size_t j = 0; j < AxesSize; ++j) {
+                    least = std::max(least, minTicks(std::abs((*dx)[j]), multiplier));
+                }
+            }
+            while (period <= maxTickPeriod_ / 2 && ticks / (2 * period) >= least) {
+                period *= 2;
+            }
+        }
+        auto sg = Sg(static_cast<int32_t>((ticks + period - 1) / period), dxs...);
+        sg.period = period;
+        segments.push_back(sg);
+    }
+
+    void roundDurations() {
         scAssert(!path_.empty());
         scAssert(path_.size() - 1 == Dts_.size());
         scAssert(path_.size() == tbs_.size());
 
         std::transform(Dts_.begin(), Dts_.end(), Dts_.begin(), &ceilf);
         std::transform(tbs_.begin(), tbs_.end(), tbs_.begin(), &ceilf);
+    }
 
-        for (size_t i = 0; i < path_.size(); i++) {
-            addSegmentsForPoint(i, segments);
-        }
+    static void appendSegments(Segments &segments, Segments const &chunk) {
+        segments.insert(segments.end(), chunk.begin(), chunk.end());
     }
 
-  private:
-    void addSegmentsForPoint(size_t i, Segments &segments) {
+    template <typename TSegments>
+    static void appendSegments(TSegments &segments, TSegments const &chunk) {
+        segments.append(chunk);
+    }
+
+    template <typename TSegments>
+    void addSegmentsForPoint(size_t i, TSegments &segments) {
         auto firstPoint = i == 0;
         auto lastPoint = (i == path_.size() - 1);
 
         auto x = path_[i];
         auto tBlend = tbs_[i];
 
-        // Add only nonzero blend segment.
-        if (tBlend > 0) {
+        if (firstPoint && any(neq(previousVelocity_, axZero<Af>()))) {
+            addPreviousLineEnd(segments);
+        }
+
+        // Add only nonzero blend segment, the last one only if it stops.
+        if (tBlend > 0 && (!lastPoint || stopAtEnd_)) {
             auto v = axZero<Af>();     // First tangent slope.
             auto vNext = axZero<Af>(); // Second tangent slope.
 
             // Treat first and last points differently.
             if (firstPoint) {
-                // First tangent of first blend has zero slope.
+                // First tangent of first blend has initial slope.
+                v = initialVelocity_;
                 vNext = axCast<float>(path_[i + 1] - x) / Dts_[i];
             } else if (lastPoint) {
                 // Second tangent of last blend has zero slope.
@@ -63,26 +196,7 @@ class TrajectoryToSegmentsConverter {
                 vNext = axCast<float>(path_[i + 1] - x) / Dts_[i];
             }
 
-            scAssert(all(le(axAbs(v), axConst<Af>(0.5f))));
-            scAssert(all(le(axAbs(vNext), axConst<Af>(0.5f))));
-
-            auto Dx = axLRound(0.5f * tBlend * v);
-            auto DxNext = axLRound(0.5f * tBlend * vNext);
-
-            // Check rounded slope <= 0.5 and correct blend duration if necessary.
-            auto tBlendCorrected = tBlend;
-            for (size_t j = 0; j < AxesSize; ++j) {
-                auto DxAbsX4 = abs(Dx[j] * 4.f);
-                if (tBlendCorrected < DxAbsX4) {
-                    tBlendCorrected = DxAbsX4;
-                }
-                auto DxNextAbsX4 = abs(DxNext[j] * 4.f);
-                if (tBlendCorrected < DxNextAbsX4) {
-                    tBlendCorrected = DxNextAbsX4;
-                }
-            }
-
-            segments.emplace_back(static_cast<int32_t>(tBlendCorrected), Dx, DxNext);
+            addBlendSegments(tBlend, v, vNext, segments);
         }
 
         // Where is no linear trajectory after last point.
@@ -105,20 +219,252 @@ class TrajectoryToSegmentsConverter {
         auto tLine = Dt - tBlendPart;
         auto DxLine = Dx - (DxBlend + DxBlendNext);
 
-        auto tLineTrunc = lTruncTowardInf(tLine);
+        auto tLineTrunc = llTruncTowardInf(tLine);
         if (tLineTrunc > 0) {
-            // Check rounded slope <= 0.5 and correct line duration if necessary.
+            // Check rounded slope is within the limit and correct line duration if necessary.
             for (size_t j = 0; j < AxesSize; ++j) {
-                auto DxAbsX2 = abs(DxLine[j] * 2);
-                if (tLineTrunc < DxAbsX2) {
-                    tLineTrunc = DxAbsX2;
+                auto minDt = minTicks(abs(DxLine[j]), 2);
+                if (tLineTrunc < minDt) {
+                    tLineTrunc = minDt;
+                }
+            }
+            addLinearSegments(tLineTrunc, DxLine, segments);
+        }
+    }
+
+    // Blend around way-point between tangents with slopes v and vNext.
+    template <typename TSegments>
+    void addBlendSegments(float tBlend, Af const &v, Af const &vNext, TSegments &segments) {
+        auto const maxSlope = maxStepsPerTick_ - 0.5f;
+        scAssert(all(le(axAbs(v), axConst<Af>(maxSlope))));
+        scAssert(all(le(axAbs(vNext), axConst<Af>(maxSlope))));
+
+        auto Dx = axLRound(0.5f * tBlend * v);
+        auto DxNext = axLRound(0.5f * tBlend * vNext);
+
+        // Check rounded slope is within the limit and correct blend duration if necessary.
+        auto tBlendCorrected = tBlend;
+        for (size_t j = 0; j < AxesSize; ++j) {
+            auto minDt = static_cast<float>(minTicks(abs(Dx[j]), 4));
+            if (tBlendCorrected < minDt) {
+                tBlendCorrected = minDt;
+            }
+            auto minDtNext = static_cast<float>(minTicks(abs(DxNext[j]), 4));
+            if (tBlendCorrected < minDtNext) {
+                tBlendCorrected = minDtNext;
+            }
+        }
+
+        if (jerkLimited_ && tBlendCorrected >= minSCurveTicks) {
+            addSCurveSegments(static_cast<int64_t>(tBlendCorrected), Dx, DxNext, segments);
+            return;
+        }
+        addParabolicSegments(static_cast<int64_t>(tBlendCorrected), Dx, DxNext, segments);
+    }
+
+    // Shorter blends are parabolic.
+    static const int32_t minSCurveTicks = 8;
+
+    // Blend with the same tangents as parabolic one. Acceleration rises linearly in the first half
+    // and falls in the second one, both halves are cubic and tangent at the middle is the average.
+    // With x(t) = v * t + j * t^3 / 6 the middle is reached at (5 * v + vNext) / 6 * half.
+    template <typename TSegments>
+    void addSCurveSegments(int64_t twiceDt, Ai const &dx1, Ai const &dx2, TSegments &segments) {
+        auto const dx1f = axCast<float>(dx1);
+        auto const dx2f = axCast<float>(dx2);
+        auto const xMiddle = axLRound((5.f * dx1f + dx2f) / 6.f);
+        auto const start = axLRound(dx1f / 3.f);
+        auto const end = axLRound(dx2f / 3.f);
+
+        auto const first = std::array<Ai, 3>{{start, start, xMiddle - 2 * start}};
+        auto const second = std::array<Ai, 3>{{dx1 + dx2 - xMiddle - 2 * end, end, end}};
+
+        // Check rounded slope is within the limit and correct halves duration if necessary.
+        auto half = (twiceDt + 1) / 2;
+        for (auto const &dxs : {first, second}) {
+            for (auto const &dx : dxs) {
+                for (size_t j = 0; j < AxesSize; ++j) {
+                    half = std::max(half, minTicks(std::abs(dx[j]), 6));
                 }
             }
-            segments.emplace_back(tLineTrunc, DxLine);
+        }
+
+        addCubicSegments(half, first[0], first[1], first[2], segments);
+        addCubicSegments(half, second[0], second[1], second[2], segments);
+    }
+
+    // Previous line was truncated for its own blend. Either the motion stops with that blend or
+    // continues with the first blend, which is not longer, and the line is extended to its start.
+    template <typename TSegments>
+    void addPreviousLineEnd(TSegments &segments) {
+        auto tBlend = ceilf(previousBlendDuration_);
+        if (all(eq(initialVelocity_, axZero<Af>()))) {
+            if (tBlend > 0) {
+                addBlendSegments(tBlend, previousVelocity_, axZero<Af>(), segments);
+            }
+            return;
+        }
+        auto tFirstBlend = tbs_[0];
+        // Planners fit the first blend into the reserved one or stop with it.
+        scAssert(tFirstBlend <= tBlend);
+        auto DxLine = axLRound(0.5f * tBlend * previousVelocity_) -
+                      axLRound(0.5f * tFirstBlend * previousVelocity_);
+        auto tLineTrunc = llTruncTowardInf(std::max(0.f, (tBlend - tFirstBlend) * 0.5f));
+        for (size_t j = 0; j < AxesSize; ++j) {
+            tLineTrunc = std::max(tLineTrunc, minTicks(std::abs(DxLine[j]), 2));
+        }
+        if (tLineTrunc > 0) {
+            addLinearSegments(tLineTrunc, DxLine, segments);
+        }
+    }
+
+    // Splits line into pieces with integer end points on it.
+    template <typename TSegments>
+    void addLinearSegments(int64_t dt, Ai const &dx, TSegments &segments) {
+        int64_t const maxDt = Sg::maxDt;
+        if (dt <= maxDt) {
+            addSegment(segments, dt, 2, dx);
+            return;
+        }
+
+        // Half of the limit leaves room for slope correction.
+        auto pieces = (dt - 1) / (maxDt / 2) + 1;
+        auto x = axZero<Ai>();
+        for (int64_t k = 1; k <= pieces; ++k) {
+            auto t0 = dt * (k - 1) / pieces;
+            auto t1 = dt * k / pieces;
+            auto xNext = dx;
+            for (size_t j = 0; j < AxesSize; ++j) {
+                // The same as dx * t1 / dt up to rounding of t1, but can't overflow.
+                xNext[j] = static_cast<int32_t>(dx[j] * k / pieces);
+            }
+            auto dxPiece = xNext - x;
+
+            // Check rounded slope is within the limit and correct piece duration if necessary.
+            auto dtPiece = t1 - t0;
+            for (size_t j = 0; j < AxesSize; ++j) {
+                dtPiece = std::max(dtPiece, minTicks(std::abs(dxPiece[j]), 2));
+            }
+            addSegment(segments, dtPiece, 2, dxPiece);
+            x = xNext;
+        }
+    }
+
+    // Splits parabola into pieces with integer end points on it. Tangents of pieces are rounded,
+    // so velocity is continuous up to rounding, but total displacement is exact.
+    template <typename TSegments>
+    void addParabolicSegments(int64_t twiceDt, Ai const &dx1, Ai const &dx2,
+                              TSegments &segments) {
+        int64_t const maxTwiceDt = Sg::maxTwiceDt;
+        if (twiceDt <= maxTwiceDt) {
+            addSegment(segments, twiceDt, 4, dx1, dx2);
+            return;
+        }
+
+        // Parabola is x(s) = 2 * s * dx1 + s^2 * (dx2 - dx1), where s = t / twiceDt.
+        auto dx1f = axCast<float>(dx1);
+        auto curvature = axCast<float>(dx2 - dx1);
+
+        // Half of the limit leaves room for slope correction.
+        auto pieces = (twiceDt - 1) / (maxTwiceDt / 2) + 1;
+        auto x = axZero<Ai>();
+        for (int64_t k = 1; k <= pieces; ++k) {
+            auto t0 = twiceDt * (k - 1) / pieces;
+            auto t1 = twiceDt * k / pieces;
+            auto s0 = static_cast<float>(t0) / twiceDt;
+            auto s1 = static_cast<float>(t1) / twiceDt;
+
+            auto xNext = k == pieces ? dx1 + dx2 : axLRound(2.f * s1 * dx1f + s1 * s1 * curvature);
+            auto dx1Piece = axLRound((dx1f + s0 * curvature) * (s1 - s0));
+            auto dx2Piece = xNext - x - dx1Piece;
+
+            // Check rounded slope is within the limit and correct piece duration if necessary.
+            auto twiceDtPiece = t1 - t0;
+            for (size_t j = 0; j < AxesSize; ++j) {
+                twiceDtPiece = std::max(twiceDtPiece, minTicks(std::abs(dx1Piece[j]), 4));
+                twiceDtPiece = std::max(twiceDtPiece, minTicks(std::abs(dx2Piece[j]), 4));
+            }
+            addSegment(segments, twiceDtPiece, 4, dx1Piece, dx2Piece);
+            x = xNext;
+        }
+    }
+
+    // Splits cubic Bezier curve into pieces of equal duration. Tangent and curvature of the
+    // control polygon at the end of a piece are carried to the next one, so velocity and
+    // acceleration are continuous at split points and only jerk of pieces is rounded. Its rounding
+    // errors are corrected by jerk of the next pieces, which keeps positions within a few steps
+    // of the curve, and the last piece ends at the exact displacement.
+    template <typename TSegments>
+    void addCubicSegments(int64_t thriceDt, Ai const &dx1, Ai const &dx2, Ai const &dx3,
+                          TSegments &segments) {
+        int64_t const maxThriceDt = Sg::maxThriceDt;
+        if (thriceDt <= maxThriceDt) {
+            addSegment(segments, thriceDt, 6, dx1, dx2, dx3);
+            return;
+        }
+
+        // Curve is x(s) = 3 * s * dx1 + 3 * s^2 * (dx2 - dx1) + s^3 * (dx3 - 2 * dx2 + dx1),
+        // its derivatives are x'(s) = 3 * dx1 + 6 * s * (dx2 - dx1) +
+        // 3 * s^2 * (dx3 - 2 * dx2 + dx1) and x''(s) = 6 * (dx2 - dx1) +
+        // 6 * s * (dx3 - 2 * dx2 + dx1), and s = t / thriceDt.
+        auto const dx1f = axCast<float>(dx1);
+        auto const curvature = axCast<float>(dx2 - dx1);
+        auto const cubic = axCast<float>(dx3 - 2 * dx2 + dx1);
+        auto position = [&](float s) {
+            return 3.f * s * dx1f + 3.f * s * s * curvature + s * s * s * cubic;
+        };
+        auto derivative = [&](float s) {
+            return 3.f * dx1f + 6.f * s * curvature + 3.f * s * s * cubic;
+        };
+        auto secondDerivative = [&](float s) { return 6.f * curvature + 6.f * s * cubic; };
+
+        // Half of the limit leaves room for slope correction.
+        auto const pieces = (thriceDt - 1) / (maxThriceDt / 2) + 1;
+        auto const thriceDtPieces = (thriceDt + pieces - 1) / pieces;
+        auto const h = 1.f / static_cast<float>(pieces);
+
+        // Piece starts at x with control polygon tangent a and curvature alpha, which are
+        // h * x'(s) / 3 and h^2 * x''(s) / 6 on the curve, and ends with a + 2 * alpha + jerk and
+        // alpha + jerk. Jerk of the curve is h^3 * (dx3 - 2 * dx2 + dx1) in every piece.
+        auto x = axZero<Ai>();
+        auto a = axLRound(derivative(0) * (h / 3.f));
+        auto alpha = axLRound(secondDerivative(0) * (h * h / 6.f));
+        for (int64_t k = 0; k < pieces; ++k) {
+            auto jerk = dx1 + dx2 + dx3 - x - 3 * a - 3 * alpha;
+            if (k < pieces - 1) {
+                // Deadbeat feedback of errors of position, tangent and curvature, they are zero
+                // after three pieces up to rounding.
+                auto const s = static_cast<float>(k) * h;
+                auto const ex = axCast<float>(x) - position(s);
+                auto const ea = axCast<float>(a) - derivative(s) * (h / 3.f);
+                auto const eAlpha = axCast<float>(alpha) - secondDerivative(s) * (h * h / 6.f);
+                jerk = axLRound(cubic * (h * h * h) - ex / 6.f - ea - eAlpha * (11.f / 6.f));
+            }
+            auto const b = a + alpha;
+            auto const c = b + alpha + jerk;
+
+            // Check rounded slope is within the limit and correct piece duration if necessary.
+            auto thriceDtPiece = thriceDtPieces;
+            for (size_t j = 0; j < AxesSize; ++j) {
+                thriceDtPiece = std::max(thriceDtPiece, minTicks(std::abs(a[j]), 6));
+                thriceDtPiece = std::max(thriceDtPiece, minTicks(std::abs(b[j]), 6));
+                thriceDtPiece = std::max(thriceDtPiece, minTicks(std::abs(c[j]), 6));
+            }
+            addSegment(segments, thriceDtPiece, 6, a, b, c);
+            x += a + b + c;
+            a = c;
+            alpha = alpha + jerk;
         }
     }
 
     std::vector<Ai> const &path_;
+    Af previousVelocity_{};
+    float previousBlendDuration_{};
+    Af initialVelocity_{};
+    bool stopAtEnd_{true};
+    bool jerkLimited_{};
+    int32_t maxStepsPerTick_{1};
+    int32_t maxTickPeriod_{1};
     std::vector<float> Dts_;
     std::vector<float> tbs_;
 };
@@ -121,9 +121,11 @@ void MainWindow::readyRead() {
         qDebug() << ">>" << line.trimmed();
         parser_->parseLine(line.data());
     }
+    interpreter_->poll();
 }
 
 void MainWindow::statusTimerTimeout() {
+    interpreter_->poll();
     if (executor_->isRunning()) {
         interpreter_->printCurrentPosition();
     }
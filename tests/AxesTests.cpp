@@ -145,6 +145,14 @@ TEST_F(Axes_Should, calculate_norm) {
     EXPECT_THAT(norm(a), FloatEq(5.f));
 }
 
+TEST_F(Axes_Should, take_elementwise_min_and_max) {
+    auto a = Af2{1, 20};
+    auto b = Af2{10, 2};
+
+    EXPECT_THAT(axMin(a, b), ElementsAre(1.f, 2.f));
+    EXPECT_THAT(axMax(a, b), ElementsAre(10.f, 20.f));
+}
+
 TEST_F(Axes_Should, apply_function) {
     auto a = Af2{3.f, 4.f};
     applyInplace(a, [](float v) { return v * 10; });
@@ -0,0 +1,543 @@
+#include "stdafx.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include "../include/sc/PackedSegments.h"
+#include "../include/sc/PathToTimeOptimalTrajectoryConverter.h"
+#include "../include/sc/PathToTrajectoryConverter.h"
+#include "../include/sc/SegmentsExecutor.h"
+#include "../include/sc/TrajectoryToSegmentsConverter.h"
+
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+using namespace StepperControl;
+using namespace testing;
+using namespace std;
+
+namespace {
+
+struct AxTr {
+    static const int size = 3;
+
+    static const char *names() { return "XYZ"; }
+};
+
+using Ai = TAi<AxTr::size>;
+using Af = TAf<AxTr::size>;
+using Sg = Segment<AxTr::size>;
+
+template <size_t AxesSize = AxTr::size>
+struct MotorMock {
+    using Ai = TAi<AxesSize>;
+
+    MotorMock() : dir(axZero<Ai>()), pos(axZero<Ai>()) {}
+
+    template <int i>
+    void writeDirection(StepperNumber<i>, bool reverse) {
+        dir[i] = reverse ? -1 : 1;
+    }
+
+    template <int i>
+    void writeStep(StepperNumber<i>, bool edge) {
+        pos[i] += edge ? dir[i] : 0;
+    }
+
+    static void begin() {}
+
+    // Cheap fingerprint of the whole step sequence, positions of every tick are kept on demand.
+    void end() {
+        for (size_t i = 0; i < AxesSize; ++i) {
+            trace = trace * 31 + static_cast<uint64_t>(pos[i]);
+        }
+        if (keepPositions) {
+            positions.push_back(pos);
+        }
+    }
+
+    void setPosition(Ai const &position) { pos = position; }
+
+    static bool checkEndSwitchHit(size_t) { return false; }
+
+    Ai dir;
+    Ai pos;
+    uint64_t trace = 0;
+    bool keepPositions = false;
+    vector<Ai> positions;
+};
+
+struct TickerMock {
+    template <typename T>
+    void attach_us(T *, void (T::*)(), int us) {
+        intervalUs = us;
+    }
+
+    void detach() { intervalUs = 0; }
+
+    int intervalUs = 0;
+};
+
+using Clock = chrono::steady_clock;
+
+double elapsedMs(Clock::time_point start) {
+    return chrono::duration<double, milli>(Clock::now() - start).count();
+}
+
+// Zig-zag path with slow moves typical for a stepper driven at 100 kHz.
+template <typename Accum = int64_t>
+vector<Segment<AxTr::size, Accum>> makeTrajectory(float maxVel, float maxAcc,
+                                                  int32_t maxTickPeriod = 1) {
+    auto path = vector<Ai>{{0, 0, 0}};
+    for (int i = 1; i <= 10; ++i) {
+        path.push_back(Ai{i * 1000, (i % 2) * 2000, i * 100});
+    }
+
+    auto trajGen = PathToTrajectoryConverter<AxTr::size>(path);
+    trajGen.setMaxVelocity(axConst<Af>(maxVel));
+    trajGen.setMaxAcceleration(axConst<Af>(maxAcc));
+    trajGen.update();
+
+    auto segGen = TrajectoryToSegmentsConverter<AxTr::size, Accum>(path);
+    segGen.setBlendDurations(move(trajGen.blendDurations()));
+    segGen.setDurations(move(trajGen.durations()));
+    segGen.setMaxTickPeriod(maxTickPeriod);
+    auto segments = vector<Segment<AxTr::size, Accum>>();
+    segGen.appendTo(segments);
+    return segments;
+}
+
+struct RunResult {
+    Ai position;
+    uint64_t trace;
+    size_t interrupts;
+    double ms;
+    vector<Ai> positions;
+};
+
+template <typename Accum>
+RunResult runExecutor(vector<Segment<AxTr::size, Accum>> const &segments,
+                      TickMode mode = TickMode::Periodic, bool keepPositions = false) {
+    MotorMock<> motor;
+    motor.keepPositions = keepPositions;
+    TickerMock ticker;
+    // Queue is big enough to hold whole trajectory.
+    SegmentsExecutor<MotorMock<>, TickerMock, AxTr, 4096, Accum> executor(&motor, &ticker);
+    executor.setTicksPerSecond(100000);
+    executor.setTickMode(mode);
+    executor.setTrajectory(segments);
+
+    auto start = Clock::now();
+    executor.start();
+    size_t interrupts = 0;
+    while (executor.isRunning()) {
+        if (mode == TickMode::NextStep) {
+            executor.tickNextStep();
+        } else {
+            executor.tickPeriodic();
+        }
+        ++interrupts;
+    }
+    return {motor.pos, motor.trace, interrupts, elapsedMs(start), move(motor.positions)};
+}
+// Previous implementation of slow down which checks all blends in every round.
+struct FullPassSlowDown {
+    vector<float> durations;
+    vector<float> blendDurations;
+    int rounds = 0;
+
+    FullPassSlowDown(vector<Ai> const &path, Af const &maxVel, Af const &maxAcc) {
+        constexpr auto eps = 1e-6f;
+        auto const size = path.size();
+        auto velocities = vector<Af>(size);
+        durations.resize(size - 1);
+        blendDurations.resize(size);
+        for (size_t i = 0; i < size - 1; i++) {
+            durations[i] = 0.0f;
+            for (size_t j = 0; j < AxTr::size; j++) {
+                durations[i] =
+                    std::max(durations[i], std::abs(path[i + 1][j] - path[i][j]) / maxVel[j]);
+            }
+            velocities[i] = axCast<float>(path[i + 1] - path[i]) / durations[i];
+        }
+
+        auto &Dts = durations;
+        auto &tbs = blendDurations;
+        int numBlendsSlowedDown = 1;
+        vector<float> slowDownFactors(size);
+        while (numBlendsSlowedDown >= 1) {
+            ++rounds;
+            numBlendsSlowedDown = 0;
+            fill(slowDownFactors.begin(), slowDownFactors.end(), 1.0f);
+            for (size_t i = 0; i < size; i++) {
+                Af previousVelocity = (i == 0) ? axConst<Af>(0.f) : velocities[i - 1];
+                Af nextVelocity = (i == size - 1) ? axConst<Af>(0.f) : velocities[i];
+                tbs[i] = 0.0f;
+                for (size_t j = 0; j < AxTr::size; j++) {
+                    tbs[i] =
+                        std::max(tbs[i], abs(nextVelocity[j] - previousVelocity[j]) / maxAcc[j]);
+                }
+                if ((i > 0 && tbs[i] > Dts[i - 1] + eps &&
+                     tbs[i - 1] + tbs[i] > 2.f * Dts[i - 1] + eps) ||
+                    (i < size - 1 && tbs[i] > Dts[i] + eps &&
+                     tbs[i] + tbs[i + 1] > 2.f * Dts[i] + eps)) {
+                    numBlendsSlowedDown++;
+                    auto maxDuration =
+                        std::min(i == 0 ? numeric_limits<float>::max() : Dts[i - 1],
+                                 i == size - 1 ? numeric_limits<float>::max() : Dts[i]);
+                    slowDownFactors[i] = std::sqrt(maxDuration / tbs[i]);
+                }
+            }
+            for (size_t i = 0; i < size - 1; i++) {
+                auto f = std::min(slowDownFactors[i], slowDownFactors[i + 1]);
+                velocities[i] *= f;
+                Dts[i] = Dts[i] / f;
+            }
+        }
+    }
+};
+
+// Zig-zag with growing segments and small wiggles. Slow down of the short segments at the start
+// propagates to the longer ones only by one segment per round.
+vector<Ai> makeZigZag(size_t size) {
+    auto path = vector<Ai>{{0, 0, 0}};
+    for (size_t i = 1; i < size; ++i) {
+        auto prev = path.back();
+        path.push_back(Ai{prev[0] + static_cast<int32_t>(i), static_cast<int32_t>(i % 2), 0});
+    }
+    return path;
+}
+
+// Rectangle with corners rounded by dense short segments like CAM output.
+vector<Ai> makeRoundedRectangle(int corners, int pointsPerCorner) {
+    auto const pi = 3.14159265f;
+    auto const radius = 300.f;
+    auto path = vector<Ai>{{0, 0, 0}};
+    for (int c = 0; c < corners; ++c) {
+        auto x0 = (c % 2) * 20000.f;
+        auto y0 = ((c / 2) % 2) * 10000.f;
+        for (int k = 0; k <= pointsPerCorner; ++k) {
+            auto angle = pi / 2 * (c + static_cast<float>(k) / pointsPerCorner);
+            path.push_back(Ai{static_cast<int32_t>(x0 + radius * cos(angle)),
+                              static_cast<int32_t>(y0 + radius * sin(angle)), 0});
+        }
+    }
+    return path;
+}
+
+// Ticks of the whole trajectory planned by TrajGen.
+template <typename TrajGen>
+int64_t trajectoryTicks(vector<Ai> path, Af const &maxVel, Af const &maxAcc) {
+    auto trajGen = TrajGen(path);
+    trajGen.setMaxVelocity(maxVel);
+    trajGen.setMaxAcceleration(maxAcc);
+    trajGen.update();
+
+    auto segGen = TrajectoryToSegmentsConverter<AxTr::size>(path);
+    segGen.setBlendDurations(move(trajGen.blendDurations()));
+    segGen.setDurations(move(trajGen.durations()));
+    auto segments = vector<Sg>();
+    segGen.appendTo(segments);
+
+    auto ticks = int64_t{};
+    for (auto const &sg : segments) {
+        ticks += sg.dt;
+    }
+    return ticks;
+}
+}
+
+TEST(SegmentsExecutorBenchmark, next_step_tick_mode_reduces_interrupts) {
+    auto segments = makeTrajectory(0.05f, 1e-5f);
+    ASSERT_THAT(segments.size(), Le(128u));
+
+    auto periodic = runExecutor(segments, TickMode::Periodic);
+    auto nextStep = runExecutor(segments, TickMode::NextStep);
+
+    printf("Periodic: %u interrupts, %.2f ms\n", static_cast<unsigned>(periodic.interrupts),
+           periodic.ms);
+    printf("NextStep: %u interrupts, %.2f ms\n", static_cast<unsigned>(nextStep.interrupts),
+           nextStep.ms);
+
+    EXPECT_THAT(nextStep.position, Eq(Ai{10000, 0, 1000}));
+    EXPECT_THAT(nextStep.position, Eq(periodic.position));
+    EXPECT_THAT(nextStep.interrupts * 2, Lt(periodic.interrupts));
+}
+
+TEST(SegmentsExecutorBenchmark, coarse_tick_periods_reduce_interrupts) {
+    auto segments = makeTrajectory(0.05f, 1e-5f);
+    auto coarseSegments = makeTrajectory(0.05f, 1e-5f, 16);
+    // Dwell in the middle.
+    segments.insert(segments.begin() + segments.size() / 2, Sg(100000));
+    coarseSegments.insert(coarseSegments.begin() + coarseSegments.size() / 2, Sg(100000));
+
+    auto periodic = runExecutor(segments);
+    auto coarse = runExecutor(coarseSegments);
+
+    printf("Tick period 1: %u interrupts, %.2f ms\n", static_cast<unsigned>(periodic.interrupts),
+           periodic.ms);
+    printf("Tick period up to 16: %u interrupts, %.2f ms\n",
+           static_cast<unsigned>(coarse.interrupts), coarse.ms);
+
+    EXPECT_THAT(coarse.position, Eq(periodic.position));
+    EXPECT_THAT(coarse.interrupts * 4, Lt(periodic.interrupts));
+}
+
+TEST(SegmentsExecutorBenchmark, int32_accumulators_make_same_steps) {
+    // Blends are long enough to be split for 32 bit accumulators.
+    auto segments32 = makeTrajectory<int32_t>(0.05f, 1e-6f);
+    auto segments = makeTrajectory(0.05f, 1e-6f);
+    ASSERT_THAT(segments32.size(), Gt(segments.size()));
+    ASSERT_THAT(segments32.size(), Le(128u));
+
+    // The same split segments executed with 64 bit accumulators.
+    auto segments64 = vector<Sg>();
+    for (auto const &sg : segments32) {
+        segments64.push_back(Sg(sg));
+    }
+
+    auto result = runExecutor(segments, TickMode::Periodic, true);
+    auto result64 = runExecutor(segments64);
+    auto result32 = runExecutor(segments32, TickMode::Periodic, true);
+
+    printf("int64: %u ticks, %.2f ms\n", static_cast<unsigned>(result64.interrupts),
+           result64.ms);
+    printf("int32: %u ticks, %.2f ms\n", static_cast<unsigned>(result32.interrupts),
+           result32.ms);
+
+    EXPECT_THAT(result32.trace, Eq(result64.trace));
+    EXPECT_THAT(result32.interrupts, Eq(result64.interrupts));
+    EXPECT_THAT(result32.position, Eq(result.position));
+    EXPECT_THAT(result32.position, Eq(Ai{10000, 0, 1000}));
+
+    // Split points are rounded to steps, so split segments follow the unsplit ones within a step
+    // at every tick.
+    ASSERT_THAT(result32.positions.size(), Eq(result.positions.size()));
+    auto maxDiff = 0;
+    for (size_t t = 0; t < result.positions.size(); ++t) {
+        maxDiff = max(maxDiff, axMax(axAbs(result32.positions[t] - result.positions[t])));
+    }
+    EXPECT_THAT(maxDiff, Le(1));
+}
+
+TEST(SegmentsExecutorBenchmark, idle_axes_are_skipped) {
+    using Ai9 = TAi<DefaultAxesTraits::size>;
+    using Sg9 = Segment<DefaultAxesTraits::size>;
+    using Executor9 = SegmentsExecutor<MotorMock<DefaultAxesTraits::size>, TickerMock>;
+
+    // Returns ns per tick and fingerprint of steps.
+    auto run = [](vector<Sg9> const &segments) {
+        MotorMock<DefaultAxesTraits::size> motor;
+        TickerMock ticker;
+        Executor9 executor(&motor, &ticker);
+        size_t ticks = 0;
+        auto start = Clock::now();
+        for (size_t i = 0; i < segments.size();) {
+            while (i < segments.size() && executor.push(segments[i])) {
+                ++i;
+            }
+            executor.start();
+            while (executor.isRunning()) {
+                executor.tick();
+                ++ticks;
+            }
+        }
+        return make_pair(elapsedMs(start) * 1e6 / ticks, motor.trace);
+    };
+
+    for (auto activeAxes : {1, 2, 9}) {
+        auto dx = axZero<Ai9>();
+        for (int j = 0; j < activeAxes; ++j) {
+            dx[j] = 300 + 50 * j;
+        }
+        auto segments = vector<Sg9>();
+        for (int k = 0; k < 200; ++k) {
+            segments.push_back(Sg9(2000, k % 2 ? dx : -dx));
+        }
+        // Without mask every axis is integrated on every tick.
+        auto allAxes = segments;
+        for (auto &sg : allAxes) {
+            sg.axesMask = (1u << DefaultAxesTraits::size) - 1;
+        }
+
+        // Best of several runs to reduce noise.
+        auto masked = run(segments);
+        auto unmasked = run(allAxes);
+        for (int k = 0; k < 2; ++k) {
+            masked.first = min(masked.first, run(segments).first);
+            unmasked.first = min(unmasked.first, run(allAxes).first);
+        }
+        printf("%d of 9 axes: %.1f ns per tick, without mask %.1f ns per tick\n", activeAxes,
+               masked.first, unmasked.first);
+        EXPECT_THAT(masked.second, Eq(unmasked.second));
+    }
+}
+
+TEST(PathToTrajectoryConverterBenchmark, remove_close_waypoints_scales_linearly) {
+    // Returns ns per way-point.
+    auto run = [](size_t size, int spread) {
+        // Random walk of micro-moves like CAM output. Without spread it is a single chain of
+        // close way-points, which are all merged.
+        auto path = vector<Ai>();
+        path.reserve(size);
+        auto point = axZero<Ai>();
+        srand(1);
+        for (size_t k = 0; k < size; ++k) {
+            for (int j = 0; j < AxTr::size; ++j) {
+                point[j] += spread ? rand() % (2 * spread + 1) - spread : 1;
+            }
+            path.push_back(point);
+        }
+        auto converter = PathToTrajectoryConverter<AxTr::size>(path);
+
+        auto start = Clock::now();
+        converter.removeCloseWaypoints(axConst<Ai>(2));
+        auto ns = elapsedMs(start) * 1e6 / size;
+        printf("%u way-points, spread %d: %u left, %.1f ns per way-point\n",
+               static_cast<unsigned>(size), spread, static_cast<unsigned>(path.size()), ns);
+        RecordProperty(to_string(size) + "_spread_" + to_string(spread) + "_ns_per_waypoint",
+                       static_cast<int>(ns));
+        EXPECT_THAT(path.size(), Lt(size));
+        return ns;
+    };
+
+    for (auto spread : {3, 0}) {
+        auto small = run(10000, spread);
+        run(100000, spread);
+        auto large = run(1000000, spread);
+
+        // Quadratic algorithm would be a hundred times slower per way-point, the margin is
+        // coarse to tolerate noise of loaded machines.
+        EXPECT_THAT(large, Lt(10 * small + 10));
+    }
+}
+
+TEST(PathToTrajectoryConverterBenchmark, slow_down_revisits_only_changed_blends) {
+    auto const maxVel = axConst<Af>(0.5f);
+    auto const maxAcc = axConst<Af>(1e-6f);
+    for (auto size : {100, 1000, 5000}) {
+        auto path = makeZigZag(size);
+
+        auto start = Clock::now();
+        auto expected = FullPassSlowDown(path, maxVel, maxAcc);
+        auto fullPassMs = elapsedMs(start);
+
+        auto converter = PathToTrajectoryConverter<AxTr::size>(path);
+        converter.setMaxVelocity(maxVel);
+        converter.setMaxAcceleration(maxAcc);
+        start = Clock::now();
+        converter.update();
+        auto ms = elapsedMs(start);
+
+        printf("%d way-points, %d rounds: full pass %.2f ms, changed blends %.2f ms\n", size,
+               expected.rounds, fullPassMs, ms);
+        EXPECT_THAT(converter.durations(), Pointwise(FloatEq(), expected.durations));
+        EXPECT_THAT(converter.blendDurations(), Pointwise(FloatEq(), expected.blendDurations));
+        RecordProperty(to_string(size) + "_full_pass_us", static_cast<int>(fullPassMs * 1000));
+        RecordProperty(to_string(size) + "_changed_blends_us", static_cast<int>(ms * 1000));
+        // It is about a hundred times faster, the margin is coarse to tolerate noise of loaded
+        // machines.
+        if (size == 5000) {
+            EXPECT_THAT(ms * 10, Lt(fullPassMs));
+        }
+    }
+}
+
+TEST(PathToTrajectoryConverterBenchmark, time_optimal_planner_makes_shorter_trajectories) {
+    auto const maxVel = axConst<Af>(0.4f);
+    auto const maxAcc = axConst<Af>(1e-4f);
+
+    auto zigZag = vector<Ai>{{0, 0, 0}};
+    for (int i = 1; i <= 10; ++i) {
+        zigZag.push_back(Ai{i * 1000, (i % 2) * 2000, i * 100});
+    }
+    auto circle = vector<Ai>();
+    for (int k = 0; k <= 360; ++k) {
+        auto angle = 3.14159265f * k / 180;
+        circle.push_back(Ai{static_cast<int32_t>(5000 * cos(angle)),
+                            static_cast<int32_t>(5000 * sin(angle)), 0});
+    }
+    // Ticks are deterministic, so ratios of the time-optimal trajectory to the blended one are
+    // checked for every case a little above the measured ones.
+    struct Case {
+        char const *name;
+        vector<Ai> path;
+        double maxRatio;
+    };
+    auto cases = vector<Case>{{"zig-zag", zigZag, 1.0},
+                              {"circle", circle, 0.08},
+                              {"rounded rectangle", makeRoundedRectangle(4, 20), 0.15},
+                              {"growing zig-zag", makeZigZag(300), 0.98}};
+
+    auto blendsTotal = int64_t{};
+    auto timeOptimalTotal = int64_t{};
+    for (auto const &c : cases) {
+        auto blends =
+            trajectoryTicks<PathToTrajectoryConverter<AxTr::size>>(c.path, maxVel, maxAcc);
+        auto timeOptimal = trajectoryTicks<PathToTimeOptimalTrajectoryConverter<AxTr::size>>(
+            c.path, maxVel, maxAcc);
+        printf("%s, %u way-points: blends %lld ticks, time-optimal %lld ticks (%.1f%%)\n", c.name,
+               static_cast<unsigned>(c.path.size()), static_cast<long long>(blends),
+               static_cast<long long>(timeOptimal), 100.0 * timeOptimal / blends);
+        // Time-optimal planner leaves a tick for rounding next to every blend. If the same blends
+        // limit both planners, like on the zig-zag, where every segment is slowed down by its
+        // blends, the time-optimal trajectory is longer by up to a tick per segment.
+        auto const roundingTicks = static_cast<int64_t>(c.path.size() - 1);
+        EXPECT_THAT(timeOptimal, Le(static_cast<int64_t>(c.maxRatio * blends) + roundingTicks))
+            << c.name;
+        blendsTotal += blends;
+        timeOptimalTotal += timeOptimal;
+    }
+    EXPECT_THAT(timeOptimalTotal * 10, Lt(blendsTotal * 9));
+}
+
+TEST(TrajectoryToSegmentsConverterBenchmark, parallel_conversion_scales_across_cores) {
+    // Random walk of short moves like CAM output with planned durations.
+    auto const size = 1000000;
+    auto path = vector<Ai>();
+    path.reserve(size);
+    auto point = axZero<Ai>();
+    srand(1);
+    for (int k = 0; k < size; ++k) {
+        for (int j = 0; j < AxTr::size; ++j) {
+            point[j] += rand() % 201 - 100;
+        }
+        path.push_back(point);
+    }
+    auto segGen = TrajectoryToSegmentsConverter<AxTr::size>(path);
+    segGen.setDurations(vector<float>(size - 1, 1000.f));
+    segGen.setBlendDurations(vector<float>(size, 200.f));
+
+    auto start = Clock::now();
+    auto expected = TPackedSgs<AxTr::size>();
+    segGen.appendTo(expected);
+    auto sequentialMs = elapsedMs(start);
+    printf("%d way-points, %u cores: sequential %.0f ms\n", size,
+           thread::hardware_concurrency(), sequentialMs);
+    RecordProperty("sequential_ms", static_cast<int>(sequentialMs));
+
+    auto const expectedSegments = vector<Sg>(expected.begin(), expected.end());
+    auto fourThreadsMs = 0.0;
+    for (size_t threads : {1, 2, 4, 8}) {
+        auto segments = TPackedSgs<AxTr::size>();
+        start = Clock::now();
+        segGen.appendTo(segments, threads);
+        auto ms = elapsedMs(start);
+        printf("%u threads: %.0f ms (%.1fx)\n", static_cast<unsigned>(threads), ms,
+               sequentialMs / ms);
+        RecordProperty(to_string(threads) + "_threads_ms", static_cast<int>(ms));
+        if (threads == 4) {
+            fourThreadsMs = ms;
+        }
+
+        ASSERT_THAT(segments.bytes(), Eq(expected.bytes()));
+        ASSERT_THAT(vector<Sg>(segments.begin(), segments.end()), ContainerEq(expectedSegments));
+    }
+    // Threads can't speed up conversion on fewer cores. Otherwise the margin is coarse to
+    // tolerate noise of loaded machines.
+    if (thread::hardware_concurrency() < 4) {
+        GTEST_SKIP() << "Speed-up needs at least 4 cores";
+    }
+    EXPECT_THAT(fourThreadsMs * 3, Lt(sequentialMs * 2));
+}
@@ -0,0 +1,87 @@
+#include "stdafx.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include "../include/sc/FastIO.h"
+
+using namespace testing;
+
+namespace {
+
+using Pins = PinGroup<PC_1, PA_4, PA_0, PC_2, PC_10>;
+
+struct PinGroup_Should : Test {
+    PinGroup_Should() {
+        for (uint32_t port = 0; port < Pins::portsCount; ++port) {
+            auto gpio = GPIO_PORT(port);
+            gpio->MODER = 0;
+            gpio->IDR = 0;
+            gpio->ODR = 0;
+            gpio->BSRR.writes = 0;
+        }
+    }
+
+    static HostGpio &portA() { return *GPIO_PORT(0); }
+
+    static HostGpio &portC() { return *GPIO_PORT(2); }
+};
+}
+
+TEST_F(PinGroup_Should, build_port_masks) {
+    EXPECT_THAT(Pins::portMask(0), Eq((1u << 4) | (1u << 0)));
+    EXPECT_THAT(Pins::portMask(1), Eq(0u));
+    EXPECT_THAT(Pins::portMask(2), Eq((1u << 1) | (1u << 2) | (1u << 10)));
+}
+
+TEST_F(PinGroup_Should, map_bits_to_port_pins) {
+    EXPECT_THAT(Pins::portBits<0>(0x1F), Eq(Pins::portMask(0)));
+    EXPECT_THAT(Pins::portBits<2>(0x1F), Eq(Pins::portMask(2)));
+    EXPECT_THAT(Pins::portBits<0>(0x04), Eq(1u << 0));
+    EXPECT_THAT(Pins::portBits<2>(0x11), Eq((1u << 1) | (1u << 10)));
+    EXPECT_THAT(Pins::portBits<1>(0x1F), Eq(0u));
+}
+
+TEST_F(PinGroup_Should, set_pins_with_single_write_per_port) {
+    portC().ODR = 1u << 5;
+    Pins::set(0x0B);
+
+    EXPECT_THAT(portA().ODR, Eq(1u << 4));
+    EXPECT_THAT(portC().ODR, Eq((1u << 5) | (1u << 1) | (1u << 2)));
+    EXPECT_THAT(portA().BSRR.writes, Eq(1));
+    EXPECT_THAT(portC().BSRR.writes, Eq(1));
+    EXPECT_THAT(GPIO_PORT(1)->BSRR.writes, Eq(0));
+}
+
+TEST_F(PinGroup_Should, clear_only_group_pins) {
+    portA().ODR = 0xFFFF;
+    portC().ODR = 0xFFFF;
+    Pins::clear();
+
+    EXPECT_THAT(portA().ODR, Eq(0xFFFFu & ~Pins::portMask(0)));
+    EXPECT_THAT(portC().ODR, Eq(0xFFFFu & ~Pins::portMask(2)));
+    EXPECT_THAT(portA().BSRR.writes, Eq(1));
+    EXPECT_THAT(portC().BSRR.writes, Eq(1));
+}
+
+TEST_F(PinGroup_Should, clear_pins_with_set_bits) {
+    portA().ODR = 0xFFFF;
+    portC().ODR = 0xFFFF;
+    Pins::clear(0x11);
+
+    EXPECT_THAT(portA().ODR, Eq(0xFFFFu));
+    EXPECT_THAT(portC().ODR, Eq(0xFFFFu & ~((1u << 1) | (1u << 10))));
+    EXPECT_THAT(portA().BSRR.writes, Eq(1));
+    EXPECT_THAT(portC().BSRR.writes, Eq(1));
+}
+
+TEST_F(PinGroup_Should, write_set_and_reset_pins_at_once) {
+    portA().ODR = 1u << 4;
+    portC().ODR = (1u << 1) | (1u << 7);
+    Pins::write(0x14);
+
+    EXPECT_THAT(portA().ODR, Eq(1u << 0));
+    EXPECT_THAT(portC().ODR, Eq((1u << 7) | (1u << 10)));
+    EXPECT_THAT(portA().BSRR.writes, Eq(1));
+    EXPECT_THAT(portC().BSRR.writes, Eq(1));
+}
@@ -18,27 +18,55 @@ struct AxTr {
 
 using Af = TAf<AxTr::size>;
 using Ai = TAi<AxTr::size>;
+using Sg = TSg<AxTr::size>;
 using Sgs = TSgs<AxTr::size>;
 
 struct SegmentsExecutorMock {
+    using Sg = TSg<AxTr::size>;
+
+    static const int maxFeedOverride = 2;
+
     void setTicksPerSecond(int32_t) {}
 
+    void setMaxStepsPerTick(int32_t) {}
+
+    void setFeedOverride(float ratio) { feedOverride = ratio; }
+
+    void setFeedOverrideRamp(float ratioPerTick) { feedOverrideRamp = ratioPerTick; }
+
+    void hold() { held = true; }
+
+    void resume() { held = false; }
+
     void start() {}
 
     void stop() {}
 
-    bool isRunning() const { return false; }
+    bool isRunning() const { return running; }
 
     Ai const &position() const { return pos; }
 
     void setPosition(Ai const &p) { pos = p; }
 
-    void setTrajectory(Sgs const &s) { seg = s; }
+    bool push(Sg const &s) {
+        if (seg.size() >= capacity) {
+            return false;
+        }
+        seg.push_back(s);
+        return true;
+    }
+
+    size_t queuedSegments() const { return 0; }
 
-    void setTrajectory(Sgs &&s) { seg = s; }
+    uint32_t queuedTicks() const { return 0; }
 
     Ai pos = axZero<Ai>();
     Sgs seg;
+    bool running = false;
+    float feedOverride = 1;
+    float feedOverrideRamp = 0;
+    bool held = false;
+    size_t capacity = std::numeric_limits<size_t>::max();
 };
 
 struct PrinterMock : Printer {
@@ -263,14 +291,42 @@ TEST_F(GCodeInterpreter_Should, change_vel_between_moves) {
     interp.linearMove({10.f, 20.f}, inf());
     interp.start();
 
+    // Blend at the turn is limited by the lower acceleration instead of stopping both moves.
     Sgs expected{
-        {20, {0, 0}, {2, 0}},  {30, {6, 0}},  {20, {2, 0}, {0, 0}},
-
-        {20, {0, 0}, {-1, 0}}, {80, {-8, 0}}, {20, {-1, 0}, {0, 0}},
+        {20, {0, 0}, {2, 0}}, {10, {2, 0}}, {61, {6, 0}, {-3, 0}}, {60, {-6, 0}},
+        {20, {-1, 0}, {0, 0}},
     };
     EXPECT_THAT(se.seg, ContainerEq(expected));
 }
 
+TEST_F(GCodeInterpreter_Should, limit_path_speed_of_linear_moves_by_feed) {
+    interp.setTicksPerSecond(10);
+    interp.m100MaxVelocityOverride(Af{2.f, 2.f});
+    interp.m101MaxAccelerationOverride(Af{1.f, 1.f});
+    auto runTicks = [&](Ai const &end) {
+        interp.start();
+        se.setPosition(end);
+        auto ticks = 0;
+        for (auto const &sg : se.seg) {
+            ticks += sg.dt;
+        }
+        se.seg.clear();
+        return ticks;
+    };
+
+    // 50 units with 1 unit per second, blends take 0.8 second.
+    interp.g1LinearMove({30.f, 40.f}, 60.f);
+    EXPECT_THAT(runTicks({30, 40}), Eq(508));
+
+    // Rapid move runs with max velocities.
+    interp.g0RapidMove({0.f, 0.f});
+    EXPECT_THAT(runTicks({0, 0}), Eq(220));
+
+    // Feed is modal.
+    interp.g1LinearMove({30.f, 40.f});
+    EXPECT_THAT(runTicks({30, 40}), Eq(508));
+}
+
 TEST_F(GCodeInterpreter_Should, move_and_wait_0_sec) {
     interp.setTicksPerSecond(10);
     interp.m100MaxVelocityOverride(Af{2.f, 2.f});
@@ -290,6 +346,304 @@ TEST_F(GCodeInterpreter_Should, move_and_wait_0_sec) {
     EXPECT_THAT(se.seg, ContainerEq(expected));
 }
 
+TEST_F(GCodeInterpreter_Should, append_to_running_trajectory) {
+    interp.setTicksPerSecond(10);
+    interp.m100MaxVelocityOverride(Af{2.f, 2.f});
+    interp.m101MaxAccelerationOverride(Af{1.f, 1.f});
+    se.setPosition(Ai{10, 20});
+
+    interp.linearMove({20.f, 20.f}, inf());
+    interp.start();
+    se.running = true;
+    interp.linearMove({10.f, 20.f}, inf());
+    interp.start();
+
+    Sgs expected{
+        {20, {0, 0}, {2, 0}},  {30, {6, 0}},  {20, {2, 0}, {0, 0}},
+
+        {20, {0, 0}, {-2, 0}}, {30, {-6, 0}}, {20, {-2, 0}, {0, 0}},
+    };
+    EXPECT_THAT(se.seg, ContainerEq(expected));
+}
+
+TEST_F(GCodeInterpreter_Should, rerun_last_trajectory_without_planning) {
+    interp.setTicksPerSecond(10);
+    interp.m100MaxVelocityOverride(Af{2.f, 2.f});
+    interp.m101MaxAccelerationOverride(Af{1.f, 1.f});
+    se.setPosition(Ai{10, 20});
+    interp.linearMove({20.f, 20.f}, inf());
+    interp.start();
+    se.running = true;
+    interp.linearMove({10.f, 20.f}, inf());
+    interp.start();
+    se.running = false;
+    auto expected = se.seg;
+    se.seg.clear();
+
+    interp.m111RerunLastTrajectory();
+
+    EXPECT_THAT(se.seg, ContainerEq(expected));
+    EXPECT_THAT(interp.commands(), IsEmpty());
+}
+
+TEST_F(GCodeInterpreter_Should, plan_next_window_while_previous_one_is_executed) {
+    interp.setTicksPerSecond(10);
+    interp.m100MaxVelocityOverride(Af{2.f, 2.f});
+    interp.m101MaxAccelerationOverride(Af{1.f, 1.f});
+    auto planProgram = [&] {
+        for (int i = 1; i <= 12; ++i) {
+            interp.linearMove({i * 10.f, i % 2 * 10.f}, inf());
+        }
+        interp.start();
+        se.running = true;
+    };
+    interp.setPlanningWindow(3);
+    planProgram();
+    while (!interp.commands().empty()) {
+        interp.poll();
+    }
+    se.running = false;
+    interp.poll();
+    auto expected = se.seg;
+    se.seg.clear();
+    se.setPosition(Ai{0, 0});
+
+    // Executor queue is full, so segments of the first window stay pending.
+    se.capacity = 1;
+    planProgram();
+    auto const firstWindow = interp.pendingSegments();
+
+    interp.poll();
+    EXPECT_THAT(interp.pendingSegments(), Gt(firstWindow));
+    // Only one window is planned ahead.
+    auto const twoWindows = interp.pendingSegments();
+    interp.poll();
+    EXPECT_THAT(interp.pendingSegments(), Eq(twoWindows));
+
+    se.capacity = std::numeric_limits<size_t>::max();
+    while (!interp.commands().empty()) {
+        interp.poll();
+    }
+    se.running = false;
+    interp.poll();
+    EXPECT_THAT(interp.pendingSegments(), Eq(0u));
+    EXPECT_THAT(se.seg, ContainerEq(expected));
+}
+
+TEST_F(GCodeInterpreter_Should, acknowledge_lines_with_free_command_slots) {
+    GCodeInterpreter<SegmentsExecutorMock, AxTr, 4> interp(&se, &printer);
+    interp.setTicksPerSecond(10);
+    interp.setPlanningWindow(2);
+    for (int i = 1; i <= 3; ++i) {
+        interp.linearMove({i * 10.f, 0.f}, inf());
+        interp.printAcknowledgement();
+    }
+    interp.linearMove({40.f, 10.f}, inf());
+    interp.printAcknowledgement();
+    interp.linearMove({50.f, 10.f}, inf());
+    interp.printAcknowledgement();
+    // Commands are planned only after start.
+    EXPECT_THAT(printer.ss.str(), StrEq("Ok: 3\r\nOk: 2\r\nOk: 1\r\n"
+                                        "Error: commands buffer is full, start to plan it\r\n"
+                                        "Ok: 0\r\nError: commands buffer is full\r\nOk: 0\r\n"));
+    printer.ss.str("");
+
+    // Slots freed by planning are reported without a received line.
+    interp.start();
+    se.running = true;
+    interp.poll();
+    EXPECT_THAT(printer.ss.str(), StrEq("Ok: 4\r\n"));
+    interp.poll();
+    EXPECT_THAT(printer.ss.str(), StrEq("Ok: 4\r\n"));
+}
+
+TEST_F(GCodeInterpreter_Should, report_full_buffer_without_planning_window_until_start) {
+    GCodeInterpreter<SegmentsExecutorMock, AxTr, 4> interp(&se, &printer);
+    interp.setTicksPerSecond(10);
+    auto stream = [&](int from, int to) {
+        for (int i = from; i <= to; ++i) {
+            interp.linearMove({i * 10.f, 0.f}, inf());
+            interp.printAcknowledgement();
+            interp.poll();
+        }
+    };
+    stream(1, 5);
+    EXPECT_THAT(printer.ss.str(), StrEq("Ok: 3\r\nOk: 2\r\nOk: 1\r\n"
+                                        "Error: commands buffer is full, start to plan it\r\n"
+                                        "Ok: 0\r\nError: commands buffer is full\r\nOk: 0\r\n"));
+    printer.ss.str("");
+
+    // Host starts the buffered part and continues with the rest of the program.
+    interp.start();
+    interp.poll();
+    EXPECT_THAT(printer.ss.str(), StrEq("Ok: 4\r\n"));
+    EXPECT_THAT(se.seg, Not(IsEmpty()));
+    se.seg.clear();
+    se.pos = {40, 0};
+    printer.ss.str("");
+    stream(5, 6);
+    EXPECT_THAT(printer.ss.str(), StrEq("Ok: 3\r\nOk: 2\r\n"));
+    interp.start();
+    EXPECT_THAT(interp.commands().size(), Eq(0u));
+    EXPECT_THAT(se.seg, Not(IsEmpty()));
+}
+
+TEST_F(GCodeInterpreter_Should, reuse_limit_profiles_of_planned_moves) {
+    interp.setTicksPerSecond(10);
+    for (int i = 1; i <= 8; ++i) {
+        interp.m100MaxVelocityOverride(Af{i * 1.f, 1.f});
+        interp.linearMove({i * 10.f, 0.f}, inf());
+        interp.linearMove({i * 10.f, 10.f}, inf());
+    }
+    EXPECT_THAT(interp.commands().size(), Eq(16u));
+
+    // Buffered commands are planned to release their profiles, but they wait for start.
+    interp.m100MaxVelocityOverride(Af{9.f, 1.f});
+    interp.linearMove({90.f, 0.f}, inf());
+    EXPECT_THAT(printer.ss.str(), IsEmpty());
+    EXPECT_THAT(interp.commands().size(), Eq(1u));
+    EXPECT_THAT(se.seg, IsEmpty());
+
+    interp.start();
+    EXPECT_THAT(interp.commands(), IsEmpty());
+    EXPECT_THAT(interp.pendingSegments(), Eq(0u));
+    auto const deferred = se.seg;
+    se.seg.clear();
+
+    // Deferred segments are kept for rerun.
+    interp.m111RerunLastTrajectory();
+    EXPECT_THAT(se.seg, ContainerEq(deferred));
+}
+
+TEST_F(GCodeInterpreter_Should, return_to_start_before_rerun_from_other_position) {
+    interp.setTicksPerSecond(10);
+    interp.linearMove({20.f, 20.f}, inf());
+    interp.start();
+    auto const last = se.seg;
+    se.setPosition(Ai{30, 20});
+    se.seg.clear();
+
+    interp.m111RerunLastTrajectory();
+
+    // Way back with max velocity 0.1 and acceleration 0.01 steps per tick, then the last run.
+    Sgs expected{
+        {10, {0, 0}, {-1, 0}}, {290, {-28, -20}}, {10, {-1, 0}, {0, 0}},
+    };
+    expected.insert(expected.end(), last.begin(), last.end());
+    EXPECT_THAT(se.seg, ContainerEq(expected));
+    EXPECT_THAT(printer.ss.str(), IsEmpty());
+}
+
+TEST_F(GCodeInterpreter_Should, not_rerun_trajectory_longer_than_rerun_capacity) {
+    interp.setTicksPerSecond(10);
+    interp.setRerunCapacity(8);
+    interp.linearMove({20.f, 20.f}, inf());
+    interp.start();
+    se.seg.clear();
+
+    interp.m111RerunLastTrajectory();
+
+    EXPECT_THAT(se.seg, IsEmpty());
+    EXPECT_THAT(printer.ss.str(), StrEq("Error: no trajectory to rerun\r\n"));
+}
+
+TEST_F(GCodeInterpreter_Should, override_feed_of_running_trajectory) {
+    interp.setTicksPerSecond(1000);
+    interp.m100MaxVelocityOverride(Af{10, 20});
+    interp.m101MaxAccelerationOverride(Af{100, 100});
+
+    interp.feedrateOverride(50);
+    EXPECT_THAT(se.feedOverride, FloatEq(0.5f));
+    // Half of acceleration to velocity ratio of the second axis.
+    EXPECT_THAT(se.feedOverrideRamp, FloatEq(0.0025f));
+
+    interp.feedrateOverride(500);
+    EXPECT_THAT(se.feedOverride, FloatEq(1.f));
+    interp.setMaxFeedOverride(2.f);
+    interp.feedrateOverride(500);
+    EXPECT_THAT(se.feedOverride, FloatEq(2.f));
+    interp.feedrateOverride(1);
+    EXPECT_THAT(se.feedOverride, FloatEq(0.1f));
+}
+
+TEST_F(GCodeInterpreter_Should, plan_moves_within_limits_of_max_feed_override) {
+    interp.setTicksPerSecond(10);
+    interp.m100MaxVelocityOverride(Af{1.f, 1.f});
+    interp.m101MaxAccelerationOverride(Af{0.25f, 0.25f});
+    interp.linearMove({20.f, 10.f});
+    interp.linearMove({0.f, 0.f});
+    interp.start();
+    auto const reduced = se.seg;
+    se.seg.clear();
+
+    // With double feed override the planned trajectory runs with max velocities and accelerations.
+    interp.setMaxFeedOverride(2.f);
+    interp.m100MaxVelocityOverride(Af{2.f, 2.f});
+    interp.m101MaxAccelerationOverride(Af{1.f, 1.f});
+    interp.linearMove({20.f, 10.f});
+    interp.linearMove({0.f, 0.f});
+    interp.start();
+
+    EXPECT_THAT(se.seg, ContainerEq(reduced));
+}
+
+TEST_F(GCodeInterpreter_Should, hold_feed_and_resume_it_by_start) {
+    interp.setTicksPerSecond(1000);
+    interp.m100MaxVelocityOverride(Af{10, 20});
+    interp.m101MaxAccelerationOverride(Af{100, 100});
+    se.running = true;
+
+    interp.m109FeedHold();
+    EXPECT_TRUE(se.held);
+    EXPECT_THAT(se.feedOverrideRamp, FloatEq(0.0025f));
+
+    interp.start();
+    EXPECT_FALSE(se.held);
+}
+
+TEST_F(GCodeInterpreter_Should, home_fast_then_back_off_and_home_slowly) {
+    interp.setTicksPerSecond(100);
+    interp.m103HomingVelocityOverride({50.f, 20.f});
+    interp.m101MaxAccelerationOverride(Af{200.f, 300.f});
+    interp.m107HomingBackOffOverride(Af{10.f, 4.f});
+    interp.m108SlowHomingVelocityOverride(Af{5.f, 5.f});
+
+    interp.g28RunHomingCycle();
+    interp.start();
+
+    // Back-off includes stopping distances 6.25 and 0.67 steps, it accelerates to 0.5 steps per
+    // tick with the max acceleration 0.02 steps per tick^2 in 25 ticks and decelerates back.
+    Sgs expected{
+        Sg(Af{0.5f, 0.2f}, Af{0.02f, 0.03f}),
+        {25, {0, 0}, {6, 2}},
+        {10, {5, 1}},
+        {25, {6, 2}, {0, 0}},
+        Sg(Af{0.05f, 0.05f}),
+    };
+    EXPECT_THAT(se.seg, ContainerEq(expected));
+}
+
+TEST_F(GCodeInterpreter_Should, back_off_and_home_slowly_only_axes_with_slow_velocity) {
+    interp.setTicksPerSecond(100);
+    interp.m103HomingVelocityOverride({50.f, 20.f});
+    interp.m101MaxAccelerationOverride(Af{200.f, 300.f});
+    interp.m107HomingBackOffOverride(Af{10.f, 4.f});
+    interp.m108SlowHomingVelocityOverride(Af{5.f, 0.f});
+
+    interp.g28RunHomingCycle();
+    interp.start();
+
+    // Y stops at its switch at once and stays there.
+    Sgs expected{
+        Sg(Af{0.5f, 0.2f}, Af{0.02f, 0.f}),
+        {25, {0, 0}, {6, 0}},
+        {10, {5, 0}},
+        {25, {6, 0}, {0, 0}},
+        Sg(Af{0.05f, 0.f}),
+    };
+    EXPECT_THAT(se.seg, ContainerEq(expected));
+}
+
 TEST_F(GCodeInterpreter_Should, set_max_position) {
     interp.m106MaxPositionOverride(Af{2.f, 30.f});
 
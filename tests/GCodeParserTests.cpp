@@ -32,7 +32,11 @@ struct GCodeParserCallbacksMock {
     MOCK_METHOD1(m103HomingVelocityOverride, void(Af const &));
     MOCK_METHOD1(m105MinPositionOverride, void(Af const &));
     MOCK_METHOD1(m106MaxPositionOverride, void(Af const &));
+    MOCK_METHOD1(m107HomingBackOffOverride, void(Af const &));
+    MOCK_METHOD1(m108SlowHomingVelocityOverride, void(Af const &));
+    MOCK_METHOD0(m109FeedHold, void());
     MOCK_METHOD0(m110PrintAxesConfiguration, void());
+    MOCK_METHOD0(m111RerunLastTrajectory, void());
     MOCK_METHOD0(start, void());
     MOCK_METHOD0(stop, void());
     MOCK_CONST_METHOD0(isRunning, bool());
@@ -206,11 +210,37 @@ TEST_F(GCodeParser_Should, parse_m106MaxPositionOverride) {
     parse("M106\n");
 }
 
+TEST_F(GCodeParser_Should, parse_m107HomingBackOffOverride) {
+    EXPECT_CALL(cb_, m107HomingBackOffOverride(ElementsAre(3.14f, 0.123f, 0.1f)));
+    parse("M107 A3.14 X0.123 C.1\n");
+
+    EXPECT_CALL(cb_, m107HomingBackOffOverride(ElementsAre(inf(), inf(), inf())));
+    parse("M107\n");
+}
+
+TEST_F(GCodeParser_Should, parse_m108SlowHomingVelocityOverride) {
+    EXPECT_CALL(cb_, m108SlowHomingVelocityOverride(ElementsAre(3.14f, 0.123f, 0.1f)));
+    parse("M108 A3.14 X0.123 C.1\n");
+
+    EXPECT_CALL(cb_, m108SlowHomingVelocityOverride(ElementsAre(0.123f, inf(), inf())));
+    parse("M108 A0.123\n");
+}
+
+TEST_F(GCodeParser_Should, parse_m109FeedHold) {
+    EXPECT_CALL(cb_, m109FeedHold());
+    parse("M109\n");
+}
+
 TEST_F(GCodeParser_Should, parse_m110PrintAxesConfiguration) {
     EXPECT_CALL(cb_, m110PrintAxesConfiguration());
     parse("M110\n");
 }
 
+TEST_F(GCodeParser_Should, parse_m111RerunLastTrajectory) {
+    EXPECT_CALL(cb_, m111RerunLastTrajectory());
+    parse("M111\n");
+}
+
 TEST_F(GCodeParser_Should, not_parse_without_line_break) {
     EXPECT_THROW(parse("G1"), std::logic_error);
 }
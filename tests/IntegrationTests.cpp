@@ -77,6 +77,7 @@ struct Integration_Should : Test {
     void run() {
         interpreter.start();
         while (executor.isRunning()) {
+            interpreter.poll();
             executor.tick();
         }
     }
@@ -153,4 +154,288 @@ TEST_F(Integration_Should, move_to_zero_without_spaces) {
 
     EXPECT_THAT(mm.current, Eq(Ai{0, 0}));
 }
-}
\ No newline at end of file
+
+TEST_F(Integration_Should, rerun_production_cycle) {
+    parser.parseLine("A10B5\n");
+    parser.parseLine("G4 P0.1\n");
+    parser.parseLine("A0B0\n");
+    run();
+    auto cycle = mm.data;
+    mm.data.clear();
+
+    parser.parseLine("M111\n");
+    while (executor.isRunning()) {
+        interpreter.poll();
+        executor.tick();
+    }
+
+    EXPECT_THAT(mm.data, ContainerEq(cycle));
+    EXPECT_THAT(mm.current, Eq(Ai{0, 0}));
+}
+
+TEST_F(Integration_Should, plan_long_program_in_windows_without_stops) {
+    auto program = vector<string>();
+    for (int i = 1; i <= 60; ++i) {
+        stringstream ss;
+        ss << "A" << i * 20 << "B" << i * i / 10 << endl;
+        program.push_back(ss.str());
+    }
+    for (auto const &line : program) {
+        parser.parseLine(line.c_str());
+    }
+    run();
+    auto wholeProgramTicks = mm.data.size();
+    auto end = mm.current;
+    executor.setPosition(axZero<Ai>());
+    mm.setPosition(axZero<Ai>());
+    mm.data.clear();
+
+    interpreter.setPlanningWindow(4);
+    for (auto const &line : program) {
+        parser.parseLine(line.c_str());
+    }
+    interpreter.start();
+
+    // Only the first window is planned.
+    EXPECT_THAT(interpreter.commands().size(), Gt(program.size() / 2));
+    while (executor.isRunning()) {
+        interpreter.poll();
+        executor.tick();
+    }
+    EXPECT_THAT(mm.current, Eq(end));
+    // Stop at the end of every window would take 10% longer.
+    EXPECT_THAT(mm.data.size(), Lt(wholeProgramTicks * 101 / 100));
+}
+
+TEST_F(Integration_Should, plan_time_optimal_trajectory_in_windows) {
+    auto program = vector<string>();
+    for (int i = 1; i <= 60; ++i) {
+        stringstream ss;
+        ss << "A" << static_cast<int>(100 * sin(i / 10.)) << "B" << i * 3 << endl;
+        program.push_back(ss.str());
+    }
+    // Fast enough for blends to slow down short moves.
+    interpreter.m100MaxVelocityOverride(axConst<Af>(300.f));
+    auto runProgram = [&](TrajectoryPlanner planner, size_t window) {
+        executor.setPosition(axZero<Ai>());
+        mm.setPosition(axZero<Ai>());
+        mm.data.clear();
+        interpreter.setTrajectoryPlanner(planner);
+        interpreter.setPlanningWindow(window);
+        for (auto const &line : program) {
+            parser.parseLine(line.c_str());
+        }
+        run();
+        return mm.data.size();
+    };
+
+    auto blendsTicks = runProgram(TrajectoryPlanner::Blends, 0);
+    auto end = mm.current;
+    auto timeOptimalTicks = runProgram(TrajectoryPlanner::TimeOptimal, 0);
+    EXPECT_THAT(mm.current, Eq(end));
+    EXPECT_THAT(timeOptimalTicks, Lt(blendsTicks * 9 / 10));
+
+    auto windowsTicks = runProgram(TrajectoryPlanner::TimeOptimal, 8);
+    EXPECT_THAT(mm.current, Eq(end));
+    EXPECT_THAT(windowsTicks, Lt(blendsTicks * 9 / 10));
+}
+
+TEST_F(Integration_Should, blend_moves_with_different_limits_without_stop) {
+    auto runProgram = [&](vector<string> const &program) {
+        executor.setPosition(axZero<Ai>());
+        mm.setPosition(axZero<Ai>());
+        mm.data.clear();
+        interpreter.m100MaxVelocityOverride(axConst<Af>(30.f));
+        for (auto const &line : program) {
+            parser.parseLine(line.c_str());
+        }
+        run();
+        return mm.data.size();
+    };
+
+    auto blendedTicks = runProgram({"A50B10\n", "M100 A10 B10\n", "A100B20\n"});
+    EXPECT_THAT(mm.current, Eq(Ai{100, 0, 0, 0, 20}));
+    // Dwell for no time stops the motion.
+    auto stoppedTicks = runProgram({"A50B10\n", "G4 P0\n", "M100 A10 B10\n", "A100B20\n"});
+    EXPECT_THAT(mm.current, Eq(Ai{100, 0, 0, 0, 20}));
+    EXPECT_THAT(blendedTicks, Lt(stoppedTicks));
+}
+
+TEST_F(Integration_Should, move_with_jerk_limited_blends) {
+    auto program = vector<string>{"A30B10\n", "A60B-10\n", "A20B-20\n", "A0B0\n"};
+    for (auto const &line : program) {
+        parser.parseLine(line.c_str());
+    }
+    run();
+    auto parabolicTicks = mm.data.size();
+    mm.data.clear();
+
+    interpreter.setJerkLimitedBlends(true);
+    interpreter.setPlanningWindow(2);
+    for (auto const &line : program) {
+        parser.parseLine(line.c_str());
+    }
+    run();
+
+    EXPECT_THAT(mm.current, Eq(Ai{0, 0}));
+    // Blends are planned with half of max acceleration.
+    EXPECT_THAT(mm.data.size(), Gt(parabolicTicks));
+}
+
+TEST_F(Integration_Should, move_faster_with_more_steps_per_tick) {
+    interpreter.setTicksPerSecond(100);
+    interpreter.m101MaxAccelerationOverride(axConst<Af>(1000.f));
+    interpreter.m100MaxVelocityOverride(axConst<Af>(50.f));
+    parser.parseLine("A300B100\n");
+    parser.parseLine("A0B0\n");
+    run();
+    auto oneStepTicks = mm.data.size();
+    mm.data.clear();
+
+    interpreter.setMaxStepsPerTick(4);
+    interpreter.m100MaxVelocityOverride(axConst<Af>(300.f));
+    parser.parseLine("A300B100\n");
+    parser.parseLine("A0B0\n");
+    run();
+
+    EXPECT_THAT(mm.current, Eq(Ai{0, 0}));
+    EXPECT_THAT(mm.data.size() * 3, Lt(oneStepTicks));
+    for (size_t i = 1; i < mm.data.size(); ++i) {
+        EXPECT_THAT(abs(mm.data[i][0] - mm.data[i - 1][0]), Le(4));
+    }
+}
+
+TEST_F(Integration_Should, stop_at_window_end_and_continue_with_commands_received_later) {
+    interpreter.setPlanningWindow(4);
+    parser.parseLine("A10\n");
+    parser.parseLine("A20B5\n");
+    interpreter.start();
+    while (executor.isRunning()) {
+        interpreter.poll();
+        executor.tick();
+    }
+    EXPECT_THAT(mm.current, Eq(Ai{20, 0, 0, 0, 5}));
+
+    parser.parseLine("A0B0\n");
+    interpreter.poll();
+    while (executor.isRunning()) {
+        interpreter.poll();
+        executor.tick();
+    }
+    EXPECT_THAT(mm.current, Eq(Ai{0, 0, 0, 0, 0}));
+}
+
+TEST_F(Integration_Should, decelerate_at_program_end_with_sparse_polls) {
+    interpreter.setPlanningWindow(4);
+    interpreter.setStopMargin(1.f);
+    for (int i = 1; i <= 12; ++i) {
+        stringstream ss;
+        ss << "A" << i * 20 << "B" << i % 2 * 5 << endl;
+        parser.parseLine(ss.str().c_str());
+    }
+    interpreter.start();
+    // Poll is called rarely, but within the stop margin.
+    for (int t = 0; executor.isRunning(); ++t) {
+        if (t % 7500 == 0) {
+            interpreter.poll();
+        }
+        executor.tick();
+    }
+
+    EXPECT_THAT(mm.current, Eq(Ai{240, 0, 0, 0, 0}));
+    // Without stop blend the queue would be drained at max velocity, when steps of A are 333
+    // ticks apart, and the motion would stop before the end.
+    auto lastStep = mm.data.size();
+    while (lastStep > 1 && mm.data[lastStep - 2][0] == 240) {
+        --lastStep;
+    }
+    auto previousStep = lastStep - 1;
+    while (previousStep > 1 && mm.data[previousStep - 2][0] == 239) {
+        --previousStep;
+    }
+    EXPECT_THAT(lastStep - previousStep, Gt(2 * 333u));
+}
+
+TEST_F(Integration_Should, run_every_move_with_more_limit_profiles_than_buffered) {
+    for (auto window : {0, 4}) {
+        executor.setPosition(axZero<Ai>());
+        mm.setPosition(axZero<Ai>());
+        interpreter.setPlanningWindow(window);
+        parser.parseLine("G91\n");
+        for (int i = 1; i <= 10; ++i) {
+            stringstream ss;
+            ss << "M100 A" << 10 + i << endl;
+            parser.parseLine(ss.str().c_str());
+            parser.parseLine("A10\n");
+        }
+
+        run();
+
+        EXPECT_THAT(mm.current, Eq(Ai{100, 0}));
+    }
+}
+
+TEST_F(Integration_Should, hold_during_blend_within_one_and_half_max_acceleration) {
+    // 3 steps per tick and 0.003 steps per tick^2, the stop blend starts at tick 2000. The hold
+    // ramp would stop the motion at the end of the blend if it started with the blend.
+    interpreter.setTicksPerSecond(1000);
+    interpreter.setMaxStepsPerTick(4);
+    interpreter.m100MaxVelocityOverride(axConst<Af>(3000.f));
+    interpreter.m101MaxAccelerationOverride(axConst<Af>(3000.f));
+    parser.parseLine("A6000\n");
+    interpreter.start();
+    // Position after every interrupt, time is scaled by the hold.
+    auto positions = vector<int32_t>();
+    while (executor.isRunning() && !executor.isHeld()) {
+        if (executor.currentTick() == 2100) {
+            interpreter.m109FeedHold();
+        }
+        interpreter.poll();
+        executor.tickPeriodic();
+        positions.push_back(mm.current[0]);
+    }
+    EXPECT_THAT(mm.current, Eq(Ai{6000, 0}));
+
+    // Change of the step rate per tick, averaged over w ticks, is within 1.5 * 0.003 steps per
+    // tick^2 and rounding of positions.
+    int32_t const w = 100;
+    auto maxChange = 0;
+    for (size_t k = 0; k + 2 * w < positions.size(); ++k) {
+        auto const change = positions[k + 2 * w] - 2 * positions[k + w] + positions[k];
+        maxChange = max(maxChange, abs(change));
+    }
+    EXPECT_THAT(maxChange, Le(45 + 2));
+    // The rest of the blend is slowed down by the hold.
+    EXPECT_THAT(positions.size(), Gt(3000u));
+}
+
+TEST_F(Integration_Should, drop_feed_hold_received_while_idle_on_start) {
+    parser.parseLine("M109\n");
+    parser.parseLine("A10\n");
+    interpreter.start();
+    for (int k = 0; k < 100000 && executor.isRunning(); ++k) {
+        interpreter.poll();
+        executor.tickPeriodic();
+    }
+
+    EXPECT_FALSE(executor.isRunning());
+    EXPECT_THAT(mm.current, Eq(Ai{10, 0}));
+}
+
+TEST_F(Integration_Should, stop_between_windows_if_acceleration_drops) {
+    interpreter.setPlanningWindow(2);
+    parser.parseLine("A100\n");
+    parser.parseLine("A200\n");
+    // The next window can't slow down within the stop blend of the previous one.
+    parser.parseLine("M100 A10\n");
+    parser.parseLine("M101 A5\n");
+    parser.parseLine("A300\n");
+    parser.parseLine("A400\n");
+    run();
+
+    EXPECT_THAT(mm.current, Eq(Ai{400, 0}));
+    for (size_t i = 1; i < mm.data.size(); ++i) {
+        ASSERT_THAT(mm.data[i][0], Ge(mm.data[i - 1][0])) << "at tick " << i;
+    }
+}
+}
@@ -0,0 +1,116 @@
+#include "stdafx.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include "../include/sc/PackedSegments.h"
+
+using namespace StepperControl;
+using namespace testing;
+using namespace std;
+
+namespace {
+
+const size_t AxesSize = 3;
+
+using Af = Axes<float, AxesSize>;
+using Ai = Axes<int32_t, AxesSize>;
+
+struct PackedSegments_Should : Test {
+    using Sg = Segment<AxesSize>;
+    using Packing = SegmentPacking<AxesSize>;
+
+    vector<Sg> segments{
+        Sg(Af{0.5f, 0.f, -0.25f}),
+        Sg(Af{0.5f, 0.f, -0.25f}, Af{1e-3f, 0.f, 0.f}),
+        Sg(0),
+        Sg(100),
+        Sg(10, {5, 0, -3}),
+        Sg(10, {0, 0, 0}),
+        Sg(16, {0, 4, -2}, {-4, 2, 0}),
+        Sg(16, {0, 0, 0}, {0, 0, 0}),
+        Sg(Sg::maxTwiceDt, {1000, 0, 0}, {-1000, 0, 0}),
+        Sg(30, {5, 0, -3}, {5, 0, 0}, {-2, 0, 4}),
+        Sg(12, {0, 0, 0}, {0, 0, 0}, {0, 0, 0}),
+        Sg(Sg::maxThriceDt, {-2000, 0, 0}, {2000, 0, 0}, {0, 1, 0}),
+        withPeriod(Sg(10, {5, 0, -3}), 16),
+        withPeriod(Sg(30, {5, 0, -3}, {5, 0, 0}, {-2, 0, 4}), 1 << 20),
+    };
+
+    static Sg withPeriod(Sg sg, int32_t period) {
+        sg.period = period;
+        return sg;
+    }
+
+    size_t packedSize(Sg const &sg) {
+        int32_t record[Packing::maxPackedSize];
+        return Packing::pack(sg, record);
+    }
+};
+
+TEST_F(PackedSegments_Should, restore_every_kind_of_segment) {
+    PackedSegments<AxesSize> packed;
+    for (auto const &sg : segments) {
+        packed.push_back(sg);
+    }
+
+    EXPECT_THAT(packed.size(), Eq(segments.size()));
+    EXPECT_THAT(vector<Sg>(packed.begin(), packed.end()), ContainerEq(segments));
+}
+
+TEST_F(PackedSegments_Should, store_only_active_axes) {
+    EXPECT_THAT(packedSize(Sg(Af{0.5f, 0.f, -0.25f})), Eq(6u));
+    EXPECT_THAT(packedSize(Sg(100)), Eq(2u));
+    EXPECT_THAT(packedSize(Sg(10, {5, 0, 0})), Eq(3u));
+    EXPECT_THAT(packedSize(Sg(16, {0, 4, -2}, {-4, 2, 0})), Eq(8u));
+    EXPECT_THAT(packedSize(Sg(30, {5, 0, -3}, {5, 0, 0}, {-2, 0, 4})), Eq(8u));
+    EXPECT_THAT(packedSize(withPeriod(Sg(10, {5, 0, 0}), 4)), Eq(4u));
+}
+
+TEST_F(PackedSegments_Should, pop_segments_in_push_order) {
+    PackedSegments<AxesSize> packed{segments[3], segments[2], segments[5]};
+
+    EXPECT_THAT(packed.front(), Eq(segments[3]));
+    packed.pop_front();
+    EXPECT_THAT(packed.front(), Eq(segments[2]));
+    packed.pop_front();
+    EXPECT_THAT(packed.front(), Eq(segments[5]));
+    packed.pop_front();
+
+    EXPECT_THAT(packed.empty(), Eq(true));
+    EXPECT_THAT(packed.bytes(), Eq(0u));
+}
+
+TEST(PackedSegments32_Should, restore_segments_with_32_bit_accumulators) {
+    using Sg32 = Segment<AxesSize, int32_t>;
+    vector<Sg32> segments{
+        Sg32(Af{0.5f, 0.f, -0.25f}),
+        Sg32(Af{0.5f, 0.f, -0.25f}, Af{1e-3f, 0.f, 1e-4f}),
+        Sg32(100),
+        Sg32(Sg32::maxDt, {5, 0, -3}),
+        Sg32(Sg32::maxTwiceDt, {1000, 0, 0}, {-1000, 0, 0}),
+        Sg32(Sg32::maxThriceDt, {50, 0, -80}, {0, 0, 0}, {-50, 0, 80}),
+    };
+    PackedSegments<AxesSize, int32_t> packed;
+    for (auto const &sg : segments) {
+        packed.push_back(sg);
+    }
+
+    EXPECT_THAT(vector<Sg32>(packed.begin(), packed.end()), ContainerEq(segments));
+}
+
+TEST(PackedSegments9_Should, take_several_times_less_memory_than_segments) {
+    using Sg9 = Segment<9>;
+    PackedSegments<9> packed;
+    for (int k = 0; k < 100; ++k) {
+        auto dx = TAi<9>{300, -200, 100, 0, 0, 0, 0, 0, 0};
+        packed.emplace_back(2000, k % 2 ? dx : -dx);
+        packed.emplace_back(2000, dx, -dx);
+    }
+
+    auto bytesPerSegment = static_cast<double>(packed.bytes()) / packed.size();
+    cout << "Segment: " << sizeof(Sg9) << " bytes, packed: " << bytesPerSegment << " bytes"
+         << endl;
+    EXPECT_THAT(sizeof(Sg9) / bytesPerSegment, Ge(5.));
+}
+}
@@ -0,0 +1,98 @@
+#include "stdafx.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include "../include/sc/RingBuffer.h"
+
+using namespace StepperControl;
+using namespace testing;
+using namespace std;
+
+namespace {
+
+struct RingBuffer_Should : Test {
+    RingBuffer<int, 4> rb;
+
+    vector<int> popAll() {
+        vector<int> items;
+        while (!rb.empty()) {
+            items.push_back(rb.front());
+            rb.pop();
+        }
+        return items;
+    }
+};
+
+TEST_F(RingBuffer_Should, be_empty_after_construction) {
+    EXPECT_THAT(rb.empty(), Eq(true));
+    EXPECT_THAT(rb.size(), Eq(0u));
+    EXPECT_THAT(rb.freeSpace(), Eq(4u));
+}
+
+TEST_F(RingBuffer_Should, pop_in_push_order) {
+    rb.push(1);
+    rb.push(2);
+    rb.push(3);
+
+    EXPECT_THAT(popAll(), ElementsAre(1, 2, 3));
+}
+
+TEST_F(RingBuffer_Should, reject_push_when_full) {
+    EXPECT_THAT(rb.push(1), Eq(true));
+    EXPECT_THAT(rb.push(2), Eq(true));
+    EXPECT_THAT(rb.push(3), Eq(true));
+    EXPECT_THAT(rb.push(4), Eq(true));
+    EXPECT_THAT(rb.full(), Eq(true));
+
+    EXPECT_THAT(rb.push(5), Eq(false));
+    EXPECT_THAT(popAll(), ElementsAre(1, 2, 3, 4));
+}
+
+TEST_F(RingBuffer_Should, wrap_around) {
+    rb.push(0);
+    rb.push(1);
+    rb.push(2);
+    vector<int> items;
+    for (int i = 3; i < 13; ++i) {
+        rb.push(i);
+        items.push_back(rb.front());
+        rb.pop();
+    }
+
+    EXPECT_THAT(items, ElementsAre(0, 1, 2, 3, 4, 5, 6, 7, 8, 9));
+    EXPECT_THAT(popAll(), ElementsAre(10, 11, 12));
+}
+
+TEST_F(RingBuffer_Should, clear) {
+    rb.push(1);
+    rb.push(2);
+
+    rb.clear();
+
+    EXPECT_THAT(rb.empty(), Eq(true));
+    rb.push(3);
+    EXPECT_THAT(popAll(), ElementsAre(3));
+}
+
+TEST_F(RingBuffer_Should, push_all_items_or_none) {
+    int items[] = {1, 2, 3};
+    rb.push(0);
+
+    EXPECT_THAT(rb.push(items, 3), Eq(true));
+    EXPECT_THAT(rb.push(items, 1), Eq(false));
+    EXPECT_THAT(popAll(), ElementsAre(0, 1, 2, 3));
+}
+
+TEST_F(RingBuffer_Should, access_and_pop_several_items_after_wrap_around) {
+    int items[] = {1, 2, 3};
+    rb.push(items, 3);
+    rb.pop(2);
+    rb.push(items, 3);
+
+    EXPECT_THAT(rb[0], Eq(3));
+    EXPECT_THAT(rb[3], Eq(3));
+    rb.pop(3);
+    EXPECT_THAT(popAll(), ElementsAre(3));
+}
+}
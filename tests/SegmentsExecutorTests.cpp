@@ -49,12 +49,80 @@ struct MotorMock {
     vector<Ai> data;
 };
 
+template <size_t AxesSize>
+struct GroupedMotorMock : MotorMock<AxesSize> {
+    void writeSteps(uint32_t bits) {
+        ++stepWrites;
+        for (size_t i = 0; i < AxesSize; ++i) {
+            this->pos[i] += (bits >> i) & 1u ? this->dir[i] : 0;
+        }
+    }
+
+    void clearSteps(uint32_t) { ++clearWrites; }
+
+    void writeDirections(uint32_t bits) {
+        ++dirWrites;
+        for (size_t i = 0; i < AxesSize; ++i) {
+            this->dir[i] = (bits >> i) & 1u ? -1 : 1;
+        }
+    }
+
+    int stepWrites = 0;
+    int clearWrites = 0;
+    int dirWrites = 0;
+};
+
+// Records pin levels and checks timing of step pulses in interrupts.
+template <size_t AxesSize>
+struct PulseMotorMock : MotorMock<AxesSize> {
+    template <int i>
+    void writeDirection(StepperNumber<i> n, bool reverse) {
+        if (this->dir[i] != (reverse ? -1 : 1)) {
+            EXPECT_FALSE(level[i]) << "direction changed during pulse at " << interrupt;
+            dirChanged[i] = interrupt;
+        }
+        MotorMock<AxesSize>::writeDirection(n, reverse);
+    }
+
+    template <int i>
+    void writeStep(StepperNumber<i>, bool edge) {
+        if (edge && !level[i]) {
+            setupTicks.push_back(interrupt - dirChanged[i]);
+            rised[i] = interrupt;
+            this->pos[i] += this->dir[i];
+        } else if (!edge && level[i]) {
+            pulseTicks.push_back(interrupt - rised[i]);
+        }
+        level[i] = edge;
+    }
+
+    void begin() { ++interrupt; }
+
+    int interrupt = 0;
+    bool level[AxesSize]{};
+    int rised[AxesSize]{};
+    int dirChanged[AxesSize]{};
+    vector<int> pulseTicks;
+    vector<int> setupTicks;
+};
+
 struct TickerMock {
     static void attach_us(...) {}
 
     static void detach() {}
 };
 
+struct IntervalTickerMock {
+    template <typename T>
+    void attach_us(T *, void (T::*)(), int us) {
+        intervalUs = us;
+    }
+
+    void detach() { intervalUs = 0; }
+
+    int intervalUs = 0;
+};
+
 template <size_t AxesSize>
 struct SegmentsExecutorTestBase : Test {
     using Ai = Axes<int32_t, AxesSize>;
@@ -229,6 +297,69 @@ TEST_F(SegmentsExecutor1_Should, approximate_parabolic_curve_with_zero_curvature
     EXPECT_THAT(motor.data, ContainerEq(expected));
 }
 
+TEST_F(SegmentsExecutor1_Should, execute_one_cubic_segment) {
+    segments.push_back(Sg(12, {2}, {2}, {0}));
+    process();
+
+    Steps expected{
+        // {0},  // 0
+        {0}, {1}, {1}, {2}, {2}, {3}, {3}, {3}, {4}, {4}, // 10
+        {4}, {4},                                         // 12
+    };
+    EXPECT_THAT(motor.data, ContainerEq(expected));
+}
+
+TEST_F(SegmentsExecutor1_Should, execute_cubic_segment_with_direction_changes) {
+    // Position is x(t) = 3 * 120^2 * 10 * t - 3 * 120 * 30 * t^2 + 60 * t^3 scaled by 120^-3.
+    segments.push_back(Sg(120, {10}, {-20}, {10}));
+    process();
+
+    ASSERT_THAT(motor.data.size(), Eq(120u));
+    int64_t const den = 120 * 120 * 120;
+    auto minPosition = 0;
+    for (int64_t t = 1; t <= 120; ++t) {
+        auto const x = 432000 * t - 10800 * t * t + 60 * t * t * t;
+        // Position is rounded.
+        EXPECT_THAT(abs(2 * (motor.data[t - 1][0] * den - x)), Le(den)) << "at tick " << t;
+        minPosition = min(minPosition, motor.data[t - 1][0]);
+    }
+    EXPECT_THAT(minPosition, Lt(0));
+    EXPECT_THAT(executor.position(), Eq(Ai{0}));
+}
+
+TEST_F(SegmentsExecutor1_Should, execute_cubic_segment_with_max_duration_and_slopes) {
+    // Acceleration reaches 6 * maxDoubledSlope * T^2, which should fit into int32_t.
+    executor.setMaxStepsPerTick(Sg::maxStepsPerTick);
+    int64_t const T = Sg::maxThriceDt;
+    auto const dx = static_cast<int32_t>(Sg::maxDoubledSlope * T / 6);
+    segments.push_back(Sg(static_cast<int32_t>(T), {-dx}, {dx}, {-dx}));
+    process();
+
+    ASSERT_THAT(motor.data.size(), Eq(static_cast<size_t>(T)));
+    auto const den = T * T * T;
+    auto const c1 = 3 * T * T * -dx;
+    auto const c2 = 3 * T * 2 * dx;
+    auto const c3 = -4 * static_cast<int64_t>(dx);
+    for (int64_t t = 1; t <= T; ++t) {
+        auto const x = c1 * t + c2 * t * t + c3 * t * t * t;
+        // Position is rounded.
+        EXPECT_THAT(abs(2 * (motor.data[t - 1][0] * den - x)), Le(den)) << "at tick " << t;
+    }
+    EXPECT_THAT(executor.position(), Eq(Ai{-dx}));
+}
+
+TEST_F(SegmentsExecutor1_Should, make_several_steps_per_tick) {
+    executor.setMaxStepsPerTick(3);
+    segments.push_back(Sg(4, {10}));
+    process();
+
+    Steps expected{
+        // {0},  // 0
+        {3}, {5}, {8}, {10}, // 4
+    };
+    EXPECT_THAT(motor.data, ContainerEq(expected));
+}
+
 TEST_F(SegmentsExecutor1_Should, execute_two_linear_segments) {
     segments.push_back(Sg(6, {3}));
     segments.push_back(Sg(6, {-3}));
@@ -286,6 +417,59 @@ TEST_F(SegmentsExecutor1_Should, do_homing_and_other_commands) {
     EXPECT_THAT(motor.data, ContainerEq(expected));
 }
 
+TEST_F(SegmentsExecutor1_Should, execute_segments_pushed_while_running) {
+    executor.push(Sg(6, {3}));
+    executor.start();
+
+    int ticks = 0;
+    while (executor.isRunning()) {
+        executor.tick();
+        if (++ticks == 3) {
+            EXPECT_THAT(executor.push(Sg(6, {-3})), Eq(true));
+        }
+    }
+
+    Steps expected{
+        {1}, {1}, {2}, {2}, {3}, {3}, // 6
+        {2}, {2}, {1}, {1}, {0}, {0}, // 12
+    };
+    EXPECT_THAT(motor.data, ContainerEq(expected));
+}
+
+TEST_F(SegmentsExecutor1_Should, drop_queued_segments_on_stop) {
+    executor.push(Sg(6, {3}));
+    executor.push(Sg(6, {-3}));
+    executor.start();
+    executor.tick();
+
+    executor.stop();
+
+    EXPECT_THAT(executor.isRunning(), Eq(false));
+    EXPECT_THAT(executor.queuedSegments(), Eq(0u));
+}
+
+TEST_F(SegmentsExecutor1_Should, stream_trajectory_longer_than_queue) {
+    // Record of one axis linear segment takes three words, so two segments fit.
+    using SmallQueueExecutor = SegmentsExecutor<Mm, TickerMock, AxTr<1>, 8>;
+    SmallQueueExecutor exec{&motor, &ticker};
+    vector<Sg> trajectory(10, Sg(2, {1}));
+    auto next = trajectory.begin();
+
+    while (next != trajectory.end() && exec.push(*next)) {
+        ++next;
+    }
+    exec.start();
+    while (exec.isRunning()) {
+        while (next != trajectory.end() && exec.push(*next)) {
+            ++next;
+        }
+        exec.tick();
+    }
+
+    EXPECT_THAT(motor.data, SizeIs(20));
+    EXPECT_THAT(motor.pos, Eq(Ai{10}));
+}
+
 TEST_F(SegmentsExecutor1_Should, callback_on_stopped) {
     bool stopped = false;
     auto func = [](void *obj) { *static_cast<bool *>(obj) = true; };
@@ -331,6 +515,408 @@ TEST_F(SegmentsExecutor2_Should, handle_zero_ticks_wait) {
     EXPECT_THAT(motor.data, SizeIs(0));
 }
 
+TEST_F(SegmentsExecutor2_Should, make_same_steps_in_next_step_tick_mode) {
+    segments = {
+        Sg(40, {0, 0}, {10, -3}),
+        Sg(30, {13, -4}),
+        Sg(60, {10, -3}, {-10, 7}),
+        Sg(25),
+        Sg(50, {-12, 8}, {0, 0}),
+        Sg(90, {5, 0}, {5, -7}, {-12, 10}),
+        Sg(90, {-12, 15}, {0, 0}, {0, 0}),
+    };
+    process();
+
+    IntervalTickerMock intervalTicker;
+    Mm eventMotor;
+    SegmentsExecutor<Mm, IntervalTickerMock, AxTr<2>> eventExecutor{&eventMotor, &intervalTicker};
+    eventExecutor.setTicksPerSecond(1000000);
+    eventExecutor.setTickMode(TickMode::NextStep);
+    eventExecutor.setTrajectory(segments);
+    eventExecutor.start();
+
+    // Tick index of every timer interrupt.
+    vector<size_t> ticks;
+    size_t tick = 0;
+    while (eventExecutor.isRunning()) {
+        tick += intervalTicker.intervalUs;
+        ticks.push_back(tick);
+        eventExecutor.tickNextStep();
+    }
+
+    ASSERT_THAT(eventMotor.data.size(), Lt(motor.data.size()));
+    // The last interrupt only stops execution.
+    ASSERT_THAT(eventMotor.data.size(), Eq(ticks.size() - 1));
+    for (size_t i = 0; i < eventMotor.data.size(); ++i) {
+        EXPECT_THAT(eventMotor.data[i], Eq(motor.data[ticks[i] - 1])) << "at tick " << ticks[i];
+    }
+    // Every step should be made in its own interrupt.
+    for (size_t i = 1; i < motor.data.size(); ++i) {
+        if (motor.data[i] != motor.data[i - 1]) {
+            EXPECT_THAT(ticks, Contains(i + 1));
+        }
+    }
+    EXPECT_THAT(eventMotor.pos, Eq(motor.pos));
+    EXPECT_THAT(eventExecutor.position(), Eq(executor.position()));
+}
+
+TEST_F(SegmentsExecutor2_Should, make_same_steps_if_more_steps_per_tick_are_enabled) {
+    segments = {
+        Sg(40, {0, 0}, {10, -3}),
+        Sg(30, {13, -4}),
+        Sg(60, {10, -3}, {-10, 7}),
+        Sg(90, {5, 0}, {5, -7}, {-12, 10}),
+        Sg(90, {-12, 15}, {0, 0}, {0, 0}),
+    };
+    process();
+
+    Mm multiStepMotor;
+    Executor multiStepExecutor{&multiStepMotor, &ticker};
+    multiStepExecutor.setMaxStepsPerTick(4);
+    multiStepExecutor.setTrajectory(segments);
+    multiStepExecutor.start();
+    while (multiStepExecutor.isRunning()) {
+        multiStepExecutor.tick();
+    }
+
+    EXPECT_THAT(multiStepMotor.data, ContainerEq(motor.data));
+}
+
+TEST_F(SegmentsExecutor2_Should, make_steps_of_fast_segments_in_pulse_trains) {
+    executor.setMaxStepsPerTick(4);
+    segments = {
+        Sg(20, {0, 0}, {30, -20}),
+        Sg(20, {60, -40}),
+        Sg(30, {20, -10}, {20, -10}, {-10, 5}),
+        Sg(40, {30, -20}, {0, 0}),
+    };
+    process();
+
+    EXPECT_THAT(motor.pos, Eq(Ai{150, -95}));
+    EXPECT_THAT(executor.position(), Eq(motor.pos));
+    auto maxSteps = 0;
+    for (size_t i = 1; i < motor.data.size(); ++i) {
+        for (size_t j = 0; j < 2; ++j) {
+            maxSteps = max(maxSteps, abs(motor.data[i][j] - motor.data[i - 1][j]));
+        }
+    }
+    EXPECT_THAT(maxSteps, Eq(3));
+
+    IntervalTickerMock intervalTicker;
+    Mm eventMotor;
+    SegmentsExecutor<Mm, IntervalTickerMock, AxTr<2>> eventExecutor{&eventMotor, &intervalTicker};
+    eventExecutor.setMaxStepsPerTick(4);
+    eventExecutor.setTickMode(TickMode::NextStep);
+    eventExecutor.setTrajectory(segments);
+    eventExecutor.start();
+    while (eventExecutor.isRunning()) {
+        eventExecutor.tickNextStep();
+    }
+    EXPECT_THAT(eventMotor.pos, Eq(motor.pos));
+}
+
+TEST_F(SegmentsExecutor2_Should, follow_tick_period_of_segments_and_skip_waits) {
+    auto slow = Sg(10, {5, -2});
+    slow.period = 4;
+    segments = {slow, Sg(1000), Sg(10, {5, 0})};
+
+    IntervalTickerMock intervalTicker;
+    SegmentsExecutor<Mm, IntervalTickerMock, AxTr<2>> periodicExecutor{&motor, &intervalTicker};
+    periodicExecutor.setTicksPerSecond(1000000);
+    periodicExecutor.setTrajectory(segments);
+    periodicExecutor.start();
+
+    // Tick index of every timer interrupt.
+    vector<int> ticks;
+    int tick = 0;
+    while (periodicExecutor.isRunning()) {
+        tick += intervalTicker.intervalUs;
+        ticks.push_back(tick);
+        periodicExecutor.tickPeriodic();
+    }
+
+    EXPECT_THAT(motor.pos, Eq(Ai{10, -2}));
+    EXPECT_THAT(periodicExecutor.position(), Eq(motor.pos));
+    // Ten interrupts of the slow segment, one of the wait, ten of the last segment and the stop.
+    ASSERT_THAT(ticks.size(), Eq(22u));
+    EXPECT_THAT(ticks[9], Eq(40));
+    EXPECT_THAT(ticks[10], Eq(44));
+    EXPECT_THAT(ticks[11], Eq(1044));
+    EXPECT_THAT(ticks.back(), Eq(1054));
+}
+
+TEST_F(SegmentsExecutor2_Should, scale_time_by_feed_override) {
+    segments = {Sg(20, {10, -4}), Sg(20, {-10, 4}, {4, 0})};
+    process();
+
+    // Twenty ticks of every segment and the stop.
+    for (auto ratioAndInterrupts : {make_pair(0.5f, 82), make_pair(0.7f, 59), make_pair(1.f, 41),
+                                    make_pair(2.f, 21)}) {
+        IntervalTickerMock intervalTicker;
+        Mm scaledMotor;
+        SegmentsExecutor<Mm, IntervalTickerMock, AxTr<2>> scaledExecutor{&scaledMotor,
+                                                                         &intervalTicker};
+        scaledExecutor.setFeedOverride(ratioAndInterrupts.first);
+        scaledExecutor.setTrajectory(segments);
+        scaledExecutor.start();
+        auto interrupts = 0;
+        while (scaledExecutor.isRunning()) {
+            scaledExecutor.tickPeriodic();
+            ++interrupts;
+        }
+        EXPECT_THAT(interrupts, Eq(ratioAndInterrupts.second));
+        EXPECT_THAT(scaledMotor.data, ContainerEq(motor.data));
+    }
+}
+
+TEST_F(SegmentsExecutor2_Should, change_feed_override_with_limited_rate) {
+    segments = {Sg(1000, {100, -50})};
+    IntervalTickerMock intervalTicker;
+    SegmentsExecutor<Mm, IntervalTickerMock, AxTr<2>> scaledExecutor{&motor, &intervalTicker};
+    scaledExecutor.setFeedOverrideRamp(0.01f);
+    scaledExecutor.setTrajectory(segments);
+    scaledExecutor.start();
+    auto run = [&](int interrupts) {
+        for (int k = 0; k < interrupts && scaledExecutor.isRunning(); ++k) {
+            scaledExecutor.tickPeriodic();
+        }
+    };
+
+    run(10);
+    scaledExecutor.setFeedOverride(0.5f);
+    EXPECT_THAT(scaledExecutor.currentFeedOverride(), FloatEq(1.f));
+    run(10);
+    EXPECT_THAT(scaledExecutor.currentFeedOverride(), FloatNear(0.9f, 1e-5f));
+    run(50);
+    EXPECT_THAT(scaledExecutor.currentFeedOverride(), FloatEq(0.5f));
+    // Ten ticks before the change, 37.5 in 50 interrupts of the ramp and 5 after it.
+    EXPECT_THAT(scaledExecutor.currentTick(), Eq(52));
+
+    run(2000);
+    EXPECT_FALSE(scaledExecutor.isRunning());
+    EXPECT_THAT(motor.pos, Eq(Ai{100, -50}));
+}
+
+TEST_F(SegmentsExecutor2_Should, scale_skipped_ticks_by_feed_override) {
+    segments = {Sg(100, {5, 0}), Sg(1000), Sg(10, {0, 3})};
+    auto run = [&](TickMode mode, float ratio, Mm &scaledMotor) {
+        IntervalTickerMock intervalTicker;
+        SegmentsExecutor<Mm, IntervalTickerMock, AxTr<2>> scaledExecutor{&scaledMotor,
+                                                                         &intervalTicker};
+        scaledExecutor.setTicksPerSecond(1000000);
+        scaledExecutor.setTickMode(mode);
+        scaledExecutor.setFeedOverride(ratio);
+        scaledExecutor.setTrajectory(segments);
+        scaledExecutor.start();
+        auto us = 0;
+        while (scaledExecutor.isRunning()) {
+            us += intervalTicker.intervalUs;
+            if (mode == TickMode::NextStep) {
+                scaledExecutor.tickNextStep();
+            } else {
+                scaledExecutor.tickPeriodic();
+            }
+        }
+        return us;
+    };
+
+    for (auto mode : {TickMode::Periodic, TickMode::NextStep}) {
+        Mm fastMotor;
+        Mm slowMotor;
+        auto const us = run(mode, 1.f, fastMotor);
+        EXPECT_THAT(run(mode, 0.5f, slowMotor), Eq(2 * us));
+        EXPECT_THAT(slowMotor.pos, Eq(Ai{5, 3}));
+        if (mode == TickMode::Periodic) {
+            EXPECT_THAT(slowMotor.data, ContainerEq(fastMotor.data));
+        }
+    }
+}
+
+TEST_F(SegmentsExecutor2_Should, hold_and_resume_without_losing_steps) {
+    segments = {
+        Sg(100, {0, 0}, {25, -10}),
+        Sg(100, {50, -20}),
+        Sg(100, {25, -10}, {0, 0}),
+    };
+    process();
+    auto const reference = motor.data;
+
+    for (auto mode : {TickMode::Periodic, TickMode::NextStep}) {
+        IntervalTickerMock intervalTicker;
+        Mm heldMotor;
+        SegmentsExecutor<Mm, IntervalTickerMock, AxTr<2>> heldExecutor{&heldMotor,
+                                                                       &intervalTicker};
+        heldExecutor.setTickMode(mode);
+        heldExecutor.setFeedOverrideRamp(1.f / 64);
+        heldExecutor.setTrajectory(segments);
+        heldExecutor.start();
+        auto interrupt = [&] {
+            if (mode == TickMode::NextStep) {
+                heldExecutor.tickNextStep();
+            } else {
+                heldExecutor.tickPeriodic();
+            }
+        };
+        while (heldExecutor.currentTick() < 120) {
+            interrupt();
+        }
+
+        heldExecutor.hold();
+        auto interrupts = 0;
+        while (!heldExecutor.isHeld() && heldExecutor.isRunning()) {
+            interrupt();
+            ++interrupts;
+        }
+        // Ratio of 1 is ramped to 0 in 64 ticks.
+        EXPECT_THAT(interrupts, Le(64));
+        EXPECT_THAT(heldExecutor.currentTick(), Lt(200));
+        auto const heldPos = heldMotor.pos;
+        auto const heldTick = heldExecutor.currentTick();
+        for (int k = 0; k < 1000; ++k) {
+            interrupt();
+        }
+        EXPECT_TRUE(heldExecutor.isRunning());
+        EXPECT_THAT(heldMotor.pos, Eq(heldPos));
+        EXPECT_THAT(heldExecutor.position(), Eq(heldPos));
+        EXPECT_THAT(heldExecutor.currentTick(), Eq(heldTick));
+
+        heldExecutor.resume();
+        while (heldExecutor.isRunning()) {
+            interrupt();
+        }
+        EXPECT_THAT(heldMotor.pos, Eq(Ai{100, -40}));
+        EXPECT_THAT(heldExecutor.position(), Eq(heldMotor.pos));
+        if (mode == TickMode::Periodic) {
+            EXPECT_THAT(heldMotor.data, ContainerEq(reference));
+        }
+    }
+}
+
+TEST_F(SegmentsExecutor2_Should, write_all_axes_at_once_if_motor_supports_it) {
+    segments.push_back(Sg(10, {5, -3}));
+    segments.push_back(Sg(10, {-2, 4}));
+    process();
+
+    GroupedMotorMock<2> groupedMotor;
+    SegmentsExecutor<GroupedMotorMock<2>, TickerMock, AxTr<2>> groupedExecutor{&groupedMotor,
+                                                                               &ticker};
+    groupedExecutor.setTrajectory(segments);
+    groupedExecutor.start();
+    while (groupedExecutor.isRunning()) {
+        groupedExecutor.tick();
+    }
+
+    EXPECT_THAT(groupedMotor.data, ContainerEq(motor.data));
+    // One write per tick with steps.
+    auto ticksWithSteps = 0;
+    auto prev = axZero<Ai>();
+    for (auto const &pos : motor.data) {
+        ticksWithSteps += pos != prev ? 1 : 0;
+        prev = pos;
+    }
+    EXPECT_THAT(groupedMotor.stepWrites, Eq(ticksWithSteps));
+    EXPECT_THAT(groupedMotor.clearWrites, Eq(ticksWithSteps));
+    // Initial write and change of both directions.
+    EXPECT_THAT(groupedMotor.dirWrites, Eq(3));
+}
+
+TEST_F(SegmentsExecutor2_Should, time_step_pulses_in_interrupts) {
+    segments.push_back(Sg(100, {10, -20}));
+    segments.push_back(Sg(100, {-10, 20}));
+    process();
+
+    PulseMotorMock<2> pulseMotor;
+    SegmentsExecutor<PulseMotorMock<2>, TickerMock, AxTr<2>> pulseExecutor{&pulseMotor, &ticker};
+    pulseExecutor.setStepTiming(2, 3);
+    pulseExecutor.setTrajectory(segments);
+    pulseExecutor.start();
+    while (pulseExecutor.isRunning()) {
+        pulseExecutor.tick();
+    }
+
+    // Steps are delayed by dir setup ticks.
+    ASSERT_THAT(pulseMotor.data.size(), Ge(motor.data.size() + 3));
+    for (size_t i = 0; i < motor.data.size(); ++i) {
+        EXPECT_THAT(pulseMotor.data[i + 3], Eq(motor.data[i])) << "at tick " << i;
+    }
+    EXPECT_THAT(pulseMotor.data.back(), Eq(motor.data.back()));
+    EXPECT_THAT(pulseExecutor.position(), Eq(executor.position()));
+
+    EXPECT_THAT(pulseMotor.pulseTicks, SizeIs(60));
+    EXPECT_THAT(pulseMotor.pulseTicks, Each(Eq(2)));
+    EXPECT_THAT(pulseMotor.setupTicks, SizeIs(60));
+    EXPECT_THAT(pulseMotor.setupTicks, Each(Ge(3)));
+    EXPECT_THAT(pulseMotor.level, Each(Eq(false)));
+}
+
+TEST_F(SegmentsExecutor2_Should, clear_pulses_and_restore_position_of_delayed_steps_on_stop) {
+    segments.push_back(Sg(100, {10, -20}));
+
+    PulseMotorMock<2> pulseMotor;
+    SegmentsExecutor<PulseMotorMock<2>, TickerMock, AxTr<2>> pulseExecutor{&pulseMotor, &ticker};
+    pulseExecutor.setStepTiming(2, 3);
+    pulseExecutor.setTrajectory(segments);
+    pulseExecutor.start();
+    for (int i = 0; i < 46; ++i) {
+        pulseExecutor.tick();
+    }
+    // Some steps are integrated, but not made yet.
+    ASSERT_THAT(pulseExecutor.position(), Ne(pulseMotor.pos));
+    ASSERT_THAT(pulseMotor.level, Contains(true));
+    pulseExecutor.stop();
+
+    EXPECT_THAT(pulseExecutor.position(), Eq(pulseMotor.pos));
+    EXPECT_THAT(pulseMotor.level, Each(Eq(false)));
+}
+
+TEST_F(SegmentsExecutor2_Should, make_same_steps_with_32_bit_accumulators) {
+    segments.push_back(Sg(16000, {0, 0}, {3000, -1000}));
+    segments.push_back(Sg(10000, {2000, -4000}));
+    segments.push_back(Sg(16384, {4000, -4000}, {-4000, 4000}));
+    segments.push_back(Sg(100));
+    segments.push_back(Sg(16383, {-3000, 1}, {0, 0}));
+    segments.push_back(Sg(512, {-80, 30}, {0, 85}, {80, -60}));
+    process();
+
+    using Sg32 = Segment<2, int32_t>;
+    Mm motor32;
+    SegmentsExecutor<Mm, TickerMock, AxTr<2>, 64, int32_t> executor32{&motor32, &ticker};
+    auto segments32 = vector<Sg32>();
+    for (auto const &sg : segments) {
+        segments32.push_back(Sg32(sg));
+    }
+    executor32.setTrajectory(segments32);
+    executor32.start();
+    while (executor32.isRunning()) {
+        executor32.tick();
+    }
+
+    EXPECT_THAT(motor32.data, ContainerEq(motor.data));
+    EXPECT_THAT(executor32.position(), Eq(executor.position()));
+}
+
+TEST_F(SegmentsExecutor2_Should, integrate_only_active_axes) {
+    segments.push_back(Sg(10, {5, 0}));
+    segments.push_back(Sg(10, {0, -5}));
+    segments.push_back(Sg(20, {0, 0}, {0, 0}));
+    segments.push_back(Sg(20, {2, 0}, {-2, 0}));
+    segments.push_back(Sg(5));
+    EXPECT_THAT(segments[0].axesMask, Eq(1u));
+    EXPECT_THAT(segments[1].axesMask, Eq(2u));
+    EXPECT_THAT(segments[2].axesMask, Eq(0u));
+    EXPECT_THAT(segments[3].axesMask, Eq(1u));
+    EXPECT_THAT(segments[4].axesMask, Eq(0u));
+    EXPECT_THAT(Sg(Af{0.f, 0.5f}).axesMask, Eq(2u));
+    process();
+
+    ASSERT_THAT(motor.data.size(), Eq(65u));
+    EXPECT_THAT(motor.data[9], Eq(Ai{5, 0}));
+    EXPECT_THAT(motor.data[19], Eq(Ai{5, -5}));
+    EXPECT_THAT(motor.data[39], Eq(Ai{5, -5}));
+    EXPECT_THAT(motor.data[49], Eq(Ai{6, -5}));
+    EXPECT_THAT(motor.data[64], Eq(Ai{5, -5}));
+}
+
 TEST_F(SegmentsExecutor2_Should, do_homing) {
     segments.push_back(Sg({0.5f, 0.2f}));
     executor.setPosition({10, 20});
@@ -354,4 +940,41 @@ TEST_F(SegmentsExecutor2_Should, do_homing) {
     EXPECT_THAT(motor.data, ContainerEq(expected));
     EXPECT_THAT(executor.position(), Eq(Ai{0, 0}));
 }
+
+TEST_F(SegmentsExecutor2_Should, home_fast_then_back_off_and_home_slowly) {
+    // Switches are hit at zero.
+    auto home = [&](vector<Sg> const &homing) {
+        Mm homingMotor;
+        SegmentsExecutor<Mm, TickerMock, AxTr<2>> homingExecutor{&homingMotor, &ticker};
+        homingMotor.setPosition({500, 300});
+        homingExecutor.setPosition({500, 300});
+        homingExecutor.setTrajectory(homing);
+        homingExecutor.start();
+        auto ticks = 0;
+        auto overshoot = axZero<Ai>();
+        while (homingExecutor.isRunning()) {
+            homingExecutor.tick();
+            ++ticks;
+            for (int i = 0; i < 2; ++i) {
+                homingMotor.isHit[i] = homingMotor.pos[i] <= 0;
+                overshoot[i] = min(overshoot[i], homingMotor.pos[i]);
+            }
+        }
+        EXPECT_THAT(homingMotor.pos, Eq(Ai{0, 0}));
+        EXPECT_THAT(homingExecutor.position(), Eq(Ai{0, 0}));
+        return make_pair(ticks, overshoot);
+    };
+
+    auto const slow = home({Sg(Af{0.05f, 0.02f})});
+    auto const fast = home({
+        Sg(Af{0.5f, 0.2f}, Af{0.01f, 0.001f}),
+        Sg(80, {30, 30}),
+        Sg(Af{0.05f, 0.02f}),
+    });
+
+    EXPECT_THAT(slow.second, Eq(Ai{0, 0}));
+    // Stopping distances v^2 / 2a are 12.5 and 20 steps.
+    EXPECT_THAT(fast.second, Eq(Ai{-13, -20}));
+    EXPECT_THAT(fast.first * 4, Lt(slow.first));
+}
 }
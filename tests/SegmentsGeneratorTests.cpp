@@ -3,6 +3,7 @@
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
+#include "../include/sc/PackedSegments.h"
 #include "../include/sc/TrajectoryToSegmentsConverter.h"
 
 using namespace StepperControl;
@@ -207,4 +208,255 @@ TEST_F(TrajectoryToSegmentsConverter_Should, generate_short_segments) {
     };
     ASSERT_THAT(segments, ContainerEq(expected));
 }
-}
\ No newline at end of file
+
+TEST_F(TrajectoryToSegmentsConverter_Should, generate_faster_segments_with_more_steps_per_tick) {
+    path.push_back({0, 0});
+    path.push_back({300, -100});
+    gen.setDurations({100});
+    gen.setBlendDurations({40, 40});
+    gen.setMaxStepsPerTick(4);
+
+    update();
+
+    vector<Sg> expected{
+        /**/ Sg(40, {0, 0}, {60, -20}),
+        /**/ Sg(60, {180, -60}),
+        /**/ Sg(40, {60, -20}, {0, 0}),
+    };
+    ASSERT_THAT(segments, ContainerEq(expected));
+}
+
+TEST_F(TrajectoryToSegmentsConverter_Should, generate_slow_segments_with_coarse_tick_period) {
+    path.push_back({0, 0});
+    path.push_back({100, 0});
+    path.push_back({300, -10});
+    gen.setDurations({10000, 400});
+    gen.setBlendDurations({0, 0, 0});
+    gen.setMaxTickPeriod(64);
+
+    update();
+
+    // The first segment needs at least 200 ticks, so 10000 ticks are 313 ticks of 32.
+    auto slow = Sg(313, {100, 0});
+    slow.period = 32;
+    vector<Sg> expected{
+        /**/ slow,
+        /**/ Sg(400, {200, -10}),
+    };
+    ASSERT_THAT(segments, ContainerEq(expected));
+}
+
+TEST_F(TrajectoryToSegmentsConverter_Should, split_long_segments_for_32_bit_accumulators) {
+    using Sg32 = Segment<AxesSize, int32_t>;
+
+    path.push_back({0, 0});
+    path.push_back({20000, -10000});
+    path.push_back({0, 30000});
+    gen.setDurations({100000, 300000000});
+    gen.setBlendDurations({40000, 40000, 40000});
+    update();
+
+    auto gen32 = TrajectoryToSegmentsConverter<AxesSize, int32_t>(path);
+    gen32.setDurations({100000, 300000000});
+    gen32.setBlendDurations({40000, 40000, 40000});
+    vector<Sg32> segments32;
+    gen32.appendTo(segments32);
+
+    ASSERT_THAT(segments32.size(), Gt(segments.size()));
+
+    // Linear segment has velocity 2 * dx, parabolic one starts with 2 * twiceDt * dx1 + halfA
+    // and accelerates with 2 * halfA.
+    auto displacement = [](int64_t dt, int64_t velocity, int64_t acceleration, int64_t den) {
+        if (den == 2 * dt) {
+            return velocity / 2;
+        }
+        auto dx1 = (velocity - acceleration / 2) / (2 * dt);
+        return 2 * dx1 + acceleration / 2;
+    };
+    auto duration = int64_t{};
+    auto duration32 = int64_t{};
+    auto dx = axZero<Ai>();
+    for (auto const &sg : segments) {
+        duration += sg.dt;
+    }
+    for (auto const &sg : segments32) {
+        EXPECT_THAT(sg.denominator, Le(1 << 28));
+        duration32 += sg.dt;
+        for (size_t j = 0; j < AxesSize; ++j) {
+            dx[j] += static_cast<int32_t>(
+                displacement(sg.dt, sg.velocity[j], sg.acceleration[j], sg.denominator));
+        }
+    }
+    EXPECT_THAT(dx, Eq(path.back() - path.front()));
+    EXPECT_THAT(duration32, Ge(duration));
+    EXPECT_THAT(duration32, Le(duration + 4 * static_cast<int64_t>(segments32.size())));
+}
+
+TEST_F(TrajectoryToSegmentsConverter_Should, split_segments_longer_than_int32_ticks) {
+    path.push_back({0, 0});
+    path.push_back({1000000, -500000});
+    path.push_back({0, 0});
+    gen.setDurations({5e9f, 5e9f});
+    gen.setBlendDurations({3e9f, 3e9f, 3e9f});
+    update();
+
+    ASSERT_THAT(segments.size(), Gt(7u));
+
+    auto duration = int64_t{};
+    auto dx = axZero<Ai>();
+    for (auto const &sg : segments) {
+        ASSERT_THAT(sg.dt, Gt(0));
+        duration += sg.dt;
+        for (size_t j = 0; j < AxesSize; ++j) {
+            if (sg.denominator == 2 * static_cast<int64_t>(sg.dt)) {
+                dx[j] += static_cast<int32_t>(sg.velocity[j] / 2);
+                continue;
+            }
+            // Parabolic segment starts with 2 * twiceDt * dx1 + halfA, accelerates with 2 * halfA.
+            auto halfA = sg.acceleration[j] / 2;
+            dx[j] += static_cast<int32_t>(2 * (sg.velocity[j] - halfA) / (2 * sg.dt) + halfA);
+        }
+    }
+    EXPECT_THAT(dx, Eq(Ai{0, 0}));
+    EXPECT_THAT(duration, Ge(int64_t{13000000000}));
+    EXPECT_THAT(duration, Le(int64_t{13000000000} + 4 * static_cast<int64_t>(segments.size())));
+}
+
+TEST_F(TrajectoryToSegmentsConverter_Should, generate_the_same_segments_on_several_threads) {
+    auto durations = vector<float>();
+    auto blendDurations = vector<float>{20};
+    path.push_back({0, 0});
+    for (int i = 1; i <= 20; ++i) {
+        path.push_back(Ai{i * 10, (i % 3) * 7});
+        durations.push_back(50.5f);
+        blendDurations.push_back(i % 2 ? 20.f : 13.f);
+    }
+    gen.setPreviousLine(Af{0.2f, 0}, 30);
+    gen.setInitialVelocity(Af{0.1f, 0});
+    gen.setStopAtEnd(false);
+    gen.setDurations(durations);
+    gen.setBlendDurations(blendDurations);
+    gen.appendTo(segments);
+
+    for (size_t threads : {1, 2, 3, 7, 100}) {
+        auto parallel = vector<Sg>();
+        gen.appendTo(parallel, threads);
+        EXPECT_THAT(parallel, ContainerEq(segments)) << threads << " threads";
+
+        auto packed = TPackedSgs<AxesSize>();
+        gen.appendTo(packed, threads);
+        EXPECT_THAT(vector<Sg>(packed.begin(), packed.end()), ContainerEq(segments));
+    }
+}
+
+TEST_F(TrajectoryToSegmentsConverter_Should, generate_jerk_limited_blend_of_two_cubic_segments) {
+    path.push_back({0, 0});
+    path.push_back({20, 0});
+    path.push_back({0, 0});
+    gen.setDurations({40, 40});
+    gen.setBlendDurations({0, 40, 0});
+    gen.setJerkLimitedBlends(true);
+
+    update();
+
+    vector<Sg> expected{
+        /**/ Sg(20, {10, 0}),
+        /**/ Sg(20, {3, 0}, {3, 0}, {1, 0}),
+        /**/ Sg(20, {-1, 0}, {-3, 0}, {-3, 0}),
+        /**/ Sg(20, {-10, 0}),
+    };
+    ASSERT_THAT(segments, ContainerEq(expected));
+}
+
+TEST_F(TrajectoryToSegmentsConverter_Should,
+       split_long_jerk_limited_blends_for_32_bit_accumulators) {
+    using Sg32 = Segment<AxesSize, int32_t>;
+
+    path.push_back({0, 0});
+    path.push_back({20000, -10000});
+    path.push_back({0, 30000});
+    auto gen32 = TrajectoryToSegmentsConverter<AxesSize, int32_t>(path);
+    gen32.setDurations({100000, 300000});
+    gen32.setBlendDurations({40000, 40000, 40000});
+    gen32.setJerkLimitedBlends(true);
+    vector<Sg32> segments32;
+    gen32.appendTo(segments32);
+
+    // Position multiplied by denominator is c1 * t + c2 * t^2 + c3 * t^3 for cubic segment.
+    auto displacement = [](Sg32 const &sg, size_t j) -> int64_t {
+        int64_t dt = sg.dt;
+        if (!sg.isCubic()) {
+            EXPECT_THAT(sg.acceleration[j], Eq(0));
+            return sg.velocity[j] / 2;
+        }
+        int64_t c3 = sg.jerk[j] / 6;
+        int64_t c2 = (sg.acceleration[j] - sg.jerk[j]) / 2;
+        int64_t c1 = sg.velocity[j] - c2 - c3;
+        return (c1 * dt + c2 * dt * dt + c3 * dt * dt * dt) / (dt * dt * dt);
+    };
+    auto dx = axZero<Ai>();
+    size_t cubic = 0;
+    for (auto const &sg : segments32) {
+        if (sg.isCubic()) {
+            EXPECT_THAT(sg.dt, Le(Sg32::maxThriceDt));
+            ++cubic;
+        }
+        for (size_t j = 0; j < AxesSize; ++j) {
+            dx[j] += static_cast<int32_t>(displacement(sg, j));
+        }
+    }
+    EXPECT_THAT(cubic, Gt(3 * 2 * 40000u / Sg32::maxThriceDt));
+    EXPECT_THAT(dx, Eq(path.back() - path.front()));
+}
+
+TEST_F(TrajectoryToSegmentsConverter_Should,
+       keep_velocity_and_acceleration_at_split_points_of_jerk_limited_blends) {
+    using Sg32 = Segment<AxesSize, int32_t>;
+
+    path.push_back({0, 0});
+    path.push_back({20000, -10000});
+    path.push_back({0, 30000});
+    auto gen32 = TrajectoryToSegmentsConverter<AxesSize, int32_t>(path);
+    gen32.setDurations({100000, 300000});
+    gen32.setBlendDurations({0, 40000, 0});
+    gen32.setJerkLimitedBlends(true);
+    vector<Sg32> segments32;
+    gen32.appendTo(segments32);
+
+    // Control polygon of cubic segment from its coefficients, see Segment.
+    auto polygon = [](Sg32 const &sg, size_t j) {
+        int64_t T = sg.dt;
+        int64_t c3 = sg.jerk[j] / 6;
+        int64_t c2 = (sg.acceleration[j] - sg.jerk[j]) / 2;
+        int64_t c1 = sg.velocity[j] - c2 - c3;
+        auto dx1 = c1 / (3 * T * T);
+        auto dx2 = dx1 + c2 / (3 * T);
+        return array<int64_t, 3>{{dx1, dx2, c3 + 2 * dx2 - dx1}};
+    };
+    auto cubic = vector<Sg32>();
+    for (auto const &sg : segments32) {
+        if (sg.isCubic()) {
+            cubic.push_back(sg);
+        }
+    }
+    // Both halves of the blend are split into the same number of pieces.
+    ASSERT_THAT(cubic.size() % 2, Eq(0u));
+    auto const pieces = cubic.size() / 2;
+    ASSERT_THAT(pieces, Gt(1u));
+
+    for (size_t i = 0; i + 1 < cubic.size(); ++i) {
+        if (i + 1 == pieces) {
+            // Halves of the blend.
+            continue;
+        }
+        EXPECT_THAT(cubic[i + 1].dt, Eq(cubic[i].dt));
+        for (size_t j = 0; j < AxesSize; ++j) {
+            auto const end = polygon(cubic[i], j);
+            auto const start = polygon(cubic[i + 1], j);
+            // Tangents and curvatures of control polygons match.
+            EXPECT_THAT(start[0], Eq(end[2])) << i;
+            EXPECT_THAT(start[1] - start[0], Eq(end[2] - end[1])) << i;
+        }
+    }
+}
+}
@@ -3,6 +3,7 @@
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
+#include "../include/sc/PathToTimeOptimalTrajectoryConverter.h"
 #include "../include/sc/PathToTrajectoryConverter.h"
 
 using namespace StepperControl;
@@ -117,6 +118,57 @@ TEST_F(PathToTrajectoryConverter_Should, not_change_first_or_last_points) {
     EXPECT_THAT(path, ContainerEq(expected));
 }
 
+TEST_F(PathToTrajectoryConverter_Should, merge_chain_of_close_points) {
+    path.push_back({0, 0});
+    path.push_back({50, 0});
+    path.push_back({52, 0});
+    path.push_back({54, 0});
+    path.push_back({56, 0});
+    path.push_back({100, 0});
+
+    gen.removeCloseWaypoints({5, 5});
+
+    // 50 and 52 are merged into 51, then 51 and 54 into 52 and 52 and 56 into 54.
+    std::vector<Ai> expected{
+        {0, 0}, {54, 0}, {100, 0},
+    };
+    EXPECT_THAT(path, ContainerEq(expected));
+}
+
+TEST_F(PathToTrajectoryConverter_Should, keep_close_first_and_last_points) {
+    path.push_back({0, 0});
+    path.push_back({1, -1});
+
+    gen.removeCloseWaypoints({10, 5});
+
+    std::vector<Ai> expected{
+        {0, 0}, {1, -1},
+    };
+    EXPECT_THAT(path, ContainerEq(expected));
+}
+
+TEST_F(PathToTrajectoryConverter_Should, leave_no_close_points_in_random_paths) {
+    srand(7);
+    for (int n = 0; n < 200; ++n) {
+        path.assign(1, Ai{0, 0});
+        for (int i = 0; i < 40; ++i) {
+            path.push_back(path.back() + Ai{rand() % 9 - 4, rand() % 9 - 4});
+        }
+        auto const first = path.front();
+        auto const last = path.back();
+
+        gen.removeCloseWaypoints({5, 5});
+
+        ASSERT_THAT(path.size(), Ge(2u));
+        EXPECT_THAT(path.front(), Eq(first));
+        EXPECT_THAT(path.back(), Eq(last));
+        // Only the first and last way-points can be close.
+        for (size_t i = 1; path.size() > 2 && i < path.size(); ++i) {
+            EXPECT_FALSE(all(le(axAbs(path[i] - path[i - 1]), Ai{5, 5}))) << "at " << i;
+        }
+    }
+}
+
 TEST_F(PathToTrajectoryConverter_Should, corner_case_1) {
     double vMax = 0.5f, aMax = 0.003f;
     int x = 40;
@@ -172,4 +224,203 @@ TEST_F(PathToTrajectoryConverter_Should, corner_case_2) {
     EXPECT_THAT(gen.blendDurations(),
                 ElementsAre(FloatEq(static_cast<float>(tb)), FloatEq(static_cast<float>(tb))));
 }
+
+TEST_F(PathToTrajectoryConverter_Should, continue_straight_motion_without_blend) {
+    path.push_back({0, 0});
+    path.push_back({1000, 0});
+    gen.setInitialVelocity({20, 0}, 2);
+
+    update();
+
+    EXPECT_THAT(gen.initialVelocity(), Eq(Af{20, 0}));
+    EXPECT_THAT(gen.velocities(), ElementsAre(Af{20, 0}));
+    EXPECT_THAT(gen.blendDurations(), ElementsAre(0.f, 2.f));
+}
+
+TEST_F(PathToTrajectoryConverter_Should, start_from_rest_after_reversal) {
+    path.push_back({0, 0});
+    path.push_back({-1000, 0});
+    gen.setInitialVelocity({20, 0}, 2);
+
+    update();
+
+    EXPECT_THAT(gen.initialVelocity(), Eq(Af{0, 0}));
+    EXPECT_THAT(gen.blendDurations(), ElementsAre(2.f, 2.f));
+}
+
+TEST_F(PathToTrajectoryConverter_Should, blend_segments_with_different_limits_without_stop) {
+    path.push_back({0, 0});
+    path.push_back({1000, 0});
+    path.push_back({2000, 0});
+    gen.setSegmentLimits({{20, 20}, {10, 10}}, {{10, 10}, {4, 4}});
+
+    update();
+
+    EXPECT_THAT(gen.velocities(), ElementsAre(Af{20, 0}, Af{10, 0}));
+    EXPECT_THAT(gen.durations(), ElementsAre(50.f, 100.f));
+    // Blend between segments is limited by the lower acceleration.
+    EXPECT_THAT(gen.accelerations(), ElementsAre(Af{10, 0}, Af{-4, 0}, Af{-4, 0}));
+    EXPECT_THAT(gen.blendDurations(), ElementsAre(2.f, 2.5f, 2.5f));
+}
+
+TEST_F(PathToTrajectoryConverter_Should, start_from_rest_if_stop_blend_needs_lower_acceleration) {
+    path.push_back({0, 0});
+    path.push_back({2000, 0});
+    path.push_back({4000, 0});
+    // Previous line was truncated for a stop blend with its own acceleration.
+    gen.setMaxVelocity({0.4f, 0.4f});
+    gen.setMaxAcceleration({0.01f, 0.01f});
+    gen.setInitialVelocity({0.4f, 0}, 40);
+    gen.setSegmentLimits({{0.1f, 0.1f}, {0.1f, 0.1f}}, {{0.001f, 0.001f}, {0.001f, 0.001f}});
+
+    update();
+
+    // Slowing down to 0.1 would take 300 ticks.
+    EXPECT_THAT(gen.initialVelocity(), Eq(Af{0, 0}));
+    EXPECT_THAT(gen.velocities(), ElementsAre(Af{0.1f, 0}, Af{0.1f, 0}));
+    EXPECT_THAT(gen.blendDurations().front(), FloatEq(100.f));
+}
+
+struct PathToTimeOptimalTrajectoryConverter_Should : Test {
+    using TrajGen = PathToTimeOptimalTrajectoryConverter<AxesSize>;
+    std::vector<Ai> path;
+    TrajGen gen{path};
+
+    PathToTimeOptimalTrajectoryConverter_Should() {
+        gen.setMaxAcceleration({10, 10});
+        gen.setMaxVelocity({20, 20});
+    }
+
+    void update() { gen.update(); }
+
+    // Every blend takes at most half of the neighboring segments with a tick left for rounding.
+    void expectBlendsFit() {
+        auto const &Dts = gen.durations();
+        auto const &tbs = gen.blendDurations();
+        for (size_t i = 0; i < tbs.size(); ++i) {
+            if (i > 0) {
+                EXPECT_THAT(tbs[i] + 1, Le(Dts[i - 1] * 1.0001f)) << i;
+            }
+            if (i < Dts.size()) {
+                EXPECT_THAT(tbs[i] + 1, Le(Dts[i] * 1.0001f)) << i;
+            }
+        }
+    }
+};
+
+TEST_F(PathToTimeOptimalTrajectoryConverter_Should, get_trajectory_for_two_axes_and_two_points) {
+    path.push_back({0, 0});
+    path.push_back({100, 200});
+
+    update();
+
+    EXPECT_THAT(gen.velocities(), ElementsAre(Af{10, 20}));
+    EXPECT_THAT(gen.durations(), ElementsAre(10.f));
+    EXPECT_THAT(gen.accelerations(), ElementsAre(Af{5, 10}, Af{-5, -10}));
+    EXPECT_THAT(gen.blendDurations(), ElementsAre(2.f, 2.f));
+}
+
+TEST_F(PathToTimeOptimalTrajectoryConverter_Should, slow_down_short_moves) {
+    path.push_back({0, 0});
+    path.push_back({100, 200});
+    gen.setMaxVelocity(Af{50, 50});
+    gen.setMaxAcceleration(Af{1, 2});
+
+    update();
+
+    // Speed s solves 100 * s + 1 = 1 / s.
+    auto s = (std::sqrt(401.f) - 1) / 200;
+    EXPECT_THAT(gen.velocities()[0], Pointwise(FloatNear(1e-3f), Af{100 * s, 200 * s}));
+    EXPECT_THAT(gen.durations(), ElementsAre(FloatNear(1 / s, 1e-3f)));
+    EXPECT_THAT(gen.blendDurations(),
+                ElementsAre(FloatNear(100 * s, 1e-3f), FloatNear(100 * s, 1e-3f)));
+}
+
+TEST_F(PathToTimeOptimalTrajectoryConverter_Should, slow_down_only_segments_next_to_short_one) {
+    path.push_back({0, 0});
+    path.push_back({1000, 0});
+    path.push_back({1000, 20});
+    path.push_back({2000, 20});
+
+    update();
+
+    expectBlendsFit();
+    EXPECT_THAT(gen.velocities()[0], Eq(Af{20, 0}));
+    EXPECT_THAT(gen.velocities()[2], Eq(Af{20, 0}));
+    EXPECT_THAT(gen.velocities()[1][1], Lt(20.f));
+
+    auto heuristic = PathToTrajectoryConverter<AxesSize>(path);
+    heuristic.setMaxAcceleration({10, 10});
+    heuristic.setMaxVelocity({20, 20});
+    heuristic.update();
+    EXPECT_THAT(heuristic.velocities()[0][0], Lt(20.f));
+}
+
+TEST_F(PathToTimeOptimalTrajectoryConverter_Should, fit_blends_of_dense_path) {
+    for (int i = 0; i <= 50; ++i) {
+        path.push_back({i * 30, (i % 3) * 25});
+    }
+
+    update();
+
+    expectBlendsFit();
+    EXPECT_THAT(gen.blendDurations().front(), Gt(0.f));
+    EXPECT_THAT(gen.blendDurations().back(), Gt(0.f));
+}
+
+TEST_F(PathToTimeOptimalTrajectoryConverter_Should,
+       blend_segments_with_different_limits_without_stop) {
+    path.push_back({0, 0});
+    path.push_back({1000, 0});
+    path.push_back({2000, 0});
+    gen.setSegmentLimits({{20, 20}, {10, 10}}, {{10, 10}, {4, 4}});
+
+    update();
+
+    expectBlendsFit();
+    EXPECT_THAT(gen.velocities(), ElementsAre(Af{20, 0}, Af{10, 0}));
+    EXPECT_THAT(gen.accelerations(), ElementsAre(Af{10, 0}, Af{-4, 0}, Af{-4, 0}));
+    EXPECT_THAT(gen.blendDurations(), ElementsAre(2.f, 2.5f, 2.5f));
+}
+
+TEST_F(PathToTimeOptimalTrajectoryConverter_Should, continue_straight_motion_without_blend) {
+    path.push_back({0, 0});
+    path.push_back({1000, 0});
+    gen.setInitialVelocity({20, 0}, 2);
+
+    update();
+
+    EXPECT_THAT(gen.initialVelocity(), Eq(Af{20, 0}));
+    EXPECT_THAT(gen.velocities(), ElementsAre(Af{20, 0}));
+    EXPECT_THAT(gen.blendDurations(), ElementsAre(0.f, 2.f));
+}
+
+TEST_F(PathToTimeOptimalTrajectoryConverter_Should, start_from_rest_after_reversal) {
+    path.push_back({0, 0});
+    path.push_back({-1000, 0});
+    gen.setInitialVelocity({20, 0}, 2);
+
+    update();
+
+    EXPECT_THAT(gen.initialVelocity(), Eq(Af{0, 0}));
+    EXPECT_THAT(gen.blendDurations(), ElementsAre(2.f, 2.f));
+}
+
+TEST_F(PathToTimeOptimalTrajectoryConverter_Should,
+       start_from_rest_if_stop_blend_needs_lower_acceleration) {
+    path.push_back({0, 0});
+    path.push_back({2000, 0});
+    path.push_back({4000, 0});
+    gen.setMaxVelocity({0.4f, 0.4f});
+    gen.setMaxAcceleration({0.01f, 0.01f});
+    gen.setInitialVelocity({0.4f, 0}, 40);
+    gen.setSegmentLimits({{0.1f, 0.1f}, {0.1f, 0.1f}}, {{0.001f, 0.001f}, {0.001f, 0.001f}});
+
+    update();
+
+    expectBlendsFit();
+    EXPECT_THAT(gen.initialVelocity(), Eq(Af{0, 0}));
+    EXPECT_THAT(gen.velocities().front()[0], FloatEq(0.1f));
+    EXPECT_THAT(gen.blendDurations().front(), FloatEq(100.f));
+}
 }
\ No newline at end of file